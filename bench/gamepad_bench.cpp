@@ -0,0 +1,1513 @@
+/* Copyright (C) Nemirtingas
+ * This file is part of gamepad.
+ *
+ * gamepad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * gamepad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gamepad.  If not, see <https://www.gnu.org/licenses/>
+ */
+
+// The benchmarks need the internal functions, so build the library sources right here (like gamepad.mm does).
+#include "gamepad.cpp"
+#include "gamepad_processing.cpp"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+
+using bench_clock = std::chrono::steady_clock;
+
+// Gamepads of the benches that don't measure the slot count, whatever GAMEPAD_MAX_GAMEPADS is.
+static constexpr uint32_t bench_gamepad_count = 16;
+static_assert(bench_gamepad_count <= gamepad::max_connected_gamepads, "The benches need 16 slots.");
+
+static double elapsed_us(bench_clock::time_point start)
+{
+    return std::chrono::duration<double, std::micro>(bench_clock::now() - start).count();
+}
+
+static double elapsed_ns(bench_clock::time_point start)
+{
+    return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Syscall shim
+//
+// Fake gamepads are FIFOs: the library opens and reads them like evdev nodes,
+// the ioctls it sends them are answered here. Every call made by this executable
+// goes through these definitions, so they are counted as well.
+
+static std::atomic<uint64_t> s_read_calls(0);
+static std::atomic<uint64_t> s_write_calls(0);
+static std::atomic<uint64_t> s_ioctl_calls(0);
+static std::atomic<uint64_t> s_epoll_wait_calls(0);
+
+// What EVIOCGKEY and EVIOCGABS report as the current device state.
+static std::atomic<bool> s_fake_btn_a_down(false);
+static std::atomic<int32_t> s_fake_abs_x(0);
+
+static uint64_t syscall_count()
+{
+    return s_read_calls + s_write_calls + s_ioctl_calls + s_epoll_wait_calls;
+}
+
+static bool is_fake_gamepad(int fd)
+{
+    struct stat fd_stat;
+    return syscall(SYS_fstat, fd, &fd_stat) == 0 && S_ISFIFO(fd_stat.st_mode);
+}
+
+static void set_bits(void* buffer, size_t buffer_size, std::initializer_list<int> bits)
+{
+    unsigned char* bytes = static_cast<unsigned char*>(buffer);
+
+    memset(buffer, 0, buffer_size);
+    for (int bit : bits)
+    {
+        if (ucharIndexForBit(bit) < buffer_size)
+            bytes[ucharIndexForBit(bit)] |= ucharValueForBit(bit);
+    }
+}
+
+// Answers like an xpad wired controller.
+static int fake_gamepad_ioctl(unsigned long request, void* arg)
+{
+    if (_IOC_TYPE(request) != 'E')
+    {
+        errno = ENOTTY;
+        return -1;
+    }
+
+    const unsigned int nr = _IOC_NR(request);
+    const unsigned int size = _IOC_SIZE(request);
+
+    if (request == EVIOCGID)
+    {
+        struct input_id* id = static_cast<struct input_id*>(arg);
+        id->bustype = BUS_USB;
+        id->vendor = 0x045e;
+        id->product = 0x028e;
+        id->version = 0x0110;
+        return 0;
+    }
+
+    if (request == EVIOCSFF)
+    {
+        struct ff_effect* effect = static_cast<struct ff_effect*>(arg);
+        if (effect->id == -1)
+            effect->id = 0;
+        return 0;
+    }
+
+    if (request == EVIOCRMFF)
+        return 0;
+
+    // The events written by the benchmarks are stamped with the monotonic clock.
+    if (request == EVIOCSCLOCKID)
+        return 0;
+
+    if (nr == 0x18 && _IOC_DIR(request) == _IOC_READ)
+    {// EVIOCGKEY
+        if (s_fake_btn_a_down)
+            set_bits(arg, size, { BTN_A });
+        else
+            set_bits(arg, size, {});
+        return static_cast<int>(size);
+    }
+
+    if (nr >= 0x20 && nr < 0x20 + EV_CNT && _IOC_DIR(request) == _IOC_READ)
+    {// EVIOCGBIT
+        switch (nr - 0x20)
+        {
+            case 0     : set_bits(arg, size, { EV_SYN, EV_KEY, EV_ABS, EV_FF }); break;
+            case EV_KEY: set_bits(arg, size, { BTN_A, BTN_B, BTN_X, BTN_Y, BTN_TL, BTN_TR, BTN_SELECT, BTN_START, BTN_MODE, BTN_THUMBL, BTN_THUMBR }); break;
+            case EV_ABS: set_bits(arg, size, { ABS_X, ABS_Y, ABS_Z, ABS_RX, ABS_RY, ABS_RZ, ABS_HAT0X, ABS_HAT0Y }); break;
+            case EV_FF : set_bits(arg, size, { FF_RUMBLE }); break;
+            default    : set_bits(arg, size, {}); break;
+        }
+        return static_cast<int>(size);
+    }
+
+    if (nr >= 0x40 && nr < 0x40 + ABS_CNT)
+    {// EVIOCGABS
+        struct input_absinfo* absinfo = static_cast<struct input_absinfo*>(arg);
+        memset(absinfo, 0, sizeof(*absinfo));
+        switch (nr - 0x40)
+        {
+            case ABS_Z: case ABS_RZ:
+                absinfo->minimum = 0;
+                absinfo->maximum = 255;
+                break;
+
+            case ABS_HAT0X: case ABS_HAT0Y:
+                absinfo->minimum = -1;
+                absinfo->maximum = 1;
+                break;
+
+            default:
+                absinfo->minimum = -32768;
+                absinfo->maximum = 32767;
+                absinfo->fuzz = 16;
+                absinfo->flat = 128;
+        }
+        if (nr - 0x40 == ABS_X)
+            absinfo->value = s_fake_abs_x;
+        return 0;
+    }
+
+    errno = ENOTTY;
+    return -1;
+}
+
+extern "C" int ioctl(int fd, unsigned long request, ...)
+{
+    va_list args;
+    va_start(args, request);
+    void* arg = va_arg(args, void*);
+    va_end(args);
+
+    ++s_ioctl_calls;
+
+    if (is_fake_gamepad(fd))
+        return fake_gamepad_ioctl(request, arg);
+
+    return static_cast<int>(syscall(SYS_ioctl, fd, request, arg));
+}
+
+extern "C" ssize_t read(int fd, void* buffer, size_t size)
+{
+    ++s_read_calls;
+    return syscall(SYS_read, fd, buffer, size);
+}
+
+extern "C" ssize_t write(int fd, const void* buffer, size_t size)
+{
+    ++s_write_calls;
+
+    // Don't loop the force feedback events back into the fake gamepad stream.
+    if (size == sizeof(struct input_event) && static_cast<const struct input_event*>(buffer)->type == EV_FF && is_fake_gamepad(fd))
+        return static_cast<ssize_t>(size);
+
+    return syscall(SYS_write, fd, buffer, size);
+}
+
+extern "C" int epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout)
+{
+    ++s_epoll_wait_calls;
+    return static_cast<int>(syscall(SYS_epoll_pwait, epfd, events, maxevents, timeout, nullptr, 0));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fake input tree
+//
+// <root>/dev/eventN are the device nodes, <root>/sys/eventN/device/capabilities their sysfs capabilities.
+// Non-gamepad nodes are empty regular files with keyboard capabilities, gamepads are FIFOs.
+
+struct fake_input_tree_t
+{
+    std::string root;
+    uint32_t node_count;
+    std::vector<int> gamepad_fds;
+};
+
+static void write_file(std::string const& path, const char* content)
+{
+    FILE* f = fopen(path.c_str(), "w");
+    if (f == nullptr)
+    {
+        perror(path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    fputs(content, f);
+    fclose(f);
+}
+
+static void make_dir(std::string const& path)
+{
+    if (mkdir(path.c_str(), 0755) == -1 && errno != EEXIST)
+    {
+        perror(path.c_str());
+        exit(EXIT_FAILURE);
+    }
+}
+
+static std::string make_fake_node(fake_input_tree_t& tree, const char* ev, const char* abs)
+{
+    std::string name = "event" + std::to_string(tree.node_count++);
+    std::string sys_path = tree.root + "/sys/" + name;
+
+    make_dir(sys_path);
+    make_dir(sys_path + "/device");
+    make_dir(sys_path + "/device/capabilities");
+    write_file(sys_path + "/device/capabilities/ev", ev);
+    write_file(sys_path + "/device/capabilities/abs", abs);
+
+    return tree.root + "/dev/" + name;
+}
+
+static fake_input_tree_t make_fake_input_tree(uint32_t non_gamepad_count)
+{
+    char root_template[] = "/tmp/gamepad_bench_XXXXXX";
+    if (mkdtemp(root_template) == nullptr)
+    {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+
+    fake_input_tree_t tree;
+    tree.root = root_template;
+    tree.node_count = 0;
+    make_dir(tree.root + "/dev");
+    make_dir(tree.root + "/sys");
+
+    for (uint32_t i = 0; i < non_gamepad_count; ++i)
+        write_file(make_fake_node(tree, "120013\n", "0\n"), "");
+
+    return tree;
+}
+
+// Returns the write end of the gamepad event stream.
+static int add_fake_gamepad(fake_input_tree_t& tree)
+{
+    std::string device_path = make_fake_node(tree, "20000b\n", "3003f\n");
+    if (mkfifo(device_path.c_str(), 0666) == -1)
+    {
+        perror(device_path.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = open(device_path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1)
+    {
+        perror(device_path.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    tree.gamepad_fds.emplace_back(fd);
+    return fd;
+}
+
+static void use_fake_input_tree(fake_input_tree_t const& tree)
+{
+    setenv("GAMEPAD_DEVFS_ROOT", (tree.root + "/dev").c_str(), 1);
+    setenv("GAMEPAD_SYSFS_ROOT", (tree.root + "/sys").c_str(), 1);
+}
+
+static void remove_fake_input_tree(fake_input_tree_t& tree)
+{
+    for (int fd : tree.gamepad_fds)
+        close(fd);
+
+    std::string command = "rm -rf '" + tree.root + "'";
+    if (system(command.c_str()) != 0)
+        fprintf(stderr, "Failed to remove %s\n", tree.root.c_str());
+}
+
+// The hotplug thread attaches the gamepads asynchronously.
+// Set when a benchmark couldn't run, the exit status reports it.
+static bool s_bench_failed = false;
+
+static bool wait_for_gamepads(uint32_t gamepad_count)
+{
+    gamepad::gamepad_id_t id;
+    auto deadline = bench_clock::now() + std::chrono::seconds(5);
+
+    for (uint32_t i = 0; i < gamepad_count; ++i)
+    {
+        while (gamepad::get_gamepad_id(i, &id) != gamepad::success)
+        {
+            if (bench_clock::now() > deadline)
+            {
+                fprintf(stderr, "Gamepad %u didn't show up.\n", i);
+                s_bench_failed = true;
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Benchmarks
+
+static double time_scans(uint32_t iterations, bool clear_cache)
+{
+    std::vector<gamepad::pending_device_t> pending_devices;
+
+    // No hotplug thread is running, the scan can be called from here.
+    auto start = bench_clock::now();
+    for (uint32_t i = 0; i < iterations; ++i)
+    {
+        if (clear_cache)
+            gamepad::s_rejected_devices.clear();
+
+        gamepad::scan_gamepad_devices(pending_devices);
+    }
+    return elapsed_us(start) / iterations;
+}
+
+static void bench_scan(uint32_t node_count, uint32_t iterations)
+{
+    fake_input_tree_t tree = make_fake_input_tree(node_count);
+
+    snprintf(gamepad::s_devfs_root, sizeof(gamepad::s_devfs_root), "%s/dev", tree.root.c_str());
+
+    printf("Scan of %u non-gamepad nodes (%u iterations)\n", node_count, iterations);
+
+    snprintf(gamepad::s_sysfs_root, sizeof(gamepad::s_sysfs_root), "%s/nosys", tree.root.c_str());
+    double ioctl_us = time_scans(iterations, true);
+    // The fake nodes are regular files: the first EVIOCGBIT fails, a real evdev open costs a lot more.
+    printf("  device probing, no cache: %10.2f us/scan %8.3f us/node\n", ioctl_us, ioctl_us / node_count);
+
+    snprintf(gamepad::s_sysfs_root, sizeof(gamepad::s_sysfs_root), "%s/sys", tree.root.c_str());
+    double sysfs_us = time_scans(iterations, true);
+    printf("  sysfs prefilter, no cache: %9.2f us/scan %8.3f us/node\n", sysfs_us, sysfs_us / node_count);
+
+    double cached_us = time_scans(iterations, false);
+    printf("  rejected nodes cached:     %9.2f us/scan %8.3f us/node\n", cached_us, cached_us / node_count);
+
+    gamepad::free_gamepad_resources();
+    remove_fake_input_tree(tree);
+}
+
+// Scans of a tree full of gamepads: the first one attaches them all, the next ones only look them up.
+static void bench_gamepad_scan(uint32_t gamepad_count, uint32_t iterations)
+{
+    if (gamepad_count > gamepad::max_connected_gamepads)
+    {
+        printf("Scan of %u gamepads skipped, the build has %u slots (GAMEPAD_MAX_GAMEPADS)\n", gamepad_count, gamepad::max_connected_gamepads);
+        return;
+    }
+
+    fake_input_tree_t tree = make_fake_input_tree(0);
+    std::vector<gamepad::pending_device_t> pending_devices;
+    std::vector<std::string> device_paths;
+
+    for (uint32_t i = 0; i < gamepad_count; ++i)
+    {
+        add_fake_gamepad(tree);
+        device_paths.emplace_back(tree.root + "/dev/event" + std::to_string(i));
+    }
+
+    snprintf(gamepad::s_devfs_root, sizeof(gamepad::s_devfs_root), "%s/dev", tree.root.c_str());
+    snprintf(gamepad::s_sysfs_root, sizeof(gamepad::s_sysfs_root), "%s/sys", tree.root.c_str());
+
+    printf("Scan of %u gamepads (%u iterations)\n", gamepad_count, iterations);
+
+    auto start = bench_clock::now();
+    gamepad::scan_gamepad_devices(pending_devices);
+    double attach_us = elapsed_us(start);
+
+    gamepad::gamepad_id_t id;
+    uint32_t attached = 0;
+    for (uint32_t i = 0; i < gamepad_count; ++i)
+        attached += gamepad::get_gamepad_id(i, &id) == gamepad::success ? 1 : 0;
+
+    if (attached != gamepad_count)
+    {
+        fprintf(stderr, "Only %u of %u gamepads got attached.\n", attached, gamepad_count);
+        s_bench_failed = true;
+    }
+
+    double rescan_us = time_scans(iterations, false);
+
+    uint32_t found = 0;
+    start = bench_clock::now();
+    for (uint32_t i = 0; i < iterations; ++i)
+    {
+        std::lock_guard<gamepad::gamepad_mutex_t> lk(gamepad::s_gamepad_mutex);
+        for (std::string const& device_path : device_paths)
+            found += gamepad::find_gamepad_device(device_path.c_str()) != -1 ? 1 : 0;
+    }
+    double lookup_ns = elapsed_ns(start) / (double(iterations) * gamepad_count);
+
+    if (found != iterations * gamepad_count)
+    {
+        fprintf(stderr, "Device lookup failed %u times.\n", iterations * gamepad_count - found);
+        s_bench_failed = true;
+    }
+
+    size_t slot_bytes = gamepad::s_slot_count.load() / gamepad::slot_chunk_size * sizeof(gamepad::slot_chunk_t);
+    printf("  first scan, attach:        %9.2f us/scan %8.3f us/gamepad\n", attach_us, attach_us / gamepad_count);
+    printf("  rescan, all attached:      %9.2f us/scan %8.3f us/gamepad\n", rescan_us, rescan_us / gamepad_count);
+    printf("  device lookup:             %9.1f ns\n", lookup_ns);
+    printf("  slot storage:              %9u slots %6.1f KiB (%.2f KiB/gamepad)\n", gamepad::s_slot_count.load(),
+        slot_bytes / 1024.0, slot_bytes / 1024.0 / gamepad_count);
+
+    gamepad::free_gamepad_resources();
+    remove_fake_input_tree(tree);
+}
+
+static void bench_idle_update(uint32_t gamepad_count, uint32_t frames)
+{
+    fake_input_tree_t tree = make_fake_input_tree(0);
+    uint32_t changed_mask[gamepad::gamepad_mask_words];
+    uint64_t syscalls;
+    double ns;
+
+    for (uint32_t i = 0; i < gamepad_count; ++i)
+        add_fake_gamepad(tree);
+
+    use_fake_input_tree(tree);
+    if (wait_for_gamepads(gamepad_count))
+    {
+        printf("Update of %u idle gamepads (%u frames)\n", gamepad_count, frames);
+
+        syscalls = syscall_count();
+        auto start = bench_clock::now();
+        for (uint32_t frame = 0; frame < frames; ++frame)
+        {
+            for (uint32_t i = 0; i < gamepad_count; ++i)
+                gamepad::update_gamepad_state(i);
+        }
+        ns = elapsed_ns(start) / frames;
+        printf("  update_gamepad_state loop: %9.1f ns/frame %6.2f syscalls/frame\n", ns, double(syscall_count() - syscalls) / frames);
+
+        syscalls = syscall_count();
+        start = bench_clock::now();
+        for (uint32_t frame = 0; frame < frames; ++frame)
+            gamepad::update_all_gamepads(changed_mask);
+
+        ns = elapsed_ns(start) / frames;
+        printf("  update_all_gamepads:       %9.1f ns/frame %6.2f syscalls/frame\n", ns, double(syscall_count() - syscalls) / frames);
+
+        gamepad::gamepad_state_t states[gamepad::max_connected_gamepads];
+        start = bench_clock::now();
+        for (uint32_t frame = 0; frame < frames; ++frame)
+        {
+            for (uint32_t i = 0; i < gamepad_count; ++i)
+                gamepad::get_gamepad_state(i, &states[i]);
+        }
+        ns = elapsed_ns(start) / frames;
+        printf("  get_gamepad_state loop:    %9.1f ns/frame\n", ns);
+
+        uint64_t sequences[gamepad::max_connected_gamepads] = {};
+        uint32_t dirty_mask;
+        start = bench_clock::now();
+        for (uint32_t frame = 0; frame < frames; ++frame)
+        {
+            for (uint32_t i = 0; i < gamepad_count; ++i)
+            {
+                if (gamepad::get_gamepad_changes(i, sequences[i], &sequences[i], &dirty_mask) == gamepad::success && dirty_mask != gamepad::state_field_none)
+                    gamepad::get_gamepad_state(i, &states[i]);
+            }
+        }
+        ns = elapsed_ns(start) / frames;
+        printf("  get_gamepad_changes loop:  %9.1f ns/frame\n", ns);
+
+        uint32_t buttons[gamepad::max_connected_gamepads];
+        float columns[6][gamepad::max_connected_gamepads];
+        gamepad::gamepad_states_soa_t soa = { buttons, columns[0], columns[1], columns[2], columns[3], columns[4], columns[5] };
+        uint32_t connected_mask[gamepad::gamepad_mask_words];
+        start = bench_clock::now();
+        for (uint32_t frame = 0; frame < frames; ++frame)
+            gamepad::get_all_gamepad_states(soa, connected_mask);
+
+        ns = elapsed_ns(start) / frames;
+        printf("  get_all_gamepad_states:    %9.1f ns/frame\n", ns);
+    }
+
+    gamepad::free_gamepad_resources();
+    remove_fake_input_tree(tree);
+}
+
+static void write_fake_event(int fd, uint16_t type, uint16_t code, int32_t value)
+{
+    struct input_event event = {};
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    event.input_event_sec = now.tv_sec;
+    event.input_event_usec = now.tv_nsec / 1000;
+    event.type = type;
+    event.code = code;
+    event.value = value;
+    if (write(fd, &event, sizeof(event)) != sizeof(event))
+        perror("write");
+}
+
+static gamepad::gamepad_state_t locked_get_gamepad_state(uint32_t index)
+{
+    gamepad::gamepad_state_t state;
+    gamepad::call_internal_action(index, &gamepad::internal_get_gamepad_state, &state);
+    return state;
+}
+
+static gamepad::gamepad_state_t lock_free_get_gamepad_state(uint32_t index)
+{
+    gamepad::gamepad_state_t state;
+    gamepad::get_gamepad_state(index, &state);
+    return state;
+}
+
+// Slots a reader polls, like a game checking for its 4 players whatever is plugged.
+static constexpr uint32_t polled_slot_count = 4;
+
+// One thread feeds the gamepads and updates them while the readers poll every slot as fast as they can.
+// The writer always moves both sticks together, a reader that sees them apart got a torn state.
+static void run_concurrent_reads(fake_input_tree_t const& tree, uint32_t reader_count, uint32_t duration_ms, gamepad::gamepad_state_t(*pfn_get)(uint32_t), const char* name)
+{
+    const uint32_t slot_count = std::max(static_cast<uint32_t>(tree.gamepad_fds.size()), polled_slot_count);
+    std::atomic<bool> running(true);
+    std::atomic<uint64_t> reads(0);
+    std::atomic<uint64_t> torn_reads(0);
+    uint64_t updates = 0;
+    std::vector<std::thread> readers;
+
+    for (uint32_t r = 0; r < reader_count; ++r)
+    {
+        readers.emplace_back([&]()
+        {
+            uint64_t thread_reads = 0;
+            uint64_t thread_torn_reads = 0;
+            while (running.load(std::memory_order_relaxed))
+            {
+                for (uint32_t i = 0; i < slot_count; ++i)
+                {
+                    gamepad::gamepad_state_t state = pfn_get(i);
+                    if (state.left_stick.x != state.right_stick.x)
+                        ++thread_torn_reads;
+                }
+                thread_reads += slot_count;
+            }
+            reads += thread_reads;
+            torn_reads += thread_torn_reads;
+        });
+    }
+
+    uint32_t changed_mask[gamepad::gamepad_mask_words];
+    int32_t value = 0;
+    gamepad::gamepad_stats_t stats;
+    gamepad::get_gamepad_stats(&stats, true);
+    auto start = bench_clock::now();
+    auto deadline = start + std::chrono::milliseconds(duration_ms);
+    while (bench_clock::now() < deadline)
+    {
+        value = (value + 997) % 32768;
+        for (int fd : tree.gamepad_fds)
+        {
+            write_fake_event(fd, EV_ABS, ABS_X, value);
+            write_fake_event(fd, EV_ABS, ABS_RX, value);
+            write_fake_event(fd, EV_SYN, SYN_REPORT, 0);
+        }
+        gamepad::update_all_gamepads(changed_mask);
+        ++updates;
+    }
+    double seconds = elapsed_us(start) / 1000000.0;
+
+    running = false;
+    for (auto& reader : readers)
+        reader.join();
+
+    // Zeroed when the counters are compiled out.
+    gamepad::get_gamepad_stats(&stats, false);
+    printf("  %-10s %2u readers: %8.2f Mreads/s per reader, %8.0f updates/s, %llu torn reads, %6.2f us lock wait/update, %8.2f locks/update\n",
+        name, reader_count, reads / seconds / reader_count / 1000000.0, updates / seconds, static_cast<unsigned long long>(torn_reads.load()),
+        stats.mutex_wait_ns / 1000.0 / updates, double(stats.mutex_locks) / updates);
+}
+
+static void bench_concurrent_reads(uint32_t gamepad_count, uint32_t duration_ms)
+{
+    fake_input_tree_t tree = make_fake_input_tree(0);
+    uint32_t max_readers = std::max(2u, std::thread::hardware_concurrency());
+
+    for (uint32_t i = 0; i < gamepad_count; ++i)
+        add_fake_gamepad(tree);
+
+    use_fake_input_tree(tree);
+    if (wait_for_gamepads(gamepad_count))
+    {
+        printf("State reads of %u slots, %u gamepads plugged, while they are updated (%u ms each)\n",
+            std::max(gamepad_count, polled_slot_count), gamepad_count, duration_ms);
+        for (uint32_t reader_count = 1; reader_count <= max_readers; reader_count *= 2)
+        {
+            run_concurrent_reads(tree, reader_count, duration_ms, &locked_get_gamepad_state, "locked");
+            run_concurrent_reads(tree, reader_count, duration_ms, &lock_free_get_gamepad_state, "lock-free");
+        }
+    }
+
+    gamepad::free_gamepad_resources();
+    remove_fake_input_tree(tree);
+}
+
+static void print_latency_histogram(const char* name, gamepad::latency_histogram_t const& histogram)
+{
+    printf("  %-26s %6llu us p50 %6llu us p99 %6llu us p999 %6llu us max (%llu reports, %llu dropped)\n", name,
+        static_cast<unsigned long long>(gamepad::get_latency_percentile(histogram, 50.0)),
+        static_cast<unsigned long long>(gamepad::get_latency_percentile(histogram, 99.0)),
+        static_cast<unsigned long long>(gamepad::get_latency_percentile(histogram, 99.9)),
+        static_cast<unsigned long long>(histogram.max_us),
+        static_cast<unsigned long long>(histogram.count),
+        static_cast<unsigned long long>(histogram.dropped));
+}
+
+// Time between an event written to the device and its state being visible, nobody calls update_gamepad_state.
+static void bench_reader_thread(uint32_t samples)
+{
+    fake_input_tree_t tree = make_fake_input_tree(0);
+    int fd = add_fake_gamepad(tree);
+    gamepad::gamepad_state_t state;
+    double total_us = 0.0;
+    double max_us = 0.0;
+    uint32_t missed = 0;
+
+    use_fake_input_tree(tree);
+    if (wait_for_gamepads(1) && gamepad::start_gamepad_reader_thread() == gamepad::success)
+    {
+        printf("Reader thread input latency (%u samples)\n", samples);
+
+        for (uint32_t i = 0; i < samples; ++i)
+        {
+            int32_t value = (i & 1) ? 32767 : -32768;
+            auto start = bench_clock::now();
+            auto deadline = start + std::chrono::milliseconds(100);
+
+            write_fake_event(fd, EV_ABS, ABS_X, value);
+            write_fake_event(fd, EV_SYN, SYN_REPORT, 0);
+            do
+            {
+                gamepad::get_gamepad_state(0, &state);
+            } while (((state.left_stick.x > 0) != (value > 0)) && bench_clock::now() < deadline);
+
+            double us = elapsed_us(start);
+            if ((state.left_stick.x > 0) != (value > 0))
+                ++missed;
+
+            total_us += us;
+            max_us = std::max(max_us, us);
+        }
+
+        printf("  event to state:            %9.2f us mean %9.2f us max, %u missed\n", total_us / samples, max_us, missed);
+
+        gamepad::gamepad_latency_t latency;
+        if (gamepad::get_gamepad_latency(0, &latency, true) == gamepad::success)
+        {
+            print_latency_histogram("kernel to read:", latency.read);
+            print_latency_histogram("kernel to visible:", latency.visible);
+        }
+    }
+
+    gamepad::free_gamepad_resources();
+    remove_fake_input_tree(tree);
+}
+
+// Sticks moving, a button and the dpad toggling every 8ms, triggers every other report.
+static void append_fake_report(std::vector<struct input_event>& stream, uint32_t ms)
+{
+    struct input_event event = {};
+    int32_t value = static_cast<int32_t>((ms * 97) % 65536) - 32768;
+    event.input_event_sec = ms / 1000;
+    event.input_event_usec = (ms % 1000) * 1000;
+
+    event.type = EV_ABS;
+    for (uint16_t code : { ABS_X, ABS_Y, ABS_RX, ABS_RY })
+    {
+        event.code = code;
+        event.value = value;
+        stream.emplace_back(event);
+    }
+    if (ms & 1)
+    {
+        event.code = ABS_Z;
+        event.value = static_cast<int32_t>(ms % 256);
+        stream.emplace_back(event);
+    }
+    if ((ms & 7) == 0)
+    {
+        event.code = ABS_HAT0X;
+        event.value = (ms & 8) ? 1 : 0;
+        stream.emplace_back(event);
+
+        event.type = EV_KEY;
+        event.code = BTN_A;
+        event.value = (ms & 8) ? 1 : 0;
+        stream.emplace_back(event);
+    }
+    event.type = EV_SYN;
+    event.code = SYN_REPORT;
+    event.value = 0;
+    stream.emplace_back(event);
+}
+
+// Decoding only (no syscalls): every pad sends a report each millisecond, for the given stream duration.
+static void bench_decode(uint32_t gamepad_count, uint32_t stream_seconds)
+{
+    fake_input_tree_t tree = make_fake_input_tree(0);
+
+    for (uint32_t i = 0; i < gamepad_count; ++i)
+        add_fake_gamepad(tree);
+
+    use_fake_input_tree(tree);
+    if (wait_for_gamepads(gamepad_count))
+    {
+        const uint32_t reports = 1000 * stream_seconds;
+        std::vector<struct input_event> stream;
+
+        for (uint32_t ms = 0; ms < reports; ++ms)
+            append_fake_report(stream, ms);
+
+        std::lock_guard<gamepad::gamepad_mutex_t> lk(gamepad::s_gamepad_mutex);
+        auto start = bench_clock::now();
+        for (uint32_t i = 0; i < gamepad_count; ++i)
+        {
+            // Decoded in read() sized chunks, like internal_update_gamepad_state does.
+            for (size_t offset = 0; offset < stream.size(); offset += 32)
+                gamepad::decode_gamepad_events(gamepad::s_gamepads[i], stream.data() + offset, static_cast<int>(std::min<size_t>(32, stream.size() - offset)));
+        }
+        double ns = elapsed_ns(start);
+        double events = double(stream.size()) * gamepad_count;
+
+        printf("Decoding %u gamepads at 1 kHz (%u s stream, %.0f events)\n", gamepad_count, stream_seconds, events);
+        printf("  decode:                    %9.2f ns/event %8.2f Mevents/s\n", ns / events, events / ns * 1000.0);
+    }
+
+    gamepad::free_gamepad_resources();
+    remove_fake_input_tree(tree);
+}
+
+// Same reports, written to the fake nodes and read back by update_all_gamepads(): one report per pad per frame.
+static void bench_stream(uint32_t gamepad_count, uint32_t frames, uint32_t reports_per_frame)
+{
+    fake_input_tree_t tree = make_fake_input_tree(0);
+    uint32_t changed_mask[gamepad::gamepad_mask_words];
+
+    for (uint32_t i = 0; i < gamepad_count; ++i)
+        add_fake_gamepad(tree);
+
+    use_fake_input_tree(tree);
+    if (wait_for_gamepads(gamepad_count))
+    {
+        std::vector<struct input_event> report;
+        double update_ns = 0.0;
+        uint64_t events = 0;
+        uint64_t reads = s_read_calls;
+        uint64_t epoll_waits = s_epoll_wait_calls;
+        gamepad::gamepad_stats_t stats;
+        gamepad::get_gamepad_stats(&stats, true);
+
+        for (uint32_t frame = 0; frame < frames; ++frame)
+        {
+            report.clear();
+            for (uint32_t i = 0; i < reports_per_frame; ++i)
+                append_fake_report(report, frame * reports_per_frame + i);
+            for (int fd : tree.gamepad_fds)
+            {
+                if (write(fd, report.data(), report.size() * sizeof(struct input_event)) == -1)
+                    perror("write");
+            }
+            events += report.size() * gamepad_count;
+
+            auto start = bench_clock::now();
+            gamepad::update_all_gamepads(changed_mask);
+            update_ns += elapsed_ns(start);
+        }
+
+        printf("Streaming %u gamepads through their nodes (%u frames, %u reports/frame, %llu events)\n", gamepad_count, frames, reports_per_frame, static_cast<unsigned long long>(events));
+        printf("  update_all_gamepads:       %9.1f ns/frame %8.2f Mevents/s\n", update_ns / frames, events / update_ns * 1000.0);
+        printf("  syscalls:                  %9.2f read/frame %6.2f epoll_wait/frame %6.2f read/1000 events\n",
+            double(s_read_calls - reads) / frames, double(s_epoll_wait_calls - epoll_waits) / frames, double(s_read_calls - reads) * 1000.0 / events);
+
+        if (gamepad::get_gamepad_stats(&stats, false) == gamepad::success)
+        {
+            printf("  counters:                  %9.2f EAGAIN reads/frame %6.2f syn/frame %6.2f abs/frame %6.2f key/frame\n",
+                double(stats.reads_would_block) / frames, double(stats.syn_events) / frames, double(stats.abs_events) / frames, double(stats.key_events) / frames);
+            printf("  io_uring:                  %9.2f enter/frame %6.2f completions/frame %6.2f enter/1000 events\n",
+                double(stats.uring_enters) / frames, double(stats.uring_completions) / frames, double(stats.uring_enters) * 1000.0 / events);
+        }
+    }
+
+    gamepad::free_gamepad_resources();
+    remove_fake_input_tree(tree);
+}
+
+// The nodes are filled with a backlog of reports, then the reader threads drain them: the throughput of the
+// sharded readers. The last report of every backlog presses BTN_B, which the stream never touches.
+static void bench_reader_threads(uint32_t gamepad_count, uint32_t thread_count, uint32_t reports_per_gamepad)
+{
+    fake_input_tree_t tree = make_fake_input_tree(0);
+    std::vector<struct input_event> stream;
+
+    for (uint32_t i = 0; i < gamepad_count; ++i)
+    {
+        int fd = add_fake_gamepad(tree);
+        // Room for the whole backlog, the FIFOs are only 64KiB otherwise.
+        fcntl(fd, F_SETPIPE_SZ, 1 << 20);
+    }
+
+    size_t capacity = static_cast<size_t>(fcntl(tree.gamepad_fds[0], F_GETPIPE_SZ)) / sizeof(struct input_event);
+    for (uint32_t ms = 0; ms < reports_per_gamepad && stream.size() + 16 < capacity; ++ms)
+        append_fake_report(stream, ms);
+
+    struct input_event marker[2] = {};
+    marker[0].type = EV_KEY;
+    marker[0].code = BTN_B;
+    marker[0].value = 1;
+    marker[1].type = EV_SYN;
+    marker[1].code = SYN_REPORT;
+    stream.insert(stream.end(), marker, marker + 2);
+
+    use_fake_input_tree(tree);
+    if (wait_for_gamepads(gamepad_count))
+    {
+        for (int fd : tree.gamepad_fds)
+        {
+            if (write(fd, stream.data(), stream.size() * sizeof(struct input_event)) != static_cast<ssize_t>(stream.size() * sizeof(struct input_event)))
+                perror("write");
+        }
+
+        auto start = bench_clock::now();
+        auto deadline = start + std::chrono::seconds(10);
+        uint32_t drained = 0;
+        if (gamepad::start_gamepad_reader_threads(thread_count, true) == gamepad::success)
+        {
+            gamepad::gamepad_state_t state;
+            while (drained != gamepad_count && bench_clock::now() < deadline)
+            {
+                drained = 0;
+                for (uint32_t i = 0; i < gamepad_count; ++i)
+                {
+                    if (gamepad::get_gamepad_state(i, &state) == gamepad::success && gamepad::is_any_pressed(state.buttons, gamepad::button_b))
+                        ++drained;
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        }
+        double us = elapsed_us(start);
+
+        if (drained != gamepad_count)
+        {
+            fprintf(stderr, "Only %u of %u gamepads got their backlog read.\n", drained, gamepad_count);
+            s_bench_failed = true;
+        }
+
+        uint64_t events = uint64_t(stream.size()) * gamepad_count;
+        printf("Reader threads draining %u gamepads, %u threads (%llu events, %u cpus)\n", gamepad_count, thread_count,
+            static_cast<unsigned long long>(events), std::thread::hardware_concurrency());
+        // The threads share the cpus past that, the throughput says nothing about the scaling.
+        bool oversubscribed = thread_count > std::thread::hardware_concurrency();
+        printf("  backlog drained:           %9.1f us %8.2f Mevents/s%s\n", us, events / us, oversubscribed ? " (more threads than cpus)" : "");
+    }
+
+    gamepad::free_gamepad_resources();
+    remove_fake_input_tree(tree);
+}
+
+// Records the stream of a fake gamepad, then replays it at maximum speed: decode throughput from a mapped file.
+static void bench_replay(uint32_t frames)
+{
+    fake_input_tree_t tree = make_fake_input_tree(0);
+    int fd = add_fake_gamepad(tree);
+    std::string recording_path = tree.root + "/recording.bin";
+    uint32_t changed_mask[gamepad::gamepad_mask_words];
+
+    use_fake_input_tree(tree);
+    if (wait_for_gamepads(1) && gamepad::start_gamepad_recording(0, recording_path.c_str()) == gamepad::success)
+    {
+        std::vector<struct input_event> report;
+        gamepad::gamepad_state_t recorded_state;
+        gamepad::gamepad_state_t live_state;
+        gamepad::gamepad_state_t replayed_state;
+        uint64_t events = 0;
+        uint32_t replay_index;
+
+        for (uint32_t frame = 0; frame < frames; ++frame)
+        {
+            report.clear();
+            append_fake_report(report, frame);
+            if (write(fd, report.data(), report.size() * sizeof(struct input_event)) == -1)
+                perror("write");
+
+            events += report.size();
+            gamepad::update_all_gamepads(changed_mask);
+        }
+        gamepad::get_gamepad_state(0, &recorded_state);
+
+        // Still recording: the replay follows what gets appended.
+        if (gamepad::start_gamepad_replay(recording_path.c_str(), gamepad::replay_speed_e::max_speed, &replay_index) == gamepad::success)
+        {
+            auto start = bench_clock::now();
+            gamepad::update_gamepad_state(replay_index);
+            double ns = elapsed_ns(start);
+            gamepad::get_gamepad_state(replay_index, &replayed_state);
+
+            printf("Replay of a %u reports recording (%llu events)\n", frames, static_cast<unsigned long long>(events));
+            printf("  max speed:                 %9.2f ns/event %8.2f Mevents/s, %s state\n", ns / events, events / ns * 1000.0,
+                memcmp(&recorded_state, &replayed_state, sizeof(replayed_state)) == 0 ? "same" : "different");
+
+            report.clear();
+            append_fake_report(report, frames);
+            if (write(fd, report.data(), report.size() * sizeof(struct input_event)) == -1)
+                perror("write");
+
+            gamepad::update_all_gamepads(changed_mask);
+            gamepad::get_gamepad_state(0, &live_state);
+            gamepad::get_gamepad_state(replay_index, &replayed_state);
+            printf("  appended while replaying:  %s state\n", memcmp(&live_state, &replayed_state, sizeof(replayed_state)) == 0 ? "same" : "different");
+
+            gamepad::stop_gamepad_replay(replay_index);
+        }
+        gamepad::stop_gamepad_recording(0);
+    }
+
+    gamepad::free_gamepad_resources();
+    remove_fake_input_tree(tree);
+}
+
+// A gamepad opened with a button held, then kernel buffer overflows: the events after each SYN_DROPPED are garbage
+// and the state must come back from EVIOCGKEY/EVIOCGABS.
+static void bench_resync(uint32_t iterations)
+{
+    fake_input_tree_t tree = make_fake_input_tree(0);
+    int fd = add_fake_gamepad(tree);
+    gamepad::gamepad_state_t state;
+
+    s_fake_btn_a_down = true;
+    s_fake_abs_x = 32767;
+    use_fake_input_tree(tree);
+    if (wait_for_gamepads(1))
+    {
+        gamepad::update_gamepad_state(0);
+        gamepad::get_gamepad_state(0, &state);
+        bool seeded = gamepad::are_all_pressed(state.buttons, gamepad::button_a) && state.left_stick.x > 0.9f;
+
+        uint32_t mismatches = 0;
+        double total_ns = 0.0;
+        for (uint32_t i = 0; i < iterations; ++i)
+        {
+            bool down = (i & 1) != 0;
+            int32_t value = down ? -32768 : 32767;
+            s_fake_btn_a_down = down;
+            s_fake_abs_x = value;
+
+            write_fake_event(fd, EV_SYN, SYN_DROPPED, 0);
+            write_fake_event(fd, EV_KEY, BTN_A, !down);
+            write_fake_event(fd, EV_ABS, ABS_X, -value);
+            write_fake_event(fd, EV_SYN, SYN_REPORT, 0);
+
+            auto start = bench_clock::now();
+            gamepad::update_gamepad_state(0);
+            total_ns += elapsed_ns(start);
+
+            gamepad::get_gamepad_state(0, &state);
+            if (gamepad::are_all_pressed(state.buttons, gamepad::button_a) != down || (state.left_stick.x > 0.0f) != (value > 0))
+                ++mismatches;
+        }
+
+        printf("SYN_DROPPED recovery (%u drops)\n", iterations);
+        printf("  seeded at open:            %9s\n", seeded ? "yes" : "no");
+        printf("  update with resync:        %9.1f ns %u mismatches\n", total_ns / iterations, mismatches);
+        if (!seeded || mismatches != 0)
+            s_bench_failed = true;
+    }
+
+    s_fake_btn_a_down = false;
+    s_fake_abs_x = 0;
+    gamepad::free_gamepad_resources();
+    remove_fake_input_tree(tree);
+}
+
+// Compares the precomputed axis transforms with rerange_value() on every value of the wired and wireless layouts.
+static void bench_axis_transform(uint32_t iterations)
+{
+    struct layout_axis_t
+    {
+        const char* name;
+        int axis_id;
+        float min;
+        float max;
+        float normalized_min;
+        float normalized_max;
+    } layout_axes[] = {
+        { "wired stick"      , ABS_X    , -32768.0f, 32767.0f , -1.0f, 1.0f },
+        { "wired stick y"    , ABS_Y    , 32767.0f , -32768.0f, -1.0f, 1.0f },
+        { "wired trigger"    , ABS_Z    , 0.0f     , 255.0f   , 0.0f , 1.0f },
+        { "wireless stick"   , ABS_RX   , 0.0f     , 65535.0f , -1.0f, 1.0f },
+        { "wireless stick y" , ABS_RY   , 65535.0f , 0.0f     , -1.0f, 1.0f },
+        { "wireless trigger" , ABS_BRAKE, 0.0f     , 1023.0f  , 0.0f , 1.0f },
+    };
+
+    std::unique_ptr<gamepad::gamepad_context_t> context(new gamepad::gamepad_context_t());
+    float* fields[] = { &context->gamepadState.left_stick.x, &context->gamepadState.left_stick.y, &context->gamepadState.left_trigger,
+                        &context->gamepadState.right_stick.x, &context->gamepadState.right_stick.y, &context->gamepadState.right_trigger };
+
+    for (size_t i = 0; i < sizeof(layout_axes) / sizeof(*layout_axes); ++i)
+    {
+        auto const& layout_axis = layout_axes[i];
+        context->axis.emplace_back(gamepad::axis_t{ layout_axis.axis_id, layout_axis.min, layout_axis.max, layout_axis.normalized_min, layout_axis.normalized_max, fields[i] });
+    }
+    gamepad::build_dispatch_tables(context.get());
+
+    printf("Axis transform, every value checked against rerange_value (%u timed passes)\n", iterations);
+    for (auto const& layout_axis : layout_axes)
+    {
+        gamepad::abs_dispatch_t const& entry = context->absDispatch[layout_axis.axis_id];
+        int32_t first = static_cast<int32_t>(std::min(layout_axis.min, layout_axis.max));
+        int32_t last = static_cast<int32_t>(std::max(layout_axis.min, layout_axis.max));
+        uint32_t different = 0;
+        float max_error = 0.0f;
+
+        for (int32_t value = first; value <= last; ++value)
+        {
+            float expected = gamepad::rerange_value(layout_axis.min, layout_axis.max, layout_axis.normalized_min, layout_axis.normalized_max, static_cast<float>(value));
+            float actual = gamepad::transform_axis_value(entry, value);
+            if (actual != expected)
+            {
+                ++different;
+                max_error = std::max(max_error, std::fabs(actual - expected));
+            }
+        }
+
+        printf("  %-17s %s: %5u/%5d values differ, max error %g%s\n",
+            layout_axis.name, entry.lut_size != 0 ? "lut   " : "affine",
+            different, last - first + 1, max_error, max_error > 1.0f / (1 << 23) ? " (TOO LARGE)" : "");
+    }
+
+    // Interleaved axes like a real stream, so the bounds are loaded for every value.
+    std::vector<std::pair<int, int32_t>> stream;
+    for (uint32_t i = 0; i < 1 << 16; ++i)
+    {
+        auto const& layout_axis = layout_axes[i % (sizeof(layout_axes) / sizeof(*layout_axes))];
+        int32_t first = static_cast<int32_t>(std::min(layout_axis.min, layout_axis.max));
+        int32_t last = static_cast<int32_t>(std::max(layout_axis.min, layout_axis.max));
+        stream.emplace_back(layout_axis.axis_id, first + static_cast<int32_t>((i * 2654435761u) % static_cast<uint32_t>(last - first + 1)));
+    }
+
+    std::vector<float> results(stream.size());
+    auto start = bench_clock::now();
+    for (uint32_t pass = 0; pass < iterations; ++pass)
+    {
+        for (size_t i = 0; i < stream.size(); ++i)
+        {
+            gamepad::axis_t const& axis = context->absDispatch[stream[i].first].axis;
+            results[i] = gamepad::rerange_value(axis.min, axis.max, axis.normalized_min, axis.normalized_max, static_cast<float>(stream[i].second));
+        }
+    }
+    double rerange_ns = elapsed_ns(start) / (double(stream.size()) * iterations);
+    float checksum = results[iterations % results.size()];
+
+    start = bench_clock::now();
+    for (uint32_t pass = 0; pass < iterations; ++pass)
+    {
+        for (size_t i = 0; i < stream.size(); ++i)
+            results[i] = gamepad::transform_axis_value(context->absDispatch[stream[i].first], stream[i].second);
+    }
+    double transform_ns = elapsed_ns(start) / (double(stream.size()) * iterations);
+    checksum += results[iterations % results.size()];
+
+    printf("  mixed stream:      %6.2f ns/value rerange_value %6.2f ns/value precomputed (%g)\n", rerange_ns, transform_ns, checksum);
+}
+
+// Rumble driven by a moving trigger, set several times per frame like a game loop reacting to several events.
+static void bench_vibration(uint32_t frames, uint32_t calls_per_frame)
+{
+    fake_input_tree_t tree = make_fake_input_tree(0);
+    uint32_t changed_mask[gamepad::gamepad_mask_words];
+
+    add_fake_gamepad(tree);
+
+    use_fake_input_tree(tree);
+    if (wait_for_gamepads(1))
+    {
+        printf("Vibration (%u frames, %u calls per frame)\n", frames, calls_per_frame);
+
+        uint64_t syscalls = s_ioctl_calls + s_write_calls;
+        auto start = bench_clock::now();
+        for (uint32_t frame = 0; frame < frames; ++frame)
+        {
+            gamepad::update_all_gamepads(changed_mask);
+            for (uint32_t call = 0; call < calls_per_frame; ++call)
+            {
+                float strength = static_cast<float>((frame / 4 + call) % 64) / 63.0f;
+                gamepad::set_gamepad_vibration(0, strength, strength / 2);
+            }
+        }
+        double ns = elapsed_ns(start);
+        uint64_t ff_syscalls = s_ioctl_calls + s_write_calls - syscalls;
+        uint64_t calls = uint64_t(frames) * calls_per_frame;
+
+        printf("  set_gamepad_vibration:     %9.1f ns/call %6.3f FF syscalls/call %6.3f FF syscalls/frame\n",
+            ns / calls, double(ff_syscalls) / calls, double(ff_syscalls) / frames);
+
+        syscalls = s_ioctl_calls + s_write_calls;
+        for (uint32_t frame = 0; frame < frames; ++frame)
+        {
+            gamepad::update_all_gamepads(changed_mask);
+            gamepad::set_gamepad_vibration(0, 0.5f, 0.5f);
+        }
+        printf("  same strength every frame: %6.3f FF syscalls/frame\n", double(s_ioctl_calls + s_write_calls - syscalls) / frames);
+
+        // Stops right after a merged change of the same frame, both must reach the device before the next update.
+        gamepad::update_all_gamepads(changed_mask);
+        gamepad::set_gamepad_vibration(0, 0.7f, 0.7f);
+        gamepad::set_gamepad_vibration(0, 0.3f, 0.3f);
+        syscalls = s_ioctl_calls + s_write_calls;
+        gamepad::set_gamepad_vibration(0, 0.0f, 0.0f);
+        uint64_t set_stop_syscalls = s_ioctl_calls + s_write_calls - syscalls;
+
+        gamepad::set_gamepad_vibration(0, 0.3f, 0.3f);
+        syscalls = s_ioctl_calls + s_write_calls;
+        gamepad::stop_gamepad_rumble_pattern(0);
+        uint64_t pattern_stop_syscalls = s_ioctl_calls + s_write_calls - syscalls;
+
+        printf("  stop after a merged change: %llu FF syscalls (strengths 0) %llu (stop_gamepad_rumble_pattern)\n",
+            static_cast<unsigned long long>(set_stop_syscalls), static_cast<unsigned long long>(pattern_stop_syscalls));
+        if (set_stop_syscalls == 0 || pattern_stop_syscalls == 0)
+        {
+            fprintf(stderr, "A rumble stop was held back until the next update.\n");
+            s_bench_failed = true;
+        }
+    }
+
+    gamepad::free_gamepad_resources();
+    remove_fake_input_tree(tree);
+}
+
+struct recorded_ff_write_t
+{
+    bench_clock::time_point time;
+    uint32_t index;
+    float left_strength;
+    float right_strength;
+};
+
+static std::mutex s_recorded_ff_writes_mutex;
+static std::vector<recorded_ff_write_t> s_recorded_ff_writes;
+
+static int32_t record_ff_write(uint32_t index, float left_strength, float right_strength)
+{
+    std::lock_guard<std::mutex> lk(s_recorded_ff_writes_mutex);
+    s_recorded_ff_writes.emplace_back(recorded_ff_write_t{ bench_clock::now(), index, left_strength, right_strength });
+    return gamepad::success;
+}
+
+// Envelopes and sample patterns on several pads, played into a sink that records the writes.
+static void bench_haptics_scheduler(uint32_t gamepad_count)
+{
+    gamepad::rumble_envelope_t envelope = { 1.0f, 0.5f, 40, 40, 40 };
+    std::vector<float> samples(50);
+    for (size_t i = 0; i < samples.size(); ++i)
+        samples[i] = static_cast<float>(i % 10) / 9.0f;
+
+    s_recorded_ff_writes.clear();
+    gamepad::s_haptics_sink = &record_ff_write;
+
+    auto start = bench_clock::now();
+    for (uint32_t i = 0; i < gamepad_count; ++i)
+    {
+        if (i & 1)
+            gamepad::play_gamepad_rumble_samples(i, samples.data(), samples.data(), static_cast<uint32_t>(samples.size()), 200);
+        else
+            gamepad::play_gamepad_rumble_envelope(i, envelope);
+    }
+    double queue_ns = elapsed_ns(start) / gamepad_count;
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    gamepad::free_gamepad_resources();
+    gamepad::s_haptics_sink = &gamepad::write_scheduled_vibration;
+
+    uint32_t writes_per_gamepad[gamepad::max_connected_gamepads] = {};
+    bench_clock::time_point last_write[gamepad::max_connected_gamepads];
+    double min_interval_ms = 1e9;
+    uint32_t not_stopped = 0;
+    for (auto const& write : s_recorded_ff_writes)
+    {
+        if (writes_per_gamepad[write.index]++ != 0)
+            min_interval_ms = std::min(min_interval_ms, std::chrono::duration<double, std::milli>(write.time - last_write[write.index]).count());
+
+        last_write[write.index] = write.time;
+    }
+    for (uint32_t i = 0; i < gamepad_count; ++i)
+    {
+        bool stopped = false;
+        for (auto const& write : s_recorded_ff_writes)
+        {
+            if (write.index == i)
+                stopped = (write.left_strength == 0.0f && write.right_strength == 0.0f);
+        }
+        not_stopped += stopped ? 0 : 1;
+    }
+
+    printf("Haptics scheduler (%u gamepads, 120 ms envelopes and 250 ms sample patterns, %u ms ticks)\n", gamepad_count, gamepad::haptics_tick_ms);
+    printf("  queueing a pattern:        %9.1f ns/call\n", queue_ns);
+    printf("  sink writes:               %9zu total %6.1f per gamepad, %.2f ms min interval per gamepad, %u not stopped\n",
+        s_recorded_ff_writes.size(), double(s_recorded_ff_writes.size()) / gamepad_count, min_interval_ms, not_stopped);
+}
+
+// Every kernel on the same random sticks and triggers, checked against the scalar one.
+struct deadzone_mode_e_name_t
+{
+    gamepad::deadzone_mode_e mode;
+    const char* name;
+};
+
+static void bench_processing(uint32_t iterations)
+{
+    struct kernel_t
+    {
+        const char* name;
+        gamepad::processing_kernel_t kernel;
+    };
+    std::vector<kernel_t> kernels = { { "scalar", &gamepad::process_columns_scalar } };
+#if defined(GAMEPAD_PROCESSING_SSE2)
+    kernels.emplace_back(kernel_t{ "sse2", &gamepad::process_columns_sse2 });
+#endif
+#if defined(GAMEPAD_PROCESSING_AVX2)
+    if (gamepad::cpu_has_avx2())
+        kernels.emplace_back(kernel_t{ "avx2", &gamepad::process_columns_avx2 });
+#endif
+#if defined(GAMEPAD_PROCESSING_NEON)
+    kernels.emplace_back(kernel_t{ "neon", &gamepad::process_columns_neon });
+#endif
+
+    const uint32_t count = bench_gamepad_count;
+    const uint32_t column_count = 7;
+    std::vector<float> input(count * column_count);
+    uint32_t seed = 12345;
+    for (auto& value : input)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        value = static_cast<float>(seed >> 8) / (1 << 24) * 2.0f - 1.0f;
+    }
+
+    printf("Deadzones and trigger thresholds on %u gamepads (%u iterations)\n", count, iterations);
+
+    for (deadzone_mode_e_name_t mode : { deadzone_mode_e_name_t{ gamepad::deadzone_mode_e::axial, "axial" },
+                                         deadzone_mode_e_name_t{ gamepad::deadzone_mode_e::radial, "radial" },
+                                         deadzone_mode_e_name_t{ gamepad::deadzone_mode_e::scaled_radial, "scaled radial" } })
+    {
+        gamepad::gamepad_processing_t processing = gamepad::default_gamepad_processing;
+        processing.deadzone_mode = mode.mode;
+
+        std::vector<uint32_t> reference_buttons;
+        std::vector<float> reference;
+
+        for (auto const& kernel : kernels)
+        {
+            std::vector<uint32_t> buttons(count);
+            std::vector<float> columns(count * column_count);
+            gamepad::gamepad_states_soa_t view = { buttons.data(), &columns[count * 0], &columns[count * 1], &columns[count * 2],
+                                                   &columns[count * 3], &columns[count * 4], &columns[count * 5] };
+
+            auto start = bench_clock::now();
+            for (uint32_t i = 0; i < iterations; ++i)
+            {
+                // The deadzones are not idempotent (scaled radial), start from the same input every time.
+                memcpy(columns.data(), input.data(), columns.size() * sizeof(float));
+                kernel.kernel(processing, view, count);
+            }
+            double ns = elapsed_ns(start) / iterations;
+
+            if (reference.empty())
+            {
+                reference_buttons = buttons;
+                reference = columns;
+            }
+            bool same = (reference == columns && reference_buttons == buttons);
+
+            printf("  %-13s %-6s:      %9.1f ns/frame %s\n", mode.name, kernel.name, ns, same ? "" : "(DIFFERS FROM SCALAR)");
+        }
+    }
+}
+
+// The linear scan get_gamepad_type() used to do, the baseline of bench_gamepad_type().
+static const gamepad::gamepad_type_t& find_gamepad_type_linear(gamepad::gamepad_id_t const& id)
+{
+    for (size_t i = 0; i < gamepad::s_known_gamepad_count; ++i)
+    {
+        if (gamepad::s_known_gamepads[i].id.vendorID == id.vendorID && gamepad::s_known_gamepads[i].id.productID == id.productID)
+            return gamepad::s_known_gamepads[i].type_infos;
+    }
+
+    return gamepad::s_unknown_gamepad;
+}
+
+// Looks up every known id and as many unknown ones, in a shuffled order.
+static void bench_gamepad_type(uint32_t iterations)
+{
+    std::vector<gamepad::gamepad_id_t> ids;
+    for (size_t i = 0; i < gamepad::s_known_gamepad_count; ++i)
+    {
+        gamepad::gamepad_id_t id = {};
+        id.vendorID = gamepad::s_known_gamepads[i].id.vendorID;
+        id.productID = gamepad::s_known_gamepads[i].id.productID;
+        ids.push_back(id);
+        id.productID ^= 0x5a5a;
+        ids.push_back(id);
+    }
+    uint32_t seed = 12345;
+    for (size_t i = ids.size() - 1; i > 0; --i)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        std::swap(ids[i], ids[(seed >> 8) % (i + 1)]);
+    }
+
+    uint32_t different = 0;
+    for (auto const& id : ids)
+    {
+        if (&gamepad::get_gamepad_type(id) != &find_gamepad_type_linear(id))
+            ++different;
+    }
+    if (different != 0)
+    {
+        fprintf(stderr, "get_gamepad_type differs from the linear scan on %u ids.\n", different);
+        s_bench_failed = true;
+    }
+
+    struct lookup_t
+    {
+        const char* name;
+        const gamepad::gamepad_type_t& (*find)(gamepad::gamepad_id_t const&);
+    } lookups[] = {
+        { "linear scan", &find_gamepad_type_linear },
+        { "sorted table", &gamepad::get_gamepad_type },
+    };
+
+    printf("Gamepad type lookup, %u known ids (%zu lookups x %u)\n", static_cast<uint32_t>(gamepad::s_known_gamepad_count), ids.size(), iterations);
+    for (auto const& lookup : lookups)
+    {
+        uint64_t unknown = 0;
+        auto start = bench_clock::now();
+        for (uint32_t i = 0; i < iterations; ++i)
+        {
+            for (auto const& id : ids)
+                unknown += lookup.find(id).type == gamepad::gamepad_type_t::type_e::Unknown;
+        }
+        double ns = elapsed_ns(start) / (double(iterations) * ids.size());
+        printf("  %-12s:              %9.1f ns/lookup %llu unknown\n", lookup.name, ns, static_cast<unsigned long long>(unknown / iterations));
+    }
+}
+
+// Presses and releases a button between two updates, then overflows the queue.
+static void bench_event_queue()
+{
+    fake_input_tree_t tree = make_fake_input_tree(0);
+    int fd = add_fake_gamepad(tree);
+    std::vector<gamepad::gamepad_event_t> events(gamepad::gamepad_event_queue_size);
+    uint32_t event_count;
+    uint32_t dropped_count;
+    gamepad::gamepad_state_t state;
+
+    use_fake_input_tree(tree);
+    if (wait_for_gamepads(1))
+    {
+        printf("Event queue\n");
+
+        write_fake_event(fd, EV_KEY, BTN_A, 1);
+        write_fake_event(fd, EV_SYN, SYN_REPORT, 0);
+        write_fake_event(fd, EV_KEY, BTN_A, 0);
+        write_fake_event(fd, EV_SYN, SYN_REPORT, 0);
+        gamepad::update_gamepad_state(0);
+        gamepad::get_gamepad_state(0, &state);
+        gamepad::get_gamepad_events(0, events.data(), static_cast<uint32_t>(events.size()), &event_count, &dropped_count);
+        printf("  tap between two updates:   state buttons 0x%x, %u events, %u dropped\n", state.buttons, event_count, dropped_count);
+
+        const uint32_t written = gamepad::gamepad_event_queue_size + 44;
+        for (uint32_t i = 0; i < written; ++i)
+        {
+            write_fake_event(fd, EV_ABS, ABS_X, static_cast<int32_t>(i));
+            write_fake_event(fd, EV_SYN, SYN_REPORT, 0);
+        }
+        gamepad::update_gamepad_state(0);
+        gamepad::get_gamepad_events(0, events.data(), static_cast<uint32_t>(events.size()), &event_count, &dropped_count);
+        printf("  %u axis events:           %u events, %u dropped\n", written, event_count, dropped_count);
+    }
+
+    gamepad::free_gamepad_resources();
+    remove_fake_input_tree(tree);
+}
+
+// Runs the benchmark on the epoll/read() path, then on the io_uring one when the library is built with it.
+// The fake gamepads are FIFOs: io_uring reads them directly, the read() interposer does not see those.
+static void for_each_read_path(std::function<void()> const& run)
+{
+#if defined(GAMEPAD_USE_IO_URING)
+    setenv("GAMEPAD_DISABLE_IO_URING", "1", 1);
+    printf("[epoll]\n");
+    run();
+    unsetenv("GAMEPAD_DISABLE_IO_URING");
+    printf("[io_uring]\n");
+    run();
+#else
+    run();
+#endif
+}
+
+struct bench_t
+{
+    const char* name;
+    std::function<void()> run;
+};
+
+// gamepad_bench [--quick] [node_count [iterations]] [bench names...]
+// Needs no gamepad nor /dev/input access, --quick shortens every benchmark for CI runs.
+int main(int argc, char* argv[])
+{
+    std::vector<uint32_t> numbers;
+    std::vector<std::string> selected;
+    bool quick = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--quick") == 0)
+            quick = true;
+        else if (isdigit(static_cast<unsigned char>(argv[i][0])))
+            numbers.emplace_back(static_cast<uint32_t>(strtoul(argv[i], nullptr, 10)));
+        else
+            selected.emplace_back(argv[i]);
+    }
+
+    const uint32_t iterations = numbers.size() > 1 ? numbers[1] : (quick ? 20 : 200);
+    const uint32_t scale = quick ? 10 : 1;
+    std::vector<uint32_t> node_counts = { 10, 40, 160 };
+    if (!numbers.empty())
+        node_counts.assign(1, numbers[0]);
+
+    const bench_t benches[] = {
+        { "scan"        , [&]() { for (uint32_t node_count : node_counts) bench_scan(node_count, iterations); } },
+        { "gamepad_scan", [&]() { for (uint32_t gamepad_count : { 16u, 64u, 256u }) bench_gamepad_scan(gamepad_count, iterations); } },
+        { "idle_update" , [&]() { bench_idle_update(bench_gamepad_count, iterations * 50); } },
+        { "concurrent"  , [&]() { for (uint32_t gamepad_count : { 4u, 1u }) bench_concurrent_reads(gamepad_count, 300 / scale); } },
+        { "reader"      , [&]() { for_each_read_path([&]() { bench_reader_thread(1000 / scale); }); } },
+        { "event_queue" , [&]() { bench_event_queue(); } },
+        { "decode"      , [&]() { bench_decode(bench_gamepad_count, quick ? 1 : 10); } },
+        { "stream"      , [&]() { for_each_read_path([&]() {
+                                          bench_stream(bench_gamepad_count, 10000 / scale, 1);
+                                          // A 1 kHz gamepad polled by a 30 Hz game loop.
+                                          bench_stream(bench_gamepad_count, 1000 / scale, 32); }); } },
+        { "reader_threads", [&]() { for (uint32_t thread_count : { 1u, 2u, 4u, 8u })
+                                          bench_reader_threads(bench_gamepad_count, thread_count, 20000 / scale); } },
+        { "replay"      , [&]() { bench_replay(100000 / scale); } },
+        { "resync"      , [&]() { for_each_read_path([&]() { bench_resync(10000 / scale); }); } },
+        { "axis"        , [&]() { bench_axis_transform(quick ? 2 : 20); } },
+        { "vibration"   , [&]() { bench_vibration(10000 / scale, 3); } },
+        { "haptics"     , [&]() { bench_haptics_scheduler(bench_gamepad_count); } },
+        { "processing"  , [&]() { bench_processing(iterations * 500); } },
+        { "gamepad_type", [&]() { bench_gamepad_type(iterations * 50); } },
+    };
+
+    for (bench_t const& bench : benches)
+    {
+        if (selected.empty() || std::find(selected.begin(), selected.end(), bench.name) != selected.end())
+            bench.run();
+    }
+
+    return s_bench_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
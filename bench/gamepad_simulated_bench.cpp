@@ -0,0 +1,128 @@
+/* Copyright (C) Nemirtingas
+ * This file is part of gamepad.
+ *
+ * gamepad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * gamepad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gamepad.  If not, see <https://www.gnu.org/licenses/>
+ */
+
+// Game loop load test on the simulated backend: no device nor OS access needed.
+#include <gamepad/gamepad_simulation.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+using bench_clock = std::chrono::steady_clock;
+
+static std::atomic<uint32_t> s_connections(0);
+static std::atomic<uint32_t> s_disconnections(0);
+static std::atomic<uint64_t> s_rumble_writes(0);
+
+static void on_connection(uint32_t, bool connected, void*)
+{
+    ++(connected ? s_connections : s_disconnections);
+}
+
+static void on_rumble(uint32_t, float, float, void*)
+{
+    ++s_rumble_writes;
+}
+
+// gamepad_simulated_bench [seconds [frame_rate_hz [report_rate_hz]]]
+int main(int argc, char* argv[])
+{
+    uint32_t seconds = argc > 1 ? static_cast<uint32_t>(strtoul(argv[1], nullptr, 10)) : 5;
+    uint32_t frame_rate_hz = argc > 2 ? static_cast<uint32_t>(strtoul(argv[2], nullptr, 10)) : 1000;
+    uint32_t report_rate_hz = argc > 3 ? static_cast<uint32_t>(strtoul(argv[3], nullptr, 10)) : 1000;
+
+    gamepad::gamepad_simulation_t simulation;
+    simulation.gamepad_count = std::min<uint32_t>(16, gamepad::max_connected_gamepads);
+    simulation.report_rate_hz = report_rate_hz;
+    simulation.report_burst_size = 1;
+    simulation.rumble_rate_hz = 60;
+    simulation.reconnect_period_ms = 500;
+
+    gamepad::set_gamepad_connection_callback(&on_connection, nullptr);
+    gamepad::set_simulated_rumble_sink(&on_rumble, nullptr);
+    if (gamepad::start_gamepad_simulation(simulation) != gamepad::success)
+    {
+        fprintf(stderr, "Failed to start the simulation.\n");
+        return EXIT_FAILURE;
+    }
+
+    uint32_t buttons[gamepad::max_connected_gamepads];
+    float columns[6][gamepad::max_connected_gamepads];
+    gamepad::gamepad_states_soa_t states = { buttons, columns[0], columns[1], columns[2], columns[3], columns[4], columns[5] };
+    gamepad::gamepad_event_t events[gamepad::gamepad_event_queue_size];
+    const uint32_t frames = seconds * frame_rate_hz;
+    const auto frame_period = std::chrono::nanoseconds(1000000000 / frame_rate_hz);
+    double total_ns = 0.0;
+    double max_ns = 0.0;
+    uint64_t event_total = 0;
+    uint64_t dropped_total = 0;
+
+    auto next_frame = bench_clock::now();
+    for (uint32_t frame = 0; frame < frames; ++frame)
+    {
+        uint32_t changed_mask[gamepad::gamepad_mask_words];
+        uint32_t connected_mask[gamepad::gamepad_mask_words];
+
+        auto start = bench_clock::now();
+        gamepad::update_all_gamepads(changed_mask);
+        gamepad::get_all_gamepad_states(states, connected_mask);
+        for (uint32_t i = 0; i < gamepad::max_connected_gamepads; ++i)
+        {
+            uint32_t event_count;
+            uint32_t dropped_count;
+            if (gamepad::is_gamepad_in_mask(connected_mask, i) && gamepad::get_gamepad_events(i, events, gamepad::gamepad_event_queue_size, &event_count, &dropped_count) == gamepad::success)
+            {
+                event_total += event_count;
+                dropped_total += dropped_count;
+            }
+        }
+        double ns = std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+        total_ns += ns;
+        max_ns = std::max(max_ns, ns);
+
+        next_frame += frame_period;
+        std::this_thread::sleep_until(next_frame);
+    }
+
+    // The last gamepad is the last one reconnected, it keeps the longest history.
+    const uint32_t latency_index = simulation.gamepad_count - 1;
+    gamepad::gamepad_latency_t latency;
+    bool has_latency = gamepad::get_gamepad_latency(latency_index, &latency, false) == gamepad::success;
+
+    gamepad::free_gamepad_resources();
+
+    printf("Simulated game loop, %u gamepads at %u Hz, %u frames at %u Hz\n", simulation.gamepad_count, report_rate_hz, frames, frame_rate_hz);
+    printf("  update + states + events:  %9.1f ns/frame mean %9.1f ns max\n", total_ns / frames, max_ns);
+    printf("  events:                    %9.1f per frame, %llu dropped\n", double(event_total) / frames, static_cast<unsigned long long>(dropped_total));
+    printf("  connections:               %9u connected %u disconnected\n", s_connections.load(), s_disconnections.load());
+    printf("  rumble writes:             %9llu\n", static_cast<unsigned long long>(s_rumble_writes.load()));
+    if (has_latency)
+    {
+        printf("  report to state (pad %2u):  %9llu us p50 %llu us p99 %llu us p999 (%llu reports, %llu dropped)\n", latency_index,
+            static_cast<unsigned long long>(gamepad::get_latency_percentile(latency.visible, 50.0)),
+            static_cast<unsigned long long>(gamepad::get_latency_percentile(latency.visible, 99.0)),
+            static_cast<unsigned long long>(gamepad::get_latency_percentile(latency.visible, 99.9)),
+            static_cast<unsigned long long>(latency.visible.count),
+            static_cast<unsigned long long>(latency.visible.dropped));
+    }
+
+    return EXIT_SUCCESS;
+}
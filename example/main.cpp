@@ -2,6 +2,7 @@
 
 #include <memory>
 #include <thread>
+#include <stdio.h>
 #include <string.h>
 
 #include "conio.h"
@@ -43,6 +44,9 @@ enum DeviceConsoleBufferIndex
     DEVICE_STATE_LEFTTHUMBY           ,
     DEVICE_STATE_RIGHTTHUMBX          ,
     DEVICE_STATE_RIGHTTHUMBY          ,
+    DEVICE_LATENCY_HEADER             ,
+    DEVICE_LATENCY_READ               ,
+    DEVICE_LATENCY_VISIBLE            ,
     DEVICE_MAX_CONSOLE_LINES
 };
 
@@ -55,8 +59,9 @@ struct GamepadDevice_t
     int device_index;
     char console_buffer[DEVICE_MAX_CONSOLE_LINES][MAX_DEVICE_LINE_WIDTH+1];
     gamepad::gamepad_id_t id;
-    gamepad::gamepad_state_t old_state;
     gamepad::gamepad_state_t state;
+    uint64_t state_sequence;
+    gamepad::gamepad_latency_t latency;
 };
 
 void BuildDeviceConsoleOutput(GamepadDevice_t& device)
@@ -91,6 +96,16 @@ void BuildDeviceConsoleOutput(GamepadDevice_t& device)
     SPRINTF(device.console_buffer[DEVICE_STATE_LEFTTHUMBY]           , "  - Left Y   : %.2f" , device.state.left_stick.y);
     SPRINTF(device.console_buffer[DEVICE_STATE_RIGHTTHUMBX]          , "  - Right X  : %.2f" , device.state.right_stick.x);
     SPRINTF(device.console_buffer[DEVICE_STATE_RIGHTTHUMBY]          , "  - Right Y  : %.2f" , device.state.right_stick.y);
+    // Latency
+    SPRINTF(device.console_buffer[DEVICE_LATENCY_HEADER]             , "Latency (us p50/p99/p999):");
+    SPRINTF(device.console_buffer[DEVICE_LATENCY_READ]               , "  - Read     : %llu/%llu/%llu",
+        static_cast<unsigned long long>(gamepad::get_latency_percentile(device.latency.read, 50.0)),
+        static_cast<unsigned long long>(gamepad::get_latency_percentile(device.latency.read, 99.0)),
+        static_cast<unsigned long long>(gamepad::get_latency_percentile(device.latency.read, 99.9)));
+    SPRINTF(device.console_buffer[DEVICE_LATENCY_VISIBLE]            , "  - Visible  : %llu/%llu/%llu",
+        static_cast<unsigned long long>(gamepad::get_latency_percentile(device.latency.visible, 50.0)),
+        static_cast<unsigned long long>(gamepad::get_latency_percentile(device.latency.visible, 99.0)),
+        static_cast<unsigned long long>(gamepad::get_latency_percentile(device.latency.visible, 99.9)));
 }
 
 void PrintDeviceConsoleOutput(GamepadDevice_t& device)
@@ -115,13 +130,16 @@ void PrintDeviceConsoleOutput(GamepadDevice_t& device)
     fflush(stdout);
 }
 
-void OnDeviceInfoChange(GamepadDevice_t& device)
+void OnDeviceInfoChange(GamepadDevice_t& device, uint32_t dirty_mask)
 {
+    if (gamepad::get_gamepad_latency(device.device_index, &device.latency, false) != gamepad::success)
+        memset(&device.latency, 0, sizeof(device.latency));
+
     BuildDeviceConsoleOutput(device);
     PrintDeviceConsoleOutput(device);
-    memcpy(&device.old_state, &device.state, sizeof(device.state));
 
-    gamepad::set_gamepad_vibration(device.device_index, device.state.left_trigger, device.state.right_trigger);
+    if (gamepad::is_any_pressed(dirty_mask, gamepad::state_field_left_trigger | gamepad::state_field_right_trigger))
+        gamepad::set_gamepad_vibration(device.device_index, device.state.left_trigger, device.state.right_trigger);
 }
 
 void OnDeviceConnect(GamepadDevice_t& device)
@@ -130,10 +148,8 @@ void OnDeviceConnect(GamepadDevice_t& device)
         return;
 
     device.connected = true;
-    memset(&device.old_state, 0, sizeof(device.old_state));
-    memset(&device.state, 0, sizeof(device.state));
 
-    OnDeviceInfoChange(device);
+    OnDeviceInfoChange(device, gamepad::state_field_left_trigger | gamepad::state_field_right_trigger);
 }
 
 void OnDeviceDisconnect(GamepadDevice_t& device)
@@ -142,7 +158,7 @@ void OnDeviceDisconnect(GamepadDevice_t& device)
     memset(&device.id, 0xff, sizeof(device.id));
     memset(&device.state, 0, sizeof(device.state));
 
-    OnDeviceInfoChange(device);
+    OnDeviceInfoChange(device, gamepad::state_field_none);
 }
 
 int main(int argc, char *argv[])
@@ -153,6 +169,7 @@ int main(int argc, char *argv[])
     for (int i = 0; i < MaxControllerCount; ++i)
     {
         devices[i].device_index = i;
+        devices[i].state_sequence = 0;
         OnDeviceDisconnect(devices[i]);
     }
 
@@ -161,15 +178,20 @@ int main(int argc, char *argv[])
         for (int i = 0; i < MaxControllerCount; ++i)
         {
             GamepadDevice_t& device = devices[i];
-            if (gamepad::update_gamepad_state(i) == gamepad::success && gamepad::get_gamepad_state(i, &device.state) == gamepad::success)
+            uint32_t dirty_mask;
+            if (gamepad::update_gamepad_state(i) == gamepad::success && gamepad::get_gamepad_changes(i, device.state_sequence, &device.state_sequence, &dirty_mask) == gamepad::success)
             {
+                // The state is only read when something changed since the last one we've seen.
+                if ((dirty_mask != gamepad::state_field_none || device.connected == false) && gamepad::get_gamepad_state(i, &device.state) != gamepad::success)
+                    continue;
+
                 if (device.connected == false)
                 {
                     OnDeviceConnect(device);
                 }
-                else if (memcmp(&device.old_state, &device.state, sizeof(device.state)) != 0)
+                else if (dirty_mask != gamepad::state_field_none)
                 {
-                    OnDeviceInfoChange(device);
+                    OnDeviceInfoChange(device, dirty_mask);
                 }
             }
             else if (device.connected)
@@ -59,11 +59,27 @@ struct stick_pos_t
     // Up    =  1.0f
     float y;
 
-    bool operator ==(stick_pos_t const& other) { return x == other.x && y == other.y; }
-    bool operator !=(stick_pos_t const& other) { return !(*this == other); }
+    bool operator ==(stick_pos_t const& other) const { return x == other.x && y == other.y; }
+    bool operator !=(stick_pos_t const& other) const { return !(*this == other); }
 };
 
-constexpr uint32_t max_connected_gamepads = 16;
+// Slots are allocated 16 at a time when first used, building with a larger GAMEPAD_MAX_CONNECTED_GAMEPADS
+// (GAMEPAD_MAX_GAMEPADS in CMake) costs little until the devices actually show up. It sizes the caller's masks
+// and state columns too, every user of the library must see the same value.
+#ifndef GAMEPAD_MAX_CONNECTED_GAMEPADS
+#define GAMEPAD_MAX_CONNECTED_GAMEPADS 16
+#endif
+constexpr uint32_t max_connected_gamepads = GAMEPAD_MAX_CONNECTED_GAMEPADS;
+static_assert(max_connected_gamepads % 16 == 0, "GAMEPAD_MAX_CONNECTED_GAMEPADS must be a multiple of 16.");
+
+// Gamepad masks are arrays of gamepad_mask_words words, gamepad N being bit N % 32 of word N / 32.
+// With the default 16 slots it is a single uint32_t.
+constexpr uint32_t gamepad_mask_words = (max_connected_gamepads + 31) / 32;
+
+constexpr inline bool is_gamepad_in_mask(uint32_t const* mask, uint32_t index)
+{
+    return (mask[index / 32] & (1u << (index % 32))) != 0;
+}
 
 constexpr int32_t success = 0;
 constexpr int32_t failed = -1;
@@ -94,6 +110,18 @@ constexpr uint32_t button_paddle1        = 0x00020000u;
 constexpr uint32_t button_paddle2        = 0x00040000u;
 constexpr uint32_t button_paddle3        = 0x00080000u;
 constexpr uint32_t button_paddle4        = 0x00100000u;
+// Set by process_gamepad_states() when a trigger is past the threshold.
+constexpr uint32_t button_left_trigger   = 0x00200000u;
+constexpr uint32_t button_right_trigger  = 0x00400000u;
+
+// Fields of the dirty mask returned by get_gamepad_changes().
+constexpr uint32_t state_field_none          = 0x00000000u;
+constexpr uint32_t state_field_buttons       = 0x00000001u;
+constexpr uint32_t state_field_left_stick    = 0x00000002u;
+constexpr uint32_t state_field_right_stick   = 0x00000004u;
+constexpr uint32_t state_field_left_trigger  = 0x00000008u;
+constexpr uint32_t state_field_right_trigger = 0x00000010u;
+constexpr uint32_t state_field_connection    = 0x00000020u;
 
 constexpr inline bool are_all_pressed(uint32_t buttons, uint32_t button_mask)
 {
@@ -129,29 +157,252 @@ struct gamepad_state_t
     float left_trigger;
     float right_trigger;
 
-    bool operator ==(gamepad_state_t const& other)
+    bool operator ==(gamepad_state_t const& other) const
     {
         return buttons == other.buttons
             && left_stick.x == other.left_stick.x
             && left_stick.y == other.left_stick.y
             && right_stick.x == other.right_stick.x
             && right_stick.y == other.right_stick.y
-            && left_trigger == left_trigger
-            && right_trigger == right_trigger;
+            && left_trigger == other.left_trigger
+            && right_trigger == other.right_trigger;
     }
 
-    bool operator !=(gamepad_state_t const& other) { return !(*this == other); }
+    bool operator !=(gamepad_state_t const& other) const { return !(*this == other); }
+};
+
+struct gamepad_event_t
+{
+    enum class type_e : uint8_t
+    {
+        button_down,
+        button_up,
+        axis,
+    };
+
+    // Same order as the gamepad_state_t axes.
+    enum class axis_e : uint8_t
+    {
+        left_stick_x,
+        left_stick_y,
+        right_stick_x,
+        right_stick_y,
+        left_trigger,
+        right_trigger,
+    };
+
+    // Kernel timestamp of the event in microseconds (CLOCK_MONOTONIC on Linux).
+    uint64_t timestamp_us;
+    type_e type;
+    // type_e::axis only.
+    axis_e axis;
+    // One of the button_* values, type_e::button_down and type_e::button_up only.
+    uint32_t button;
+    // type_e::axis only, normalized like the gamepad_state_t axes.
+    float value;
+};
+
+constexpr uint32_t gamepad_event_queue_size = 256;
+
+// Caller-provided columns, every pointer to max_connected_gamepads values, entry N being gamepad N.
+struct gamepad_states_soa_t
+{
+    uint32_t* buttons;
+    float* lx;
+    float* ly;
+    float* rx;
+    float* ry;
+    float* lt;
+    float* rt;
+};
+
+enum class deadzone_mode_e : uint32_t
+{
+    none,
+    // Each axis is zeroed on its own.
+    axial,
+    // The stick is zeroed when its distance from the center is within the deadzone.
+    radial,
+    // Like radial, the remaining distance is scaled back to [0.0, 1.0].
+    scaled_radial,
+};
+
+struct gamepad_processing_t
+{
+    deadzone_mode_e deadzone_mode;
+    float left_thumb_deadzone;
+    float right_thumb_deadzone;
+    float trigger_threshold;
+};
+
+constexpr gamepad_processing_t default_gamepad_processing = {
+    deadzone_mode_e::scaled_radial,
+    gamepad_left_thumb_deadzone,
+    gamepad_right_thumb_deadzone,
+    gamepad_trigger_threshold,
 };
 
 const gamepad_type_t& get_gamepad_type(gamepad_id_t const& id);
 int32_t update_gamepad_state(uint32_t index);
+// Updates every connected gamepad under a single lock, changed_mask (gamepad_mask_words words) gets the gamepads
+// that changed.
+int32_t update_all_gamepads(uint32_t* changed_mask);
 int32_t get_gamepad_id(uint32_t index, gamepad_id_t* id);
+// Lock-free, even for an empty slot once the first call started the device discovery. On Windows, where new
+// gamepads are only found by looking the empty slots up, an empty slot still takes the library lock.
 int32_t get_gamepad_state(uint32_t index, gamepad_state_t* state);
+// Fills the columns with the state of every gamepad, all captured at the same time. connected_mask
+// (gamepad_mask_words words) gets the connected gamepads, the columns of the other ones are zeroed.
+int32_t get_all_gamepad_states(gamepad_states_soa_t const& states, uint32_t* connected_mask);
+// Lock-free. sequence is the change sequence of the gamepad, it only moves when a value actually changed (or the
+// gamepad got connected or disconnected). dirty_mask gets the state_field_* changed after last_seen_sequence, pass
+// the sequence of the previous call (0 the first time) and skip the state read when dirty_mask is empty.
+int32_t get_gamepad_changes(uint32_t index, uint64_t last_seen_sequence, uint64_t* sequence, uint32_t* dirty_mask);
 // Normalized strength ([0.0, 1.0])
+// On Linux, setting the same strengths again costs nothing and the changes made after the first one of a frame
+// (until the gamepad is updated again) are merged, the last one is sent when the next update begins. Stopping
+// (0.0, 0.0) is never merged, it is sent right away.
 int32_t set_gamepad_vibration(uint32_t index, float left_strength, float right_strength);
 int32_t set_gamepad_led(uint32_t index, uint8_t r, uint8_t g, uint8_t b);
 
-// If you feel like freeing resources before leaving, call this.
+struct rumble_envelope_t
+{
+    // Peak normalized strength ([0.0, 1.0])
+    float left_strength;
+    float right_strength;
+    // Ramp from 0 to the peak, hold it, then ramp back to 0.
+    uint32_t attack_ms;
+    uint32_t sustain_ms;
+    uint32_t decay_ms;
+};
+
+// Rumble patterns are played by a library thread: these calls only queue them and never wait for the device.
+// The thread sends at most one update per gamepad every haptics_tick_ms. Starting a pattern replaces the one
+// the gamepad was playing, set_gamepad_vibration() cancels it.
+constexpr uint32_t haptics_tick_ms = 8;
+int32_t play_gamepad_rumble_envelope(uint32_t index, rumble_envelope_t const& envelope);
+// Plays left_samples[i] and right_samples[i] (normalized) in turn, sample_rate_hz samples per second.
+int32_t play_gamepad_rumble_samples(uint32_t index, float const* left_samples, float const* right_samples, uint32_t sample_count, uint32_t sample_rate_hz);
+// Stops the pattern and the rumble of the gamepad.
+int32_t stop_gamepad_rumble_pattern(uint32_t index);
+// Pops up to max_events events of the gamepad, oldest first, and stores how many in event_count.
+// Events are queued when the gamepad is updated (update functions or reader thread), alongside its state.
+// Past gamepad_event_queue_size events the oldest are dropped, dropped_count (can be nullptr) gets how many
+// were lost since the last call. Linux only, failed elsewhere.
+int32_t get_gamepad_events(uint32_t index, gamepad_event_t* events, uint32_t max_events, uint32_t* event_count, uint32_t* dropped_count);
+
+// Appends the raw evdev events of the gamepad to path as they are read, after a header holding its id and axis
+// ranges. The header is written first, so the file can be replayed while it is still recorded. Recordings only
+// replay on machines with the same struct input_event layout. Linux only, failed elsewhere.
+int32_t start_gamepad_recording(uint32_t index, const char* path);
+int32_t stop_gamepad_recording(uint32_t index);
+
+enum class replay_speed_e : uint32_t
+{
+    // The events are due at their recorded pace, starting from the first update.
+    real_time,
+    // Every update replays all the events left, the recording is decoded as fast as possible.
+    max_speed,
+};
+
+// Connects a recording as a gamepad in a free slot, stored in index. It behaves like the recorded device and is
+// advanced by update_gamepad_state() and update_all_gamepads() (not by the reader thread). At the end of the file
+// it keeps its last state and picks up the events a recorder still appends. Linux only, failed elsewhere.
+int32_t start_gamepad_replay(const char* path, replay_speed_e speed, uint32_t* index);
+// Disconnects the replayed gamepad.
+int32_t stop_gamepad_replay(uint32_t index);
+
+// Input latency of a gamepad in microseconds, from the kernel timestamp of each report to the moment it was read
+// (read) and to the moment get_gamepad_state() could see it (visible). Buckets are exact below 32us, then 16 per
+// power of two (about 6% precision). Linux and simulated backends only, the histograms stay empty elsewhere and
+// for replayed gamepads.
+constexpr uint32_t latency_bucket_count = 464;
+struct latency_histogram_t
+{
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+    // Reports left out of the visible histogram: more than 1024 of them were decoded between two publications.
+    uint64_t dropped;
+    uint32_t buckets[latency_bucket_count];
+};
+
+struct gamepad_latency_t
+{
+    latency_histogram_t read;
+    latency_histogram_t visible;
+};
+
+// Lock-free copy of the histograms of the slot, cleared afterward when reset is true. They restart empty
+// when a new gamepad takes the slot.
+int32_t get_gamepad_latency(uint32_t index, gamepad_latency_t* latency, bool reset);
+// Upper bound of the bucket holding the percentile ([0.0, 100.0]) of the histogram, 0 when it is empty.
+uint64_t get_latency_percentile(latency_histogram_t const& histogram, double percentile);
+
+// Library counters since startup or the last reset. The device ones are only filled by the Linux backend.
+struct gamepad_stats_t
+{
+    // Hotplug: /dev/input listings, nodes checked, device opens (retries wait for write access).
+    uint64_t directory_scans;
+    uint64_t nodes_probed;
+    uint64_t device_opens;
+    uint64_t open_retries;
+    uint64_t open_failures;
+    // read() calls on the devices and their outcome.
+    uint64_t reads;
+    uint64_t reads_with_data;
+    uint64_t reads_would_block;
+    uint64_t read_errors;
+    // io_uring_enter calls and completions, when the library is built with GAMEPAD_IO_URING.
+    uint64_t uring_enters;
+    uint64_t uring_completions;
+    // Events decoded by type.
+    uint64_t syn_events;
+    uint64_t key_events;
+    uint64_t abs_events;
+    uint64_t other_events;
+    // SYN_DROPPED received (kernel buffer overflows) and state reloads from the kernel, at open and after drops.
+    uint64_t sync_drops;
+    uint64_t resyncs;
+    // Force feedback effect uploads (ioctl) and play/stop writes.
+    uint64_t ff_uploads;
+    uint64_t ff_writes;
+    uint64_t ff_errors;
+    // Library lock acquisitions, the ones that had to wait and how long they waited.
+    uint64_t mutex_locks;
+    uint64_t mutex_contentions;
+    uint64_t mutex_wait_ns;
+};
+
+// Copies the counters, cleared afterward when reset is true. The library must be built with GAMEPAD_ENABLE_STATS,
+// otherwise stats is zeroed and failed is returned.
+int32_t get_gamepad_stats(gamepad_stats_t* stats, bool reset);
+
+// Called when a gamepad is connected (connected = true) or disconnected.
+// It can be called from a library thread, but never while the library holds its lock,
+// so the callback is free to call the gamepad functions.
+typedef void (*connection_callback_t)(uint32_t index, bool connected, void* user_param);
+// Gamepads already connected are reported right away. Pass nullptr to remove the callback.
+int32_t set_gamepad_connection_callback(connection_callback_t callback, void* user_param);
+// Starts a library thread that reads the gamepads as soon as their input arrives (Linux only, failed elsewhere).
+// get_gamepad_state() then returns their latest state without any update_gamepad_state() call.
+int32_t start_gamepad_reader_thread();
+// Same with the gamepads spread over thread_count reader threads, gamepad N being read by thread N % thread_count
+// through its own epoll set. The threads never wait on each other nor on the library lock while reading, a call
+// on a gamepad only waits for the thread reading it. pin_threads pins thread N to the Nth cpu the process may run on.
+// Fails when start_gamepad_reader_thread() already runs.
+constexpr uint32_t max_reader_threads = 64;
+int32_t start_gamepad_reader_threads(uint32_t thread_count, bool pin_threads);
+// Stops the reader thread(s), free_gamepad_resources() stops them as well.
+int32_t stop_gamepad_reader_thread();
+
+// Applies the stick deadzones to the states in place and sets button_left_trigger and button_right_trigger
+// from the trigger threshold, the analog trigger values are kept. Runs with the widest vector unit of the cpu.
+void process_gamepad_states(gamepad_processing_t const& processing, gamepad_state_t* states, uint32_t count);
+// Same on the columns filled by get_all_gamepad_states(), without any copy.
+void process_gamepad_states(gamepad_processing_t const& processing, gamepad_states_soa_t const& states);
+
+// If you feel like freeing resources before leaving, call this. The library threads are stopped at exit otherwise.
 void free_gamepad_resources();
 
 }
@@ -0,0 +1,59 @@
+/* Copyright (C) Nemirtingas
+ * This file is part of gamepad.
+ *
+ * gamepad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * gamepad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gamepad.  If not, see <https://www.gnu.org/licenses/>
+ */
+
+#pragma once
+
+#include "gamepad.h"
+
+// Only available when the library is built with GAMEPAD_SIMULATED_BACKEND: the gamepads then live in memory,
+// the gamepad.h functions see them like real devices.
+
+namespace gamepad
+{
+
+// Plugs a gamepad in the slot, it shows up with the next update or call on the slot like a hotplugged device.
+int32_t connect_simulated_gamepad(uint32_t index, gamepad_id_t const& id);
+int32_t disconnect_simulated_gamepad(uint32_t index);
+// Queues input reports, the next update of the gamepad applies them in order and queues their events.
+// Only the latest simulated_report_queue_size reports are kept between two updates.
+constexpr uint32_t simulated_report_queue_size = 4096;
+int32_t push_simulated_gamepad_reports(uint32_t index, gamepad_state_t const* reports, uint32_t report_count);
+
+// Receives what the library sends to the simulated rumble motors. It is called with the library lock held,
+// it must not call the gamepad functions.
+typedef void (*simulated_rumble_sink_t)(uint32_t index, float left_strength, float right_strength, void* user_param);
+int32_t set_simulated_rumble_sink(simulated_rumble_sink_t sink, void* user_param);
+
+struct gamepad_simulation_t
+{
+    // Gamepads connected in slots [0, gamepad_count).
+    uint32_t gamepad_count;
+    // Input reports per gamepad per second, pushed report_burst_size at a time.
+    uint32_t report_rate_hz;
+    uint32_t report_burst_size;
+    // set_gamepad_vibration() calls per gamepad per second, 0 for none.
+    uint32_t rumble_rate_hz;
+    // Every period one of the gamepads is unplugged and plugged back, 0 to never do it.
+    uint32_t reconnect_period_ms;
+};
+
+// Starts a library thread scripting the gamepads at the given rates, stop_gamepad_simulation()
+// and free_gamepad_resources() stop it. The gamepads stay connected after it stopped.
+int32_t start_gamepad_simulation(gamepad_simulation_t const& simulation);
+int32_t stop_gamepad_simulation();
+
+}
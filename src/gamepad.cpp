@@ -17,7 +17,15 @@
 
 #include <gamepad/gamepad.h>
 #include "gamepad_internal.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <memory>
 #include <mutex>
+#include <new>
+#include <thread>
 #include <vector>
 
 namespace gamepad 
@@ -25,1326 +33,4747 @@ namespace gamepad
 struct gamepad_context_t;
 
 static int32_t internal_get_gamepad(uint32_t index, gamepad_context_t** pp_context);
+// Called with s_gamepad_mutex held. Returns true once the backend keeps the published states in line with the
+// connections by itself, the lookups of empty slots then never need to take the lock.
+static bool    internal_start_discovery();
 static int32_t internal_update_gamepad_state(gamepad_context_t* p_context);
+static int32_t internal_update_all_gamepads(uint32_t* p_changed_mask);
 static int32_t internal_get_gamepad_state(gamepad_context_t* p_context, gamepad_state_t* p_gamepad_state);
 static int32_t internal_get_gamepad_id(gamepad_context_t* p_context, gamepad_id_t* p_gamepad_id);
 static int32_t internal_set_gamepad_vibration(gamepad_context_t* p_context, float left_strength, float right_strength);
+// Sends the strengths now, unlike internal_set_gamepad_vibration which can defer them to the next frame.
+static int32_t internal_write_gamepad_vibration(gamepad_context_t* p_context, float left_strength, float right_strength);
 static int32_t internal_set_gamepad_led(gamepad_context_t* p_context, uint8_t r, uint8_t g, uint8_t b);
+static int32_t internal_get_gamepad_events(gamepad_context_t* p_context, gamepad_event_t* p_events, uint32_t max_events, uint32_t* p_event_count, uint32_t* p_dropped_count);
+static int32_t internal_start_gamepad_recording(gamepad_context_t* p_context, const char* path);
+static int32_t internal_stop_gamepad_recording(gamepad_context_t* p_context);
+// Called without s_gamepad_mutex held.
+static int32_t internal_start_gamepad_replay(const char* path, replay_speed_e speed, uint32_t* p_index);
+static int32_t internal_stop_gamepad_replay(uint32_t index);
 static void    internal_free_all_contexts();
-
-static std::mutex s_gamepad_mutex;
-static gamepad_context_t* s_gamepads[max_connected_gamepads] = {
-    nullptr, nullptr, nullptr, nullptr,
-    nullptr, nullptr, nullptr, nullptr,
-    nullptr, nullptr, nullptr, nullptr,
-    nullptr, nullptr, nullptr, nullptr,
+// Called without s_gamepad_mutex held, unless the library is being freed.
+static void    internal_free_context(gamepad_context_t** pp_context);
+// Called without s_gamepad_mutex held, background threads might need it to exit.
+static void    internal_stop_threads();
+// Called when a library thread is created, so it is joined at exit.
+static void    register_threads_cleanup();
+// Called with s_reader_thread_mutex held, but not s_gamepad_mutex.
+static int32_t internal_start_reader_thread();
+static int32_t internal_start_reader_threads(uint32_t thread_count, bool pin_threads);
+static void    internal_stop_reader_thread();
+// Called with s_gamepad_mutex held, locks the reader thread decoding the gamepad input (if any).
+static std::unique_lock<std::mutex> internal_lock_reader(gamepad_context_t* p_context);
+
+struct connection_event_t
+{
+    uint32_t index;
+    bool connected;
 };
 
-template<typename ...Args>
-static inline int32_t call_internal_action(uint32_t index, int32_t(*pfn_internal)(gamepad_context_t*, Args ...), Args ...args)
+struct pending_connection_events_t
 {
-    std::lock_guard<std::mutex> lk(s_gamepad_mutex);
+    connection_callback_t callback;
+    void* user_param;
+    std::vector<connection_event_t> events;
+    // Freed with the events dispatched, see s_released_contexts.
+    std::vector<gamepad_context_t*> released_contexts;
+};
 
-    int32_t res;
+// Fixed size ring of the decoded events of a gamepad, the oldest events are overwritten when it is full.
+struct gamepad_event_queue_t
+{
+    gamepad_event_t events[gamepad_event_queue_size];
+    uint32_t head;
+    uint32_t count;
+    uint32_t dropped;
+};
 
-    gamepad_context_t* p_context;
-    if ((res = internal_get_gamepad(index, &p_context)) != gamepad::success)
-        return res;
+static inline void reset_event_queue(gamepad_event_queue_t& queue)
+{
+    queue.head = 0;
+    queue.count = 0;
+    queue.dropped = 0;
+}
 
-    return pfn_internal(p_context, std::forward<Args>(args)...);
+static inline void push_event(gamepad_event_queue_t& queue, gamepad_event_t const& event)
+{
+    queue.events[(queue.head + queue.count) % gamepad_event_queue_size] = event;
+    if (queue.count < gamepad_event_queue_size)
+    {
+        ++queue.count;
+    }
+    else
+    {
+        queue.head = (queue.head + 1) % gamepad_event_queue_size;
+        ++queue.dropped;
+    }
 }
 
-const gamepad_type_t& get_gamepad_type(gamepad_id_t const& id)
+// Queues a button_down or button_up event for every button that differs between old_buttons and new_buttons.
+static void push_button_events(gamepad_event_queue_t& queue, uint64_t timestamp_us, uint32_t old_buttons, uint32_t new_buttons)
 {
-    static const struct internal_gamepad_map_t
-    {
-        gamepad_id_t id;
-        gamepad_type_t type_infos;
-    } known_gamepads[] = {
-        {{0x0079, 0x18d4}, gamepad_type_t::type_e::Xbox360, "GPD Win 2 X-Box Controller"},
-        {{0x044f, 0xb326}, gamepad_type_t::type_e::Xbox360, "Thrustmaster Gamepad GP XID"},
-        {{0x045e, 0x028e}, gamepad_type_t::type_e::Xbox360, "Microsoft X-Box 360 pad"},
-        {{0x045e, 0x028f}, gamepad_type_t::type_e::Xbox360, "Microsoft X-Box 360 pad v2"},
-        {{0x045e, 0x0291}, gamepad_type_t::type_e::Xbox360, "Xbox 360 Wireless Receiver (XBOX)"},
-        {{0x045e, 0x02a0}, gamepad_type_t::type_e::Xbox360, "Microsoft X-Box 360 Big Button IR"},
-        {{0x045e, 0x02a1}, gamepad_type_t::type_e::Xbox360, "Microsoft X-Box 360 pad"},
-        {{0x045e, 0x02dd}, gamepad_type_t::type_e::XboxOne, "Microsoft X-Box One pad"},
-        {{0x044f, 0xb326}, gamepad_type_t::type_e::XboxOne, "Microsoft X-Box One pad (Firmware 2015)"},
-        {{0x045e, 0x02e0}, gamepad_type_t::type_e::XboxOne, "Microsoft X-Box One S pad (Bluetooth)"},
-        {{0x045e, 0x02e3}, gamepad_type_t::type_e::XboxOne, "Microsoft X-Box One Elite pad"},
-        {{0x045e, 0x02ea}, gamepad_type_t::type_e::XboxOne, "Microsoft X-Box One S pad"},
-        {{0x045e, 0x02fd}, gamepad_type_t::type_e::XboxOne, "Microsoft X-Box One S pad (Bluetooth)"},
-        {{0x045e, 0x02ff}, gamepad_type_t::type_e::XboxOne, "Microsoft X-Box One Elite pad"},
-        {{0x045e, 0x0b12}, gamepad_type_t::type_e::XboxOne, "Microsoft X-Box One Wireless Controller"},
-        {{0x045e, 0x0b13}, gamepad_type_t::type_e::XboxOne, "Microsoft X-Box One Wireless Controller"},
-        {{0x045e, 0x0b20}, gamepad_type_t::type_e::XboxOne, "Microsoft X-Box One Wireless Controller"},
-        {{0x045e, 0x0719}, gamepad_type_t::type_e::Xbox360, "Xbox 360 Wireless Receiver"},
-        {{0x046d, 0xc21d}, gamepad_type_t::type_e::Xbox360, "Logitech Gamepad F310"},
-        {{0x046d, 0xc21e}, gamepad_type_t::type_e::Xbox360, "Logitech Gamepad F510"},
-        {{0x046d, 0xc21f}, gamepad_type_t::type_e::Xbox360, "Logitech Gamepad F710"},
-        {{0x046d, 0xc242}, gamepad_type_t::type_e::Xbox360, "Logitech Chillstream Controller"},
-        {{0x0f0d, 0x00c1}, gamepad_type_t::type_e::Switch , "HORI Pad Switch"},
-        {{0x0f0d, 0x0092}, gamepad_type_t::type_e::Switch , "HORI Pokken Tournament DX Pro Pad"},
-        {{0x0f0d, 0x00f6}, gamepad_type_t::type_e::Switch , "HORI Wireless Switch Pad"},
-        {{0x0f0d, 0x00dc}, gamepad_type_t::type_e::Switch , "HORI Battle Pad"},
-        {{0x20d6, 0xa711}, gamepad_type_t::type_e::Switch , "PowerA Wired Controller Plus/PowerA Wired Gamcube Controller"},
-        {{0x0e6f, 0x0185}, gamepad_type_t::type_e::Switch , "PDP Wired Fight Pad Pro for Nintendo Switch"},
-        {{0x0e6f, 0x0180}, gamepad_type_t::type_e::Switch , "PDP Faceoff Wired Pro Controller for Nintendo Switch"},
-        {{0x0e6f, 0x0181}, gamepad_type_t::type_e::Switch , "PDP Faceoff Deluxe Wired Pro Controller for Nintendo Switch"},
-        {{0x054c, 0x0268}, gamepad_type_t::type_e::PS3    , "Sony PS3 Controller"},
-        {{0x0925, 0x0005}, gamepad_type_t::type_e::PS3    , "Sony PS3 Controller"},
-        {{0x8888, 0x0308}, gamepad_type_t::type_e::PS3    , "Sony PS3 Controller"},
-        {{0x1a34, 0x0836}, gamepad_type_t::type_e::PS3    , "Afterglow PS3"},
-        {{0x0f0d, 0x006e}, gamepad_type_t::type_e::PS3    , "HORI horipad4 PS3"},
-        {{0x0f0d, 0x0066}, gamepad_type_t::type_e::PS3    , "HORI horipad4 PS4"},
-        {{0x0f0d, 0x005f}, gamepad_type_t::type_e::PS3    , "HORI Fighting commander PS3"},
-        {{0x0f0d, 0x005e}, gamepad_type_t::type_e::PS3    , "HORI Fighting commander PS4"},
-        {{0x0738, 0x8250}, gamepad_type_t::type_e::PS3    , "Madcats Fightpad Pro PS4"},
-        {{0x0079, 0x181a}, gamepad_type_t::type_e::PS3    , "Venom Arcade Stick"},
-        {{0x0079, 0x0006}, gamepad_type_t::type_e::PS3    , "PC Twin Shock Controller"},
-        {{0x2563, 0x0523}, gamepad_type_t::type_e::PS3    , "Digiflip GP006"},
-        {{0x11ff, 0x3331}, gamepad_type_t::type_e::PS3    , "SRXJ-PH2400"},
-        {{0x20bc, 0x5500}, gamepad_type_t::type_e::PS3    , "ShanWan PS3"},
-        {{0x044f, 0xb315}, gamepad_type_t::type_e::PS3    , "Firestorm Dual Analog 3"},
-        {{0x0f0d, 0x004d}, gamepad_type_t::type_e::PS3    , "Horipad 3"},
-        {{0x0f0d, 0x0009}, gamepad_type_t::type_e::PS3    , "HORI BDA GP1"},
-        {{0x0e8f, 0x0008}, gamepad_type_t::type_e::PS3    , "Green Asia"},
-        {{0x0f0d, 0x006a}, gamepad_type_t::type_e::PS3    , "Real Arcade Pro 4"},
-        {{0x0e6f, 0x011e}, gamepad_type_t::type_e::PS3    , "Rock Candy PS4"},
-        {{0x0e6f, 0x0214}, gamepad_type_t::type_e::PS3    , "Afterglow PS3"},
-        {{0x056e, 0x2013}, gamepad_type_t::type_e::PS3    , "JC-U4113SBK"},
-        {{0x0738, 0x8838}, gamepad_type_t::type_e::PS3    , "Madcatz Fightstick Pro"},
-        {{0x1a34, 0x0836}, gamepad_type_t::type_e::PS3    , "Afterglow PS3"},
-        {{0x0f30, 0x1100}, gamepad_type_t::type_e::PS3    , "Quanba Q1 fight stick"},
-        {{0x0f0d, 0x0087}, gamepad_type_t::type_e::PS3    , "HORI fighting mini stick"},
-        {{0x8380, 0x0003}, gamepad_type_t::type_e::PS3    , "BTP 2163"},
-        {{0x1345, 0x1000}, gamepad_type_t::type_e::PS3    , "PS2 ACME GA-D5"},
-        {{0x0e8f, 0x3075}, gamepad_type_t::type_e::PS3    , "SpeedLink Strike FX"},
-        {{0x0e6f, 0x0128}, gamepad_type_t::type_e::PS3    , "Rock Candy PS3"},
-        {{0x2c22, 0x2000}, gamepad_type_t::type_e::PS3    , "Quanba Drone"},
-        {{0x06a3, 0xf622}, gamepad_type_t::type_e::PS3    , "Cyborg V3"},
-        {{0x044f, 0xd007}, gamepad_type_t::type_e::PS3    , "Thrustmaster wireless 3-1"},
-        {{0x25f0, 0x83c3}, gamepad_type_t::type_e::PS3    , "Gioteck vx2"},
-        {{0x05b8, 0x1006}, gamepad_type_t::type_e::PS3    , "JC-U3412SBK"},
-        {{0x20d6, 0x576d}, gamepad_type_t::type_e::PS3    , "Power A PS3"},
-        {{0x0e6f, 0x1314}, gamepad_type_t::type_e::PS3    , "PDP Afterglow Wireless PS3 controller"},
-        {{0x0738, 0x3180}, gamepad_type_t::type_e::PS3    , "Mad Catz Alpha PS3 mode"},
-        {{0x0738, 0x8180}, gamepad_type_t::type_e::PS3    , "Mad Catz Alpha PS4 mode"},
-        {{0x0e6f, 0x0203}, gamepad_type_t::type_e::PS3    , "Victrix Pro FS"},
-        {{0x054c, 0x05c4}, gamepad_type_t::type_e::PS4    , "Sony PS4 Controller"},
-        {{0x054c, 0x09cc}, gamepad_type_t::type_e::PS4    , "Sony PS4 Slim Controller"},
-        {{0x054c, 0x0ba0}, gamepad_type_t::type_e::PS4    , "Sony PS4 Controller (Wireless dongle)"},
-        {{0x0f0d, 0x008a}, gamepad_type_t::type_e::PS4    , "HORI Real Arcade Pro 4"},
-        {{0x0f0d, 0x0055}, gamepad_type_t::type_e::PS4    , "HORIPAD 4 FPS"},
-        {{0x0f0d, 0x0066}, gamepad_type_t::type_e::PS4    , "HORIPAD 4 FPS Plus"},
-        {{0x0738, 0x8384}, gamepad_type_t::type_e::PS4    , "HORIPAD 4 FPS Plus"},
-        {{0x0738, 0x8250}, gamepad_type_t::type_e::PS4    , "Mad Catz FightPad Pro PS4"},
-        {{0x0738, 0x8384}, gamepad_type_t::type_e::PS4    , "Mad Catz Fightstick TE S+"},
-        {{0x0C12, 0x0E10}, gamepad_type_t::type_e::PS4    , "Armor Armor 3 Pad PS4"},
-        {{0x0C12, 0x1CF6}, gamepad_type_t::type_e::PS4    , "EMIO PS4 Elite Controller"},
-        {{0x1532, 0x1000}, gamepad_type_t::type_e::PS4    , "Razer Raiju PS4 Controller"},
-        {{0x1532, 0X0401}, gamepad_type_t::type_e::PS4    , "Razer Panthera PS4 Controller"},
-        {{0x054c, 0x05c5}, gamepad_type_t::type_e::PS4    , "STRIKEPAD PS4 Grip Add-on"},
-        {{0x146b, 0x0d01}, gamepad_type_t::type_e::PS4    , "Nacon Revolution Pro Controller"},
-        {{0x146b, 0x0d02}, gamepad_type_t::type_e::PS4    , "Nacon Revolution Pro Controller V2"},
-        {{0x0f0d, 0x00a0}, gamepad_type_t::type_e::PS4    , "HORI TAC4"},
-        {{0x0f0d, 0x009c}, gamepad_type_t::type_e::PS4    , "HORI TAC PRO"},
-        {{0x0c12, 0x0ef6}, gamepad_type_t::type_e::PS4    , "Hitbox Arcade Stick"},
-        {{0x0079, 0x181b}, gamepad_type_t::type_e::PS4    , "Venom Arcade Stick"},
-        {{0x0738, 0x3250}, gamepad_type_t::type_e::PS4    , "Mad Catz FightPad PRO"},
-        {{0x0f0d, 0x00ee}, gamepad_type_t::type_e::PS4    , "HORI mini wired gamepad"},
-        {{0x0738, 0x8481}, gamepad_type_t::type_e::PS4    , "Mad Catz FightStick TE 2+ PS4"},
-        {{0x0738, 0x8480}, gamepad_type_t::type_e::PS4    , "Mad Catz FightStick TE 2"},
-        {{0x7545, 0x0104}, gamepad_type_t::type_e::PS4    , "Armor 3, Level Up Cobra"},
-        {{0x1532, 0x1007}, gamepad_type_t::type_e::PS4    , "Razer Raiju 2 Tournament Edition (USB)"},
-        {{0x1532, 0x100A}, gamepad_type_t::type_e::PS4    , "Razer Raiju 2 Tournament Edition (BT)"},
-        {{0x1532, 0x1004}, gamepad_type_t::type_e::PS4    , "Razer Raiju 2 Ultimate Edition (USB)"},
-        {{0x1532, 0x1009}, gamepad_type_t::type_e::PS4    , "Razer Raiju 2 Ultimate Edition (BT)"},
-        {{0x1532, 0x1008}, gamepad_type_t::type_e::PS4    , "Razer Panthera Evo Fightstick"},
-        {{0x9886, 0x0025}, gamepad_type_t::type_e::PS4    , "Astro C40"},
-        {{0x0c12, 0x0e15}, gamepad_type_t::type_e::PS4    , "Game:Pad 4"},
-        {{0x4001, 0x0104}, gamepad_type_t::type_e::PS4    , "PS4 Fun Controller"},
-        {{0x056e, 0x2004}, gamepad_type_t::type_e::Xbox360, "Elecom JC-U3613M"},
-        {{0x06a3, 0xf51a}, gamepad_type_t::type_e::Xbox360, "Saitek P3600"},
-        {{0x0738, 0x4716}, gamepad_type_t::type_e::Xbox360, "Mad Catz Wired Xbox 360 Controller"},
-        {{0x0738, 0x4718}, gamepad_type_t::type_e::Xbox360, "Mad Catz Street Fighter IV FightStick SE"},
-        {{0x0738, 0x4726}, gamepad_type_t::type_e::Xbox360, "Mad Catz Xbox 360 Controller"},
-        {{0x0738, 0x4728}, gamepad_type_t::type_e::Xbox360, "Mad Catz Street Fighter IV FightPad"},
-        {{0x0738, 0x4736}, gamepad_type_t::type_e::Xbox360, "Mad Catz MicroCon Gamepad"},
-        {{0x0738, 0x4738}, gamepad_type_t::type_e::Xbox360, "Mad Catz Wired Xbox 360 Controller (SFIV)"},
-        {{0x0738, 0x4740}, gamepad_type_t::type_e::Xbox360, "Mad Catz Beat Pad"},
-        {{0x0738, 0x4a01}, gamepad_type_t::type_e::XboxOne, "Mad Catz FightStick TE 2"},
-        {{0x0738, 0xb726}, gamepad_type_t::type_e::Xbox360, "Mad Catz Xbox controller - MW2"},
-        {{0x0738, 0xbeef}, gamepad_type_t::type_e::Xbox360, "Mad Catz JOYTECH NEO SE Advanced GamePad"},
-        {{0x0738, 0xcb02}, gamepad_type_t::type_e::Xbox360, "Saitek Cyborg Rumble Pad - PC/Xbox 360"},
-        {{0x0738, 0xcb03}, gamepad_type_t::type_e::Xbox360, "Saitek P3200 Rumble Pad - PC/Xbox 360"},
-        {{0x0738, 0xf738}, gamepad_type_t::type_e::Xbox360, "Super SFIV FightStick TE S"},
-        {{0x0e6f, 0x0105}, gamepad_type_t::type_e::Xbox360, "HSM3 Xbox360 dancepad"},
-        {{0x0e6f, 0x0113}, gamepad_type_t::type_e::Xbox360, "Afterglow AX.1 Gamepad for Xbox 360"},
-        {{0x0e6f, 0x011f}, gamepad_type_t::type_e::Xbox360, "Rock Candy Gamepad Wired Controller"},
-        {{0x0e6f, 0x0133}, gamepad_type_t::type_e::Xbox360, "Xbox 360 Wired Controller"},
-        {{0x0e6f, 0x0139}, gamepad_type_t::type_e::XboxOne, "Afterglow Prismatic Wired Controller"},
-        {{0x0e6f, 0x013a}, gamepad_type_t::type_e::XboxOne, "PDP Xbox One Controller"},
-        {{0x0e6f, 0x0146}, gamepad_type_t::type_e::XboxOne, "Rock Candy Wired Controller for Xbox One"},
-        {{0x0e6f, 0x0147}, gamepad_type_t::type_e::XboxOne, "PDP Marvel Xbox One Controller"},
-        {{0x0e6f, 0x015c}, gamepad_type_t::type_e::XboxOne, "PDP Xbox One Arcade Stick"},
-        {{0x0e6f, 0x0161}, gamepad_type_t::type_e::XboxOne, "PDP Xbox One Controller"},
-        {{0x0e6f, 0x0162}, gamepad_type_t::type_e::XboxOne, "PDP Xbox One Controller"},
-        {{0x0e6f, 0x0163}, gamepad_type_t::type_e::XboxOne, "PDP Xbox One Controller"},
-        {{0x0e6f, 0x0164}, gamepad_type_t::type_e::XboxOne, "PDP Battlefield One"},
-        {{0x0e6f, 0x0165}, gamepad_type_t::type_e::XboxOne, "PDP Titanfall 2"},
-        {{0x0e6f, 0x0201}, gamepad_type_t::type_e::Xbox360, "Pelican PL-3601 'TSZ' Wired Xbox 360 Controller"},
-        {{0x0e6f, 0x0213}, gamepad_type_t::type_e::Xbox360, "Afterglow Gamepad for Xbox 360"},
-        {{0x0e6f, 0x021f}, gamepad_type_t::type_e::Xbox360, "Rock Candy Gamepad for Xbox 360"},
-        {{0x0e6f, 0x0246}, gamepad_type_t::type_e::XboxOne, "Rock Candy Gamepad for Xbox One 2015"},
-        {{0x0e6f, 0x0301}, gamepad_type_t::type_e::Xbox360, "Logic3 Controller"},
-        {{0x0e6f, 0x0346}, gamepad_type_t::type_e::XboxOne, "Rock Candy Gamepad for Xbox One 2016"},
-        {{0x0e6f, 0x0401}, gamepad_type_t::type_e::Xbox360, "Logic3 Controller"},
-        {{0x0e6f, 0x0413}, gamepad_type_t::type_e::Xbox360, "Afterglow AX.1 Gamepad for Xbox 360"},
-        {{0x0e6f, 0x0501}, gamepad_type_t::type_e::Xbox360, "PDP Xbox 360 Controller"},
-        {{0x0e6f, 0xf900}, gamepad_type_t::type_e::Xbox360, "PDP Afterglow AX.1"},
-        {{0x0f0d, 0x000a}, gamepad_type_t::type_e::Xbox360, "Hori Co. DOA4 FightStick"},
-        {{0x0f0d, 0x000c}, gamepad_type_t::type_e::Xbox360, "Hori PadEX Turbo"},
-        {{0x0f0d, 0x000d}, gamepad_type_t::type_e::Xbox360, "Hori Fighting Stick EX2"},
-        {{0x0f0d, 0x0016}, gamepad_type_t::type_e::Xbox360, "Hori Real Arcade Pro.EX"},
-        {{0x0f0d, 0x001b}, gamepad_type_t::type_e::Xbox360, "Hori Real Arcade Pro VX"},
-        {{0x0f0d, 0x0063}, gamepad_type_t::type_e::XboxOne, "Hori Real Arcade Pro Hayabusa (USA) Xbox One"},
-        {{0x0f0d, 0x0067}, gamepad_type_t::type_e::XboxOne, "HORIPAD ONE"},
-        {{0x0f0d, 0x0078}, gamepad_type_t::type_e::XboxOne, "Hori Real Arcade Pro V Kai Xbox One"},
-        {{0x11c9, 0x55f0}, gamepad_type_t::type_e::Xbox360, "Nacon GC-100XF"},
-        {{0x12ab, 0x0004}, gamepad_type_t::type_e::Xbox360, "Honey Bee Xbox360 dancepad"},
-        {{0x12ab, 0x0301}, gamepad_type_t::type_e::Xbox360, "PDP AFTERGLOW AX.1"},
-        {{0x12ab, 0x0303}, gamepad_type_t::type_e::Xbox360, "Mortal Kombat Klassic FightStick"},
-        {{0x1430, 0x4748}, gamepad_type_t::type_e::Xbox360, "RedOctane Guitar Hero X-plorer"},
-        {{0x1430, 0xf801}, gamepad_type_t::type_e::Xbox360, "RedOctane Controller"},
-        {{0x146b, 0x0601}, gamepad_type_t::type_e::Xbox360, "BigBen Interactive XBOX 360 Controller"},
-        {{0x1532, 0x0037}, gamepad_type_t::type_e::Xbox360, "Razer Sabertooth"},
-        {{0x1532, 0x0a00}, gamepad_type_t::type_e::XboxOne, "Razer Atrox Arcade Stick"},
-        {{0x1532, 0x0a03}, gamepad_type_t::type_e::XboxOne, "Razer Wildcat"},
-        {{0x15e4, 0x3f00}, gamepad_type_t::type_e::Xbox360, "Power A Mini Pro Elite"},
-        {{0x15e4, 0x3f0a}, gamepad_type_t::type_e::Xbox360, "Xbox Airflo wired controller"},
-        {{0x15e4, 0x3f10}, gamepad_type_t::type_e::Xbox360, "Batarang Xbox 360 controller"},
-        {{0x162e, 0xbeef}, gamepad_type_t::type_e::Xbox360, "Joytech Neo-Se Take2"},
-        {{0x1689, 0xfd00}, gamepad_type_t::type_e::Xbox360, "Razer Onza Tournament Edition"},
-        {{0x1689, 0xfd01}, gamepad_type_t::type_e::Xbox360, "Razer Onza Classic Edition"},
-        {{0x1689, 0xfe00}, gamepad_type_t::type_e::Xbox360, "Razer Sabertooth"},
-        {{0x1bad, 0x0002}, gamepad_type_t::type_e::Xbox360, "Harmonix Rock Band Guitar"},
-        {{0x1bad, 0x0003}, gamepad_type_t::type_e::Xbox360, "Harmonix Rock Band Drumkit"},
-        {{0x1bad, 0xf016}, gamepad_type_t::type_e::Xbox360, "Mad Catz Xbox 360 Controller"},
-        {{0x1bad, 0xf018}, gamepad_type_t::type_e::Xbox360, "Mad Catz Street Fighter IV SE Fighting Stick"},
-        {{0x1bad, 0xf019}, gamepad_type_t::type_e::Xbox360, "Mad Catz Brawlstick for Xbox 360"},
-        {{0x1bad, 0xf021}, gamepad_type_t::type_e::Xbox360, "Mad Cats Ghost Recon FS GamePad"},
-        {{0x1bad, 0xf023}, gamepad_type_t::type_e::Xbox360, "MLG Pro Circuit Controller (Xbox)"},
-        {{0x1bad, 0xf025}, gamepad_type_t::type_e::Xbox360, "Mad Catz Call Of Duty"},
-        {{0x1bad, 0xf027}, gamepad_type_t::type_e::Xbox360, "Mad Catz FPS Pro"},
-        {{0x1bad, 0xf028}, gamepad_type_t::type_e::Xbox360, "Street Fighter IV FightPad"},
-        {{0x1bad, 0xf02e}, gamepad_type_t::type_e::Xbox360, "Mad Catz Fightpad"},
-        {{0x1bad, 0xf036}, gamepad_type_t::type_e::Xbox360, "Mad Catz MicroCon GamePad Pro"},
-        {{0x1bad, 0xf038}, gamepad_type_t::type_e::Xbox360, "Street Fighter IV FightStick TE"},
-        {{0x1bad, 0xf039}, gamepad_type_t::type_e::Xbox360, "Mad Catz MvC2 TE"},
-        {{0x1bad, 0xf03a}, gamepad_type_t::type_e::Xbox360, "Mad Catz SFxT Fightstick Pro"},
-        {{0x1bad, 0xf03d}, gamepad_type_t::type_e::Xbox360, "Street Fighter IV Arcade Stick TE - Chun Li"},
-        {{0x1bad, 0xf03e}, gamepad_type_t::type_e::Xbox360, "Mad Catz MLG FightStick TE"},
-        {{0x1bad, 0xf03f}, gamepad_type_t::type_e::Xbox360, "Mad Catz FightStick SoulCaliber"},
-        {{0x1bad, 0xf042}, gamepad_type_t::type_e::Xbox360, "Mad Catz FightStick TES+"},
-        {{0x1bad, 0xf080}, gamepad_type_t::type_e::Xbox360, "Mad Catz FightStick TE2"},
-        {{0x1bad, 0xf501}, gamepad_type_t::type_e::Xbox360, "HoriPad EX2 Turbo"},
-        {{0x1bad, 0xf502}, gamepad_type_t::type_e::Xbox360, "Hori Real Arcade Pro.VX SA"},
-        {{0x1bad, 0xf503}, gamepad_type_t::type_e::Xbox360, "Hori Fighting Stick VX"},
-        {{0x1bad, 0xf504}, gamepad_type_t::type_e::Xbox360, "Hori Real Arcade Pro. EX"},
-        {{0x1bad, 0xf505}, gamepad_type_t::type_e::Xbox360, "Hori Fighting Stick EX2B"},
-        {{0x1bad, 0xf506}, gamepad_type_t::type_e::Xbox360, "Hori Real Arcade Pro.EX Premium VLX"},
-        {{0x1bad, 0xf900}, gamepad_type_t::type_e::Xbox360, "Harmonix Xbox 360 Controller"},
-        {{0x1bad, 0xf901}, gamepad_type_t::type_e::Xbox360, "Gamestop Xbox 360 Controller"},
-        {{0x1bad, 0xf903}, gamepad_type_t::type_e::Xbox360, "Tron Xbox 360 controller"},
-        {{0x1bad, 0xf904}, gamepad_type_t::type_e::Xbox360, "PDP Versus Fighting Pad"},
-        {{0x1bad, 0xf906}, gamepad_type_t::type_e::Xbox360, "MortalKombat FightStick"},
-        {{0x1bad, 0xfa01}, gamepad_type_t::type_e::Xbox360, "MadCatz GamePad"},
-        {{0x1bad, 0xfd00}, gamepad_type_t::type_e::Xbox360, "Razer Onza TE"},
-        {{0x1bad, 0xfd01}, gamepad_type_t::type_e::Xbox360, "Razer Onza"},
-        {{0x24c6, 0x5000}, gamepad_type_t::type_e::Xbox360, "Razer Atrox Arcade Stick"},
-        {{0x24c6, 0x5300}, gamepad_type_t::type_e::Xbox360, "PowerA MINI PROEX Controller"},
-        {{0x24c6, 0x5303}, gamepad_type_t::type_e::Xbox360, "Xbox Airflo wired controller"},
-        {{0x24c6, 0x530a}, gamepad_type_t::type_e::Xbox360, "Xbox 360 Pro EX Controller"},
-        {{0x24c6, 0x531a}, gamepad_type_t::type_e::Xbox360, "PowerA Pro Ex"},
-        {{0x24c6, 0x5397}, gamepad_type_t::type_e::Xbox360, "FUS1ON Tournament Controller"},
-        {{0x24c6, 0x541a}, gamepad_type_t::type_e::XboxOne, "PowerA Xbox One Mini Wired Controller"},
-        {{0x24c6, 0x542a}, gamepad_type_t::type_e::XboxOne, "Xbox ONE spectra"},
-        {{0x24c6, 0x543a}, gamepad_type_t::type_e::XboxOne, "PowerA Xbox One wired controller"},
-        {{0x24c6, 0x5500}, gamepad_type_t::type_e::Xbox360, "Hori XBOX 360 EX 2 with Turbo"},
-        {{0x24c6, 0x5501}, gamepad_type_t::type_e::Xbox360, "Hori Real Arcade Pro VX-SA"},
-        {{0x24c6, 0x5502}, gamepad_type_t::type_e::Xbox360, "Hori Fighting Stick VX Alt"},
-        {{0x24c6, 0x5503}, gamepad_type_t::type_e::Xbox360, "Hori Fighting Edge"},
-        {{0x24c6, 0x5506}, gamepad_type_t::type_e::Xbox360, "Hori SOULCALIBUR V Stick"},
-        {{0x24c6, 0x550d}, gamepad_type_t::type_e::Xbox360, "Hori GEM Xbox controller"},
-        {{0x24c6, 0x550e}, gamepad_type_t::type_e::Xbox360, "Hori Real Arcade Pro V Kai 360"},
-        {{0x24c6, 0x551a}, gamepad_type_t::type_e::XboxOne, "PowerA FUSION Pro Controller"},
-        {{0x24c6, 0x561a}, gamepad_type_t::type_e::XboxOne, "PowerA FUSION Controller"},
-        {{0x24c6, 0x5b02}, gamepad_type_t::type_e::Xbox360, "Thrustmaster"},
-        {{0x24c6, 0x5b03}, gamepad_type_t::type_e::Xbox360, "Thrustmaster Ferrari 458 Racing Wheel"},
-        {{0x24c6, 0x5d04}, gamepad_type_t::type_e::Xbox360, "Razer Sabertooth"},
-        {{0x24c6, 0xfafe}, gamepad_type_t::type_e::Xbox360, "Rock Candy Gamepad for Xbox 360"},
-        {{0xffff, 0xffff}, gamepad_type_t::type_e::Unknown, "Unknown gamepad"},
-    };
-    
-    constexpr size_t known_gamepad_count = sizeof(known_gamepads) / sizeof(*known_gamepads);
+    gamepad_event_t event;
+    event.timestamp_us = timestamp_us;
+    event.axis = gamepad_event_t::axis_e::left_stick_x;
+    event.value = 0.0f;
 
-    for (size_t i = 0; i < known_gamepad_count; ++i)
+    for (uint32_t changed = old_buttons ^ new_buttons; changed != 0; changed &= changed - 1)
     {
-        if (known_gamepads[i].id.id == id.id)
-            return known_gamepads[i].type_infos;
+        event.button = changed & (~changed + 1);
+        event.type = (new_buttons & event.button) ? gamepad_event_t::type_e::button_down : gamepad_event_t::type_e::button_up;
+        push_event(queue, event);
     }
+}
 
-    return known_gamepads[known_gamepad_count-1].type_infos;
+static inline void push_axis_event(gamepad_event_queue_t& queue, uint64_t timestamp_us, gamepad_event_t::axis_e axis, float value)
+{
+    gamepad_event_t event;
+    event.timestamp_us = timestamp_us;
+    event.type = gamepad_event_t::type_e::axis;
+    event.axis = axis;
+    event.button = button_none;
+    event.value = value;
+    push_event(queue, event);
 }
 
-int32_t update_gamepad_state(uint32_t index)
+static uint32_t pop_events(gamepad_event_queue_t& queue, gamepad_event_t* p_events, uint32_t max_events, uint32_t* p_dropped_count)
 {
-    if (index >= gamepad::max_connected_gamepads)
-        return gamepad::invalid_parameter;
+    uint32_t count = std::min(max_events, queue.count);
+    for (uint32_t i = 0; i < count; ++i)
+        p_events[i] = queue.events[(queue.head + i) % gamepad_event_queue_size];
+
+    queue.head = (queue.head + count) % gamepad_event_queue_size;
+    queue.count -= count;
+
+    if (p_dropped_count != nullptr)
+        *p_dropped_count = queue.dropped;
 
-    return call_internal_action(index, &internal_update_gamepad_state);
+    queue.dropped = 0;
+    return count;
 }
 
-int32_t get_gamepad_state(uint32_t index, gamepad_state_t* p_gamepad_state)
+#if defined(GAMEPAD_ENABLE_STATS)
+// Indexes of s_stats, in the order of the gamepad_stats_t fields.
+enum class stat_e : uint32_t
 {
-    if (index >= gamepad::max_connected_gamepads || p_gamepad_state == nullptr)
-        return gamepad::invalid_parameter;
+    directory_scans,
+    nodes_probed,
+    device_opens,
+    open_retries,
+    open_failures,
+    reads,
+    reads_with_data,
+    reads_would_block,
+    read_errors,
+    uring_enters,
+    uring_completions,
+    syn_events,
+    key_events,
+    abs_events,
+    other_events,
+    sync_drops,
+    resyncs,
+    ff_uploads,
+    ff_writes,
+    ff_errors,
+    mutex_locks,
+    mutex_contentions,
+    mutex_wait_ns,
+    count,
+};
 
-    return call_internal_action(index, &internal_get_gamepad_state, p_gamepad_state);
-}
+static uint64_t gamepad_stats_t::* const s_stat_fields[] = {
+    &gamepad_stats_t::directory_scans,
+    &gamepad_stats_t::nodes_probed,
+    &gamepad_stats_t::device_opens,
+    &gamepad_stats_t::open_retries,
+    &gamepad_stats_t::open_failures,
+    &gamepad_stats_t::reads,
+    &gamepad_stats_t::reads_with_data,
+    &gamepad_stats_t::reads_would_block,
+    &gamepad_stats_t::read_errors,
+    &gamepad_stats_t::uring_enters,
+    &gamepad_stats_t::uring_completions,
+    &gamepad_stats_t::syn_events,
+    &gamepad_stats_t::key_events,
+    &gamepad_stats_t::abs_events,
+    &gamepad_stats_t::other_events,
+    &gamepad_stats_t::sync_drops,
+    &gamepad_stats_t::resyncs,
+    &gamepad_stats_t::ff_uploads,
+    &gamepad_stats_t::ff_writes,
+    &gamepad_stats_t::ff_errors,
+    &gamepad_stats_t::mutex_locks,
+    &gamepad_stats_t::mutex_contentions,
+    &gamepad_stats_t::mutex_wait_ns,
+};
 
-int32_t get_gamepad_id(uint32_t index, gamepad_id_t* p_gamepad_id)
+static_assert(sizeof(s_stat_fields) / sizeof(*s_stat_fields) == static_cast<uint32_t>(stat_e::count), "Every counter needs its gamepad_stats_t field.");
+
+// Relaxed: they are only meant to be summed and compared between snapshots.
+static std::atomic<uint64_t> s_stats[static_cast<uint32_t>(stat_e::count)];
+
+#define GAMEPAD_STAT_ADD(counter, value) gamepad::s_stats[static_cast<uint32_t>(gamepad::stat_e::counter)].fetch_add((value), std::memory_order_relaxed)
+
+// std::mutex that counts its locks and the time spent waiting for it.
+struct gamepad_mutex_t
 {
-    if (index >= gamepad::max_connected_gamepads || p_gamepad_id == nullptr)
-        return gamepad::invalid_parameter;
+    std::mutex mutex;
 
-    return call_internal_action(index, &internal_get_gamepad_id, p_gamepad_id);
-}
+    void lock()
+    {
+        GAMEPAD_STAT_ADD(mutex_locks, 1);
+        if (mutex.try_lock())
+            return;
+
+        auto start = std::chrono::steady_clock::now();
+        mutex.lock();
+        GAMEPAD_STAT_ADD(mutex_contentions, 1);
+        GAMEPAD_STAT_ADD(mutex_wait_ns, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+    }
 
-int32_t set_gamepad_vibration(uint32_t index, float left_strength, float right_strength)
+    bool try_lock()
+    {
+        if (!mutex.try_lock())
+            return false;
+
+        GAMEPAD_STAT_ADD(mutex_locks, 1);
+        return true;
+    }
+
+    void unlock()
+    {
+        mutex.unlock();
+    }
+};
+#else
+#define GAMEPAD_STAT_ADD(counter, value) ((void)0)
+
+typedef std::mutex gamepad_mutex_t;
+#endif
+
+static gamepad_mutex_t s_gamepad_mutex;
+// Serializes the reader thread start and stop, taken before s_gamepad_mutex.
+static std::mutex s_reader_thread_mutex;
+static gamepad_context_t* s_gamepads[max_connected_gamepads] = {};
+
+// Last state of every slot, published so get_gamepad_state() never takes s_gamepad_mutex.
+// It lives in the slot rather than in the context, a reader never touches memory the hotplug code may free.
+// Writers hold s_gamepad_mutex, or are the reader thread that owns the slot (see start_gamepad_reader_threads),
+// so there is one writer at a time. It fills the buffer after the latest one,
+// so a reader only has to retry when it got preempted for two whole publications.
+// The change sequence of a slot only moves when a field changed, each field keeps the change sequence of its
+// last change so a caller's dirty mask needs no history.
+static constexpr uint32_t state_field_count = 6;
+static_assert(gamepad::state_field_connection == (1u << (state_field_count - 1)), "state_field_* must be the bits [0, state_field_count).");
+
+struct published_buffer_t
 {
-    if (index >= gamepad::max_connected_gamepads || left_strength < 0.0f || right_strength < 0.0f)
-        return gamepad::invalid_parameter;
+    std::atomic<uint32_t> sequence; // Odd while the writer is filling the buffer.
+    std::atomic<uint32_t> connected;
+    std::atomic<uint32_t> words[sizeof(gamepad_state_t) / sizeof(uint32_t)];
+    std::atomic<uint64_t> change_sequence;
+    std::atomic<uint64_t> field_sequences[state_field_count];
+};
 
-    if (left_strength > 1.0f)
-        left_strength = 1.0f;
+struct alignas(64) published_state_t
+{
+    std::atomic<uint32_t> latest;
+    published_buffer_t buffers[3];
+    // Only touched by the writer.
+    uint64_t change_sequence;
+    uint64_t field_sequences[state_field_count];
+};
 
-    if (right_strength > 1.0f)
-        right_strength = 1.0f;
+static_assert(sizeof(gamepad_state_t) % sizeof(uint32_t) == 0, "gamepad_state_t must be made of 32bits words.");
 
-    return call_internal_action(index, &internal_set_gamepad_vibration, left_strength, right_strength);
-}
+// Latency histograms of every slot. The slot's writer records the reports it decodes (see publish_gamepad_state()),
+// get_gamepad_latency() copies and resets them without any lock. Every field is atomic, a histogram never needs a lock.
+struct latency_stats_t
+{
+    std::atomic<uint64_t> sum_us;
+    std::atomic<uint64_t> max_us;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint32_t> buckets[latency_bucket_count];
+};
 
-int32_t set_gamepad_led(uint32_t index, uint8_t r, uint8_t g, uint8_t b)
+// As many reports as a full evdev read buffer can hold, more only pile up when an update reads it several times.
+static constexpr uint32_t max_pending_reports = 1024;
+
+struct alignas(64) gamepad_latency_stats_t
 {
-    if (index >= gamepad::max_connected_gamepads)
-        return gamepad::invalid_parameter;
+    latency_stats_t read;
+    latency_stats_t visible;
+    // Slot writer only: timestamps of the reports decoded since the state was last published, as offsets from the first.
+    uint64_t pending_base_us;
+    uint32_t pending_offsets_us[max_pending_reports];
+    uint32_t pending_report_count;
+};
 
-    return call_internal_action(index, &internal_set_gamepad_led, r, g, b);
-}
+// The published state and the histograms of the slots, allocated slot_chunk_size slots at a time (s_gamepad_mutex
+// held) the first time one of them gets a gamepad. Lock-free readers may hold a chunk at any time, so a chunk is
+// only freed at exit.
+static constexpr uint32_t slot_chunk_size = 16;
 
-void free_gamepad_resources()
+struct slot_chunk_t
 {
-    std::lock_guard<std::mutex> lock(s_gamepad_mutex);
+    published_state_t published_states[slot_chunk_size];
+    gamepad_latency_stats_t latency_stats[slot_chunk_size];
+};
 
-    internal_free_all_contexts();
+static std::atomic<slot_chunk_t*> s_slot_chunks[max_connected_gamepads / slot_chunk_size];
+// C++11 new ignores the chunk alignment, the chunks are aligned by hand inside these allocations.
+static void* s_slot_chunk_allocations[max_connected_gamepads / slot_chunk_size];
+// No slot past s_slot_count ever had a gamepad.
+static std::atomic<uint32_t> s_slot_count(0);
+// What the readers of a never used slot see: a disconnected gamepad with no history.
+static published_state_t const s_unused_published_state = {};
+
+static struct slot_chunks_cleanup_t
+{
+    ~slot_chunks_cleanup_t()
+    {
+        for (uint32_t i = 0; i < max_connected_gamepads / slot_chunk_size; ++i)
+        {
+            slot_chunk_t* p_chunk = s_slot_chunks[i].exchange(nullptr);
+            if (p_chunk != nullptr)
+                p_chunk->~slot_chunk_t();
+
+            ::operator delete(s_slot_chunk_allocations[i]);
+            s_slot_chunk_allocations[i] = nullptr;
+        }
+    }
+} s_slot_chunks_cleanup;
+
+// Lock-free, returns nullptr when the slot never had a gamepad.
+static inline slot_chunk_t* get_slot_chunk(uint32_t index)
+{
+    return s_slot_chunks[index / slot_chunk_size].load(std::memory_order_acquire);
 }
 
-#if defined(GAMEPAD_OS_WINDOWS)
+static inline published_state_t const& get_published_state(uint32_t index)
+{
+    slot_chunk_t const* p_chunk = get_slot_chunk(index);
+    return p_chunk != nullptr ? p_chunk->published_states[index % slot_chunk_size] : s_unused_published_state;
+}
 
-struct gamepad_context_t
+// Must be called with s_gamepad_mutex held, returns nullptr when the slot chunk is not allocated and allocate is false.
+static slot_chunk_t* get_writable_slot_chunk(uint32_t index, bool allocate)
 {
-    HANDLE       hDevice;
-    PWSTR        devicePath;
+    std::atomic<slot_chunk_t*>& chunk = s_slot_chunks[index / slot_chunk_size];
+    slot_chunk_t* p_chunk = chunk.load(std::memory_order_relaxed);
+    if (p_chunk == nullptr && allocate)
+    {
+        size_t size = sizeof(slot_chunk_t) + alignof(slot_chunk_t);
+        void* p_memory = ::operator new(size);
+
+        s_slot_chunk_allocations[index / slot_chunk_size] = p_memory;
+        p_chunk = new (std::align(alignof(slot_chunk_t), sizeof(slot_chunk_t), p_memory, size)) slot_chunk_t();
+        chunk.store(p_chunk, std::memory_order_release);
+        if (s_slot_count.load(std::memory_order_relaxed) < (index / slot_chunk_size + 1) * slot_chunk_size)
+            s_slot_count.store((index / slot_chunk_size + 1) * slot_chunk_size, std::memory_order_release);
+    }
 
-    uint8_t      dead;
-    uint16_t     type;
-    gamepad_id_t id;
+    return p_chunk;
+}
 
-    gamepad_state_t gamepadState;
-};
+static inline void set_gamepad_mask_bit(uint32_t* p_mask, uint32_t index)
+{
+    p_mask[index / 32] |= (1u << (index % 32));
+}
 
-static HRESULT DeviceIo(gamepad_context_t* context, DWORD ioControlCode, LPVOID inBuff, DWORD inBuffSize, LPVOID outBuff, DWORD outBuffSize, LPOVERLAPPED pOverlapped)
+static inline void clear_gamepad_mask(uint32_t* p_mask)
 {
-    HRESULT result;
-    int BytesReturned;
-    DWORD lpBytesReturned;
+    memset(p_mask, 0, gamepad_mask_words * sizeof(uint32_t));
+}
 
-    lpBytesReturned = 0;
-    BytesReturned = DeviceIoControl(context->hDevice, ioControlCode, inBuff, inBuffSize, outBuff, outBuffSize, &lpBytesReturned, pOverlapped);
-    if (BytesReturned)
-        return ERROR_SUCCESS;
+static inline bool is_gamepad_mask_empty(uint32_t const* p_mask)
+{
+    for (uint32_t i = 0; i < gamepad_mask_words; ++i)
+    {
+        if (p_mask[i] != 0)
+            return false;
+    }
 
-    if (GetLastError() == ERROR_IO_PENDING && pOverlapped)
-        result = E_PENDING;
-    else
-        result = E_FAIL;
-    return result;
+    return true;
 }
 
-static HRESULT DeviceInIo(gamepad_context_t* context, DWORD nioctl, void* buff, size_t buff_size)
+// Bumped around every publication (odd while one is in progress), get_all_gamepad_states() uses them to read
+// all the slots as one snapshot. [0] is the one of the publications made with s_gamepad_mutex held, [1 + N] the one
+// of reader thread N of start_gamepad_reader_threads(), each thread has its own cache line.
+struct alignas(64) publish_sequence_t
 {
-    return DeviceIo(context, nioctl, nullptr, 0, buff, buff_size, nullptr);
+    std::atomic<uint32_t> value;
+};
+
+static publish_sequence_t s_publish_sequences[1 + max_reader_threads];
+// Reader threads publishing with their own sequence, only changed while none of them runs.
+static std::atomic<uint32_t> s_reader_shard_count(0);
+
+struct publish_snapshot_t
+{
+    uint32_t shard_count;
+    uint32_t sequences[1 + max_reader_threads];
+};
+
+// Returns false while a publication is in progress.
+static bool begin_publish_snapshot(publish_snapshot_t& snapshot)
+{
+    snapshot.shard_count = s_reader_shard_count.load(std::memory_order_acquire);
+    for (uint32_t i = 0; i <= snapshot.shard_count; ++i)
+    {
+        snapshot.sequences[i] = s_publish_sequences[i].value.load(std::memory_order_acquire);
+        if (snapshot.sequences[i] & 1)
+            return false;
+    }
+
+    return true;
 }
 
-static HRESULT DeviceOutIo(gamepad_context_t* context, DWORD nioctl, void* buff, size_t buff_size)
+// Returns false when something got published since begin_publish_snapshot().
+static bool end_publish_snapshot(publish_snapshot_t const& snapshot)
 {
-    return DeviceIo(context, nioctl, buff, buff_size, nullptr, 0, nullptr);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (s_reader_shard_count.load(std::memory_order_relaxed) != snapshot.shard_count)
+        return false;
+
+    for (uint32_t i = 0; i <= snapshot.shard_count; ++i)
+    {
+        if (s_publish_sequences[i].value.load(std::memory_order_relaxed) != snapshot.sequences[i])
+            return false;
+    }
+
+    return true;
 }
 
-static HRESULT DeviceInOutIo(gamepad_context_t* context, DWORD nioctl, void* in_buff, size_t in_buff_size, void* out_buff, size_t out_buff_size)
+static connection_callback_t s_connection_callback = nullptr;
+static void* s_connection_callback_param = nullptr;
+static std::vector<connection_event_t> s_connection_events;
+// Detached contexts the kernel was still writing into (io_uring reads), added once it let go of them. Freed by
+// whoever releases s_gamepad_mutex next, like the connection events are dispatched.
+static std::vector<gamepad_context_t*> s_released_contexts;
+// Set once internal_start_discovery() succeeded, cleared by free_gamepad_resources().
+static std::atomic<bool> s_discovery_started(false);
+
+// Bitwise, like the memcmp() deciding whether a state gets published at all.
+static uint32_t get_changed_fields(gamepad_state_t const& old_state, gamepad_state_t const& new_state)
 {
-    return DeviceIo(context, nioctl, in_buff, in_buff_size, out_buff, out_buff_size, nullptr);
+    uint32_t changed_fields = gamepad::state_field_none;
+
+    if (old_state.buttons != new_state.buttons)
+        changed_fields |= gamepad::state_field_buttons;
+    if (memcmp(&old_state.left_stick, &new_state.left_stick, sizeof(stick_pos_t)) != 0)
+        changed_fields |= gamepad::state_field_left_stick;
+    if (memcmp(&old_state.right_stick, &new_state.right_stick, sizeof(stick_pos_t)) != 0)
+        changed_fields |= gamepad::state_field_right_stick;
+    if (memcmp(&old_state.left_trigger, &new_state.left_trigger, sizeof(float)) != 0)
+        changed_fields |= gamepad::state_field_left_trigger;
+    if (memcmp(&old_state.right_trigger, &new_state.right_trigger, sizeof(float)) != 0)
+        changed_fields |= gamepad::state_field_right_trigger;
+
+    return changed_fields;
 }
 
-static int32_t parse_buffer(gamepad_state_t* p_gamepad_state, GamepadState0100 &buff)
+// Must be called with s_gamepad_mutex held, or by the reader thread owning the slot with its own sequence.
+static void publish_gamepad_state(uint32_t index, gamepad_state_t const* p_gamepad_state, bool connected, publish_sequence_t& publish_sequence = s_publish_sequences[0])
 {
-    if (buff.status != 1) // Gamepad is offline
-        return gamepad::failed;
+    // A slot that never had a gamepad already reads as disconnected.
+    slot_chunk_t* p_chunk = get_writable_slot_chunk(index, connected);
+    if (p_chunk == nullptr)
+        return;
 
-    p_gamepad_state->left_stick.x = rerange_value(-32768.0f, 32767.0f, -1.0f, 1.0f, buff.sThumbLX);
-    p_gamepad_state->left_stick.y = rerange_value(-32768.0f, 32767.0f, -1.0f, 1.0f, buff.sThumbLY);
+    published_state_t& published = p_chunk->published_states[index % slot_chunk_size];
+    published_buffer_t& latest_buffer = published.buffers[published.latest.load(std::memory_order_relaxed)];
+    uint32_t next = (published.latest.load(std::memory_order_relaxed) + 1) % 3;
+    published_buffer_t& buffer = published.buffers[next];
+    uint32_t words[sizeof(gamepad_state_t) / sizeof(uint32_t)];
+    uint32_t sequence = buffer.sequence.load(std::memory_order_relaxed);
+    uint32_t publish_sequence_value = publish_sequence.value.load(std::memory_order_relaxed);
+    gamepad_state_t latest_state;
+
+    // The writer is alone, the latest buffer is stable for it.
+    for (size_t i = 0; i < sizeof(words) / sizeof(*words); ++i)
+        words[i] = latest_buffer.words[i].load(std::memory_order_relaxed);
+    memcpy(&latest_state, words, sizeof(words));
+    memcpy(words, p_gamepad_state, sizeof(words));
+
+    uint32_t changed_fields = get_changed_fields(latest_state, *p_gamepad_state);
+    if (latest_buffer.connected.load(std::memory_order_relaxed) != (connected ? 1u : 0u))
+        changed_fields |= gamepad::state_field_connection;
+
+    // Same state again, the readers already have it.
+    if (changed_fields == gamepad::state_field_none)
+        return;
 
-    p_gamepad_state->right_stick.x = rerange_value(-32768.0f, 32767.0f, -1.0f, 1.0f, buff.sThumbRX);
-    p_gamepad_state->right_stick.y = rerange_value(-32768.0f, 32767.0f, -1.0f, 1.0f, buff.sThumbRY);
+    ++published.change_sequence;
+    for (uint32_t i = 0; i < state_field_count; ++i)
+    {
+        if (changed_fields & (1u << i))
+            published.field_sequences[i] = published.change_sequence;
+    }
 
-    p_gamepad_state->buttons = buff.wButtons;
+    publish_sequence.value.store(publish_sequence_value + 1, std::memory_order_relaxed);
+    buffer.sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
 
-    p_gamepad_state->left_trigger = rerange_value(0.0f, 255.0f, 0.0f, 1.0f, buff.bLeftTrigger);
-    p_gamepad_state->right_trigger = rerange_value(0.0f, 255.0f, 0.0f, 1.0f, buff.bRightTrigger);
+    buffer.connected.store(connected ? 1 : 0, std::memory_order_relaxed);
+    for (size_t i = 0; i < sizeof(words) / sizeof(*words); ++i)
+        buffer.words[i].store(words[i], std::memory_order_relaxed);
+    buffer.change_sequence.store(published.change_sequence, std::memory_order_relaxed);
+    for (uint32_t i = 0; i < state_field_count; ++i)
+        buffer.field_sequences[i].store(published.field_sequences[i], std::memory_order_relaxed);
 
-    return gamepad::success;
+    buffer.sequence.store(sequence + 2, std::memory_order_release);
+    published.latest.store(next, std::memory_order_release);
+    publish_sequence.value.store(publish_sequence_value + 2, std::memory_order_release);
 }
 
-static int32_t parse_buffer(gamepad_state_t* p_gamepad_state, GamepadState0101 &buff)
+// Same locking as publish_gamepad_state().
+static inline void unpublish_gamepad_state(uint32_t index, publish_sequence_t& publish_sequence = s_publish_sequences[0])
 {
-    if (buff.status != 1) // Gamepad is offline
-        return gamepad::failed;
+    static const gamepad_state_t empty_state = {};
+    publish_gamepad_state(index, &empty_state, false, publish_sequence);
+}
 
-    p_gamepad_state->left_stick.x = rerange_value(-32768.0f, 32767.0f, -1.0f, 1.0f, buff.sThumbLX);
-    p_gamepad_state->left_stick.y = rerange_value(-32768.0f, 32767.0f, -1.0f, 1.0f, buff.sThumbLY);
+// Same locking as publish_gamepad_state().
+static inline void publish_gamepad_context(uint32_t index, gamepad_context_t* p_context, publish_sequence_t& publish_sequence = s_publish_sequences[0])
+{
+    gamepad_state_t state;
+    internal_get_gamepad_state(p_context, &state);
+    publish_gamepad_state(index, &state, true, publish_sequence);
+}
 
-    p_gamepad_state->right_stick.x = rerange_value(-32768.0f, 32767.0f, -1.0f, 1.0f, buff.sThumbRX);
-    p_gamepad_state->right_stick.y = rerange_value(-32768.0f, 32767.0f, -1.0f, 1.0f, buff.sThumbRY);
+// Lock-free, returns false when the slot has no connected gamepad.
+static bool read_published_gamepad_state(uint32_t index, gamepad_state_t* p_gamepad_state)
+{
+    published_state_t const& published = get_published_state(index);
+    uint32_t words[sizeof(gamepad_state_t) / sizeof(uint32_t)];
+    uint32_t sequence;
+    uint32_t connected;
 
-    p_gamepad_state->buttons = buff.wButtons;
+    while (true)
+    {
+        published_buffer_t const& buffer = published.buffers[published.latest.load(std::memory_order_acquire)];
 
-    if (buff.bExtraButtons & 0x01)
-        p_gamepad_state->buttons |= button_share;
+        sequence = buffer.sequence.load(std::memory_order_acquire);
+        if (sequence & 1)
+            continue;
 
-    p_gamepad_state->left_trigger = rerange_value(0.0f, 255.0f, 0.0f, 1.0f, buff.bLeftTrigger);
-    p_gamepad_state->right_trigger = rerange_value(0.0f, 255.0f, 0.0f, 1.0f, buff.bRightTrigger);
+        connected = buffer.connected.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < sizeof(words) / sizeof(*words); ++i)
+            words[i] = buffer.words[i].load(std::memory_order_relaxed);
 
-    return gamepad::success;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (buffer.sequence.load(std::memory_order_relaxed) == sequence)
+            break;
+    }
+
+    if (connected == 0)
+        return false;
+
+    memcpy(p_gamepad_state, words, sizeof(words));
+    return true;
 }
 
-static int32_t get_gamepad_infos(gamepad_context_t* p_context)
+// Lock-free, same retry loop as read_published_gamepad_state().
+static void read_published_gamepad_changes(uint32_t index, uint64_t last_seen_sequence, uint64_t* p_sequence, uint32_t* p_dirty_mask)
 {
-    WORD buffer[6] = { 0 };
-    bool success = (DeviceInIo(p_context, IOCTL_XINPUT_GET_INFORMATION, buffer, sizeof(buffer)) >= 0 ? true : false);
-    if (success)
+    published_state_t const& published = get_published_state(index);
+    uint64_t change_sequence;
+    uint32_t dirty_mask;
+
+    while (true)
     {
-        if (!(buffer[2] & 0x80))
-        {
-            for (int i = 0; i < (buffer[1] & 0xFF); ++i)
-            {
-                //dwUserIndex = i;
-                p_context->type = buffer[0];
-                p_context->id.id = 0;
-                p_context->id.vendorID = buffer[4];
-                p_context->id.productID = buffer[5];
+        published_buffer_t const& buffer = published.buffers[published.latest.load(std::memory_order_acquire)];
 
-                {// This part might not be needed
-                    char buff[5] = {
-                        0,              // XInput User Index
-                        XINPUT_LED_OFF, // LED Status
-                        0,
-                        0,
-                        1 };
+        uint32_t sequence = buffer.sequence.load(std::memory_order_acquire);
+        if (sequence & 1)
+            continue;
 
-                    DeviceOutIo(p_context, IOCTL_XINPUT_SET_GAMEPAD_STATE, buff, sizeof(buff));
-                }
+        change_sequence = buffer.change_sequence.load(std::memory_order_relaxed);
+        dirty_mask = gamepad::state_field_none;
+        if (change_sequence > last_seen_sequence)
+        {
+            for (uint32_t i = 0; i < state_field_count; ++i)
+            {
+                if (buffer.field_sequences[i].load(std::memory_order_relaxed) > last_seen_sequence)
+                    dirty_mask |= (1u << i);
             }
         }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (buffer.sequence.load(std::memory_order_relaxed) == sequence)
+            break;
     }
-    return success;
+
+    *p_sequence = change_sequence;
+    *p_dirty_mask = dirty_mask;
 }
 
-static void close_device(gamepad_context_t* p_context)
+static inline uint64_t get_monotonic_us()
 {
-    if (p_context->hDevice != INVALID_HANDLE_VALUE)
-    {
-        CloseHandle(p_context->hDevice);
-        p_context->hDevice = INVALID_HANDLE_VALUE;
-    }
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
 }
 
-static int32_t internal_create_context(gamepad_context_t** pp_context, PWSTR device_path)
+static inline uint32_t get_highest_bit(uint32_t value)
 {
-    *pp_context = (gamepad_context_t*)malloc(sizeof(gamepad_context_t));
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse(&index, value);
+    return static_cast<uint32_t>(index);
+#else
+    return 31 - static_cast<uint32_t>(__builtin_clz(value));
+#endif
+}
 
-    if (*pp_context == nullptr)
-        return gamepad::failed;
+// Exact below 32us, then 16 buckets per power of two up to 2^32us.
+static inline uint32_t get_latency_bucket(uint64_t latency_us)
+{
+    if (latency_us < 32)
+        return static_cast<uint32_t>(latency_us);
 
-    (*pp_context)->hDevice = INVALID_HANDLE_VALUE;
-    (*pp_context)->dead = false;
+    uint32_t value = static_cast<uint32_t>(std::min<uint64_t>(latency_us, 0xffffffffu));
+    uint32_t shift = get_highest_bit(value) - 4;
+    return shift * 16 + (value >> shift);
+}
 
-    memset(&(*pp_context)->gamepadState, 0, sizeof(gamepad_state_t));
+// Highest latency counted in the bucket.
+static constexpr uint64_t get_latency_bucket_max(uint32_t bucket)
+{
+    return bucket < 32 ? bucket : ((static_cast<uint64_t>(bucket % 16 + 16) + 1) << (bucket / 16 - 1)) - 1;
+}
 
-    (*pp_context)->devicePath = _wcsdup(device_path);
-    if ((*pp_context)->devicePath == nullptr)
-        return gamepad::failed;
+static_assert(get_latency_bucket_max(latency_bucket_count - 1) == 0xffffffffu, "latency_bucket_count must cover 32bits latencies.");
 
-    (*pp_context)->hDevice = CreateFileW((*pp_context)->devicePath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
-    if ((*pp_context)->hDevice == INVALID_HANDLE_VALUE)
-        return gamepad::failed;
+static void record_latency(latency_stats_t& stats, uint64_t latency_us)
+{
+    stats.buckets[get_latency_bucket(latency_us)].fetch_add(1, std::memory_order_relaxed);
+    stats.sum_us.fetch_add(latency_us, std::memory_order_relaxed);
 
-    if (!get_gamepad_infos(*pp_context))
-        return gamepad::failed;
+    // Safe with any number of writers, a plain store could replace a larger max.
+    uint64_t max_us = stats.max_us.load(std::memory_order_relaxed);
+    while (latency_us > max_us && !stats.max_us.compare_exchange_weak(max_us, latency_us, std::memory_order_relaxed))
+        ;
+}
 
-    return gamepad::success;
+// Must be called by the slot's writer (s_gamepad_mutex held, or the reader shard owning the slot with its mutex held),
+// when a backend decodes a report stamped report_us.
+static inline void record_report_read(gamepad_latency_stats_t& stats, uint64_t report_us, uint64_t read_us)
+{
+    // Never negative, even with a clock going slightly backward.
+    record_latency(stats.read, read_us > report_us ? read_us - report_us : 0);
+
+    if (stats.pending_report_count == max_pending_reports)
+    {
+        stats.visible.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    if (stats.pending_report_count == 0)
+        stats.pending_base_us = report_us;
+
+    uint64_t offset_us = report_us > stats.pending_base_us ? report_us - stats.pending_base_us : 0;
+    stats.pending_offsets_us[stats.pending_report_count++] = static_cast<uint32_t>(std::min<uint64_t>(offset_us, 0xffffffffu));
 }
 
-static void internal_free_context(gamepad_context_t** pp_context)
+// Same locking as record_report_read(), once the reports decoded for the slot got published.
+static inline void record_reports_visible(uint32_t index)
 {
-    if (*pp_context == nullptr)
+    slot_chunk_t* p_chunk = get_slot_chunk(index);
+    if (p_chunk == nullptr)
         return;
 
-    close_device(*pp_context);
+    gamepad_latency_stats_t& stats = p_chunk->latency_stats[index % slot_chunk_size];
+    if (stats.pending_report_count == 0)
+        return;
 
-    if ((*pp_context)->devicePath != nullptr)
+    uint64_t now_us = get_monotonic_us();
+    for (uint32_t i = 0; i < stats.pending_report_count; ++i)
     {
-        free((*pp_context)->devicePath);
-        (*pp_context)->devicePath = nullptr;
+        uint64_t report_us = stats.pending_base_us + stats.pending_offsets_us[i];
+        record_latency(stats.visible, now_us > report_us ? now_us - report_us : 0);
     }
 
-    free(*pp_context);
-    *pp_context = nullptr;
+    stats.pending_report_count = 0;
 }
 
-static int32_t internal_get_gamepad(uint32_t index, gamepad_context_t** pp_context)
+static void copy_latency_stats(latency_stats_t& stats, latency_histogram_t& histogram, bool reset)
 {
-    HDEVINFO device_info_set;
-    SP_DEVICE_INTERFACE_DATA interface_data;
-    SP_DEVICE_INTERFACE_DETAIL_DATA_W* data;
-    DWORD detail_size = MAX_PATH * sizeof(WCHAR);
-    DWORD idx = 0;
-
-    if (s_gamepads[index] != nullptr && !s_gamepads[index]->dead)
+    histogram.count = 0;
+    for (uint32_t i = 0; i < latency_bucket_count; ++i)
     {
-        *pp_context = s_gamepads[index];
-        return gamepad::success;
+        histogram.buckets[i] = reset ? stats.buckets[i].exchange(0, std::memory_order_relaxed) : stats.buckets[i].load(std::memory_order_relaxed);
+        histogram.count += histogram.buckets[i];
     }
-    *pp_context = nullptr;
-
-    // Didn't find the gamepad, going to check for new ones
-    device_info_set = SetupDiGetClassDevsW(&XUSB_INTERFACE_CLASS_GUID, NULL, NULL, DIGCF_DEVICEINTERFACE | DIGCF_PRESENT);
+    histogram.sum_us = reset ? stats.sum_us.exchange(0, std::memory_order_relaxed) : stats.sum_us.load(std::memory_order_relaxed);
+    histogram.max_us = reset ? stats.max_us.exchange(0, std::memory_order_relaxed) : stats.max_us.load(std::memory_order_relaxed);
+    histogram.dropped = reset ? stats.dropped.exchange(0, std::memory_order_relaxed) : stats.dropped.load(std::memory_order_relaxed);
+}
 
-    data = (SP_DEVICE_INTERFACE_DETAIL_DATA_W*)HeapAlloc(GetProcessHeap(), 0, sizeof(*data) + detail_size);
-    if (data == nullptr)
-        return gamepad::failed;
+// Must be called with s_gamepad_mutex held, allocates the slot chunk.
+static inline gamepad_latency_stats_t& get_latency_stats(uint32_t index)
+{
+    return get_writable_slot_chunk(index, true)->latency_stats[index % slot_chunk_size];
+}
 
-    data->cbSize = sizeof(*data);
+// Must be called with s_gamepad_mutex held, when a new gamepad gets the slot.
+static void reset_latency_stats(uint32_t index)
+{
+    gamepad_latency_stats_t& stats = get_latency_stats(index);
+    latency_histogram_t histogram;
+    copy_latency_stats(stats.read, histogram, true);
+    copy_latency_stats(stats.visible, histogram, true);
+    stats.pending_report_count = 0;
+}
 
-    ZeroMemory(&interface_data, sizeof(interface_data));
-    interface_data.cbSize = sizeof(interface_data);
+// Must be called with s_gamepad_mutex held.
+static int32_t update_and_publish_gamepad_state(gamepad_context_t* p_context, uint32_t index)
+{
+    gamepad_state_t old_state;
+    gamepad_state_t new_state;
 
-    while (SetupDiEnumDeviceInterfaces(device_info_set, NULL, &XUSB_INTERFACE_CLASS_GUID, idx++, &interface_data))
+    internal_get_gamepad_state(p_context, &old_state);
+    if (internal_update_gamepad_state(p_context) != gamepad::success)
     {
-        if (!SetupDiGetDeviceInterfaceDetailW(device_info_set,
-            &interface_data, data, sizeof(*data) + detail_size, NULL, NULL))
-            continue;
+        unpublish_gamepad_state(index);
+        return gamepad::failed;
+    }
 
-        bool found = false;
-        int free_device = -1;
-        for (uint32_t i = 0; i < max_connected_gamepads; ++i)
-        {
-            if (s_gamepads[i] != nullptr)
-            {
-                if (!s_gamepads[i]->dead)
-                {
-                    if (wcscmp(s_gamepads[i]->devicePath, data->DevicePath) == 0)
-                    {
-                        found = true;
-                        break;
-                    }
-                    continue;
-                }
-                internal_free_context(&s_gamepads[i]);
-            }
-            if (free_device == -1)
-            {
-                free_device = i;
-            }
-        }
+    internal_get_gamepad_state(p_context, &new_state);
+    if (memcmp(&old_state, &new_state, sizeof(gamepad_state_t)) != 0)
+        publish_gamepad_state(index, &new_state, true);
 
-        if (!found && free_device != -1)
-        {
-            if (internal_create_context(&s_gamepads[free_device], data->DevicePath) != gamepad::success)
-            {
-                internal_free_context(&s_gamepads[free_device]);
-            }
-        }
-    }
-    HeapFree(GetProcessHeap(), 0, data);
-    SetupDiDestroyDeviceInfoList(device_info_set);
+    record_reports_visible(index);
+    return gamepad::success;
+}
 
-    if(s_gamepads[index] != nullptr && !s_gamepads[index]->dead)
-    {
-        *pp_context = s_gamepads[index];
-        return gamepad::success;
-    }
+// Must be called with s_gamepad_mutex held.
+static inline void queue_connection_event(uint32_t index, bool connected)
+{
+    if (s_connection_callback != nullptr)
+        s_connection_events.emplace_back(connection_event_t{ index, connected });
+}
 
-    return gamepad::failed;
+// Must be called with s_gamepad_mutex held.
+static inline void take_connection_events(pending_connection_events_t& pending)
+{
+    pending.callback = s_connection_callback;
+    pending.user_param = s_connection_callback_param;
+    pending.events.swap(s_connection_events);
+    pending.released_contexts.swap(s_released_contexts);
 }
 
-static int32_t internal_update_gamepad_state(gamepad_context_t* p_context)
+// Must be called without s_gamepad_mutex held, the callback is allowed to call the gamepad functions.
+static inline void dispatch_connection_events(pending_connection_events_t& pending)
 {
-    union
-    {
-        GamepadState0100 state0100;
-        GamepadState0101 state0101;
-    } out_buff;
+    for (auto& p_context : pending.released_contexts)
+        internal_free_context(&p_context);
 
-    union
-    {
-        InGamepadState0100 state0100;
-        InGamepadState0101 state0101;
-    } in_buff;
+    if (pending.callback == nullptr)
+        return;
 
-    DWORD inBuffSize;
-    DWORD outBuffSize;
-    unsigned int res;
+    for (auto const& event : pending.events)
+        pending.callback(event.index, event.connected, pending.user_param);
+}
 
-    memset(&out_buff, 0, sizeof(out_buff));
-    memset(&in_buff, 0, sizeof(in_buff));
+template<typename ...Args>
+static inline int32_t call_internal_action(uint32_t index, int32_t(*pfn_internal)(gamepad_context_t*, Args ...), Args ...args)
+{
+    pending_connection_events_t pending;
+    int32_t res;
 
-    if (p_context->type == 256)
-    {
-        in_buff.state0100.DeviceIndex = 0;
-        inBuffSize = sizeof(in_buff.state0100);
-        outBuffSize = sizeof(out_buff.state0100);
-    }
-    else
     {
-        in_buff.state0101.wType = 257;
-        in_buff.state0101.DeviceIndex= 0;
-        inBuffSize = sizeof(in_buff.state0101);
-        outBuffSize = sizeof(out_buff.state0101);
-    }
+        std::lock_guard<gamepad_mutex_t> lk(s_gamepad_mutex);
 
-    res = DeviceInOutIo(p_context, IOCTL_XINPUT_GET_GAMEPAD_STATE, &in_buff, inBuffSize, &out_buff, outBuffSize);
-    if (res < 0)
-    {
-        p_context->dead = 1;
-        return gamepad::failed;
-    }
+        gamepad_context_t* p_context;
+        if ((res = internal_get_gamepad(index, &p_context)) == gamepad::success)
+        {
+            std::unique_lock<std::mutex> reader_lk = internal_lock_reader(p_context);
+            res = pfn_internal(p_context, std::forward<Args>(args)...);
+        }
 
-    if (p_context->type == 256)
-    {
-        res = parse_buffer(&p_context->gamepadState, out_buff.state0100);
-    }
-    else
-    {
-        res = parse_buffer(&p_context->gamepadState, out_buff.state0101);
+        take_connection_events(pending);
     }
 
-    if (res != gamepad::success)
+    dispatch_connection_events(pending);
+    return res;
+}
+
+// Sorted by vendor then product id, get_gamepad_type() binary searches it.
+static constexpr struct known_gamepad_t
+{
+    struct
     {
-        p_context->dead = 1;
-    }
+        uint16_t vendorID;
+        uint16_t productID;
+    } id;
+    gamepad_type_t type_infos;
+} s_known_gamepads[] = {
+    {{0x0079, 0x0006}, gamepad_type_t::type_e::PS3    , "PC Twin Shock Controller"},
+    {{0x0079, 0x181a}, gamepad_type_t::type_e::PS3    , "Venom Arcade Stick"},
+    {{0x0079, 0x181b}, gamepad_type_t::type_e::PS4    , "Venom Arcade Stick"},
+    {{0x0079, 0x18d4}, gamepad_type_t::type_e::Xbox360, "GPD Win 2 X-Box Controller"},
+    {{0x044f, 0xb315}, gamepad_type_t::type_e::PS3    , "Firestorm Dual Analog 3"},
+    {{0x044f, 0xb326}, gamepad_type_t::type_e::Xbox360, "Thrustmaster Gamepad GP XID"},
+    {{0x044f, 0xd007}, gamepad_type_t::type_e::PS3    , "Thrustmaster wireless 3-1"},
+    {{0x045e, 0x028e}, gamepad_type_t::type_e::Xbox360, "Microsoft X-Box 360 pad"},
+    {{0x045e, 0x028f}, gamepad_type_t::type_e::Xbox360, "Microsoft X-Box 360 pad v2"},
+    {{0x045e, 0x0291}, gamepad_type_t::type_e::Xbox360, "Xbox 360 Wireless Receiver (XBOX)"},
+    {{0x045e, 0x02a0}, gamepad_type_t::type_e::Xbox360, "Microsoft X-Box 360 Big Button IR"},
+    {{0x045e, 0x02a1}, gamepad_type_t::type_e::Xbox360, "Microsoft X-Box 360 pad"},
+    {{0x045e, 0x02d1}, gamepad_type_t::type_e::XboxOne, "Microsoft X-Box One pad"},
+    {{0x045e, 0x02dd}, gamepad_type_t::type_e::XboxOne, "Microsoft X-Box One pad (Firmware 2015)"},
+    {{0x045e, 0x02e0}, gamepad_type_t::type_e::XboxOne, "Microsoft X-Box One S pad (Bluetooth)"},
+    {{0x045e, 0x02e3}, gamepad_type_t::type_e::XboxOne, "Microsoft X-Box One Elite pad"},
+    {{0x045e, 0x02ea}, gamepad_type_t::type_e::XboxOne, "Microsoft X-Box One S pad"},
+    {{0x045e, 0x02fd}, gamepad_type_t::type_e::XboxOne, "Microsoft X-Box One S pad (Bluetooth)"},
+    {{0x045e, 0x02ff}, gamepad_type_t::type_e::XboxOne, "Microsoft X-Box One Elite pad"},
+    {{0x045e, 0x0719}, gamepad_type_t::type_e::Xbox360, "Xbox 360 Wireless Receiver"},
+    {{0x045e, 0x0b12}, gamepad_type_t::type_e::XboxOne, "Microsoft X-Box One Wireless Controller"},
+    {{0x045e, 0x0b13}, gamepad_type_t::type_e::XboxOne, "Microsoft X-Box One Wireless Controller"},
+    {{0x045e, 0x0b20}, gamepad_type_t::type_e::XboxOne, "Microsoft X-Box One Wireless Controller"},
+    {{0x046d, 0xc21d}, gamepad_type_t::type_e::Xbox360, "Logitech Gamepad F310"},
+    {{0x046d, 0xc21e}, gamepad_type_t::type_e::Xbox360, "Logitech Gamepad F510"},
+    {{0x046d, 0xc21f}, gamepad_type_t::type_e::Xbox360, "Logitech Gamepad F710"},
+    {{0x046d, 0xc242}, gamepad_type_t::type_e::Xbox360, "Logitech Chillstream Controller"},
+    {{0x054c, 0x0268}, gamepad_type_t::type_e::PS3    , "Sony PS3 Controller"},
+    {{0x054c, 0x05c4}, gamepad_type_t::type_e::PS4    , "Sony PS4 Controller"},
+    {{0x054c, 0x05c5}, gamepad_type_t::type_e::PS4    , "STRIKEPAD PS4 Grip Add-on"},
+    {{0x054c, 0x09cc}, gamepad_type_t::type_e::PS4    , "Sony PS4 Slim Controller"},
+    {{0x054c, 0x0ba0}, gamepad_type_t::type_e::PS4    , "Sony PS4 Controller (Wireless dongle)"},
+    {{0x056e, 0x2004}, gamepad_type_t::type_e::Xbox360, "Elecom JC-U3613M"},
+    {{0x056e, 0x2013}, gamepad_type_t::type_e::PS3    , "JC-U4113SBK"},
+    {{0x05b8, 0x1006}, gamepad_type_t::type_e::PS3    , "JC-U3412SBK"},
+    {{0x06a3, 0xf51a}, gamepad_type_t::type_e::Xbox360, "Saitek P3600"},
+    {{0x06a3, 0xf622}, gamepad_type_t::type_e::PS3    , "Cyborg V3"},
+    {{0x0738, 0x3180}, gamepad_type_t::type_e::PS3    , "Mad Catz Alpha PS3 mode"},
+    {{0x0738, 0x3250}, gamepad_type_t::type_e::PS4    , "Mad Catz FightPad PRO"},
+    {{0x0738, 0x4716}, gamepad_type_t::type_e::Xbox360, "Mad Catz Wired Xbox 360 Controller"},
+    {{0x0738, 0x4718}, gamepad_type_t::type_e::Xbox360, "Mad Catz Street Fighter IV FightStick SE"},
+    {{0x0738, 0x4726}, gamepad_type_t::type_e::Xbox360, "Mad Catz Xbox 360 Controller"},
+    {{0x0738, 0x4728}, gamepad_type_t::type_e::Xbox360, "Mad Catz Street Fighter IV FightPad"},
+    {{0x0738, 0x4736}, gamepad_type_t::type_e::Xbox360, "Mad Catz MicroCon Gamepad"},
+    {{0x0738, 0x4738}, gamepad_type_t::type_e::Xbox360, "Mad Catz Wired Xbox 360 Controller (SFIV)"},
+    {{0x0738, 0x4740}, gamepad_type_t::type_e::Xbox360, "Mad Catz Beat Pad"},
+    {{0x0738, 0x4a01}, gamepad_type_t::type_e::XboxOne, "Mad Catz FightStick TE 2"},
+    {{0x0738, 0x8180}, gamepad_type_t::type_e::PS3    , "Mad Catz Alpha PS4 mode"},
+    {{0x0738, 0x8250}, gamepad_type_t::type_e::PS4    , "Mad Catz FightPad Pro PS4"},
+    {{0x0738, 0x8384}, gamepad_type_t::type_e::PS4    , "Mad Catz Fightstick TE S+"},
+    {{0x0738, 0x8480}, gamepad_type_t::type_e::PS4    , "Mad Catz FightStick TE 2"},
+    {{0x0738, 0x8481}, gamepad_type_t::type_e::PS4    , "Mad Catz FightStick TE 2+ PS4"},
+    {{0x0738, 0x8838}, gamepad_type_t::type_e::PS3    , "Madcatz Fightstick Pro"},
+    {{0x0738, 0xb726}, gamepad_type_t::type_e::Xbox360, "Mad Catz Xbox controller - MW2"},
+    {{0x0738, 0xbeef}, gamepad_type_t::type_e::Xbox360, "Mad Catz JOYTECH NEO SE Advanced GamePad"},
+    {{0x0738, 0xcb02}, gamepad_type_t::type_e::Xbox360, "Saitek Cyborg Rumble Pad - PC/Xbox 360"},
+    {{0x0738, 0xcb03}, gamepad_type_t::type_e::Xbox360, "Saitek P3200 Rumble Pad - PC/Xbox 360"},
+    {{0x0738, 0xf738}, gamepad_type_t::type_e::Xbox360, "Super SFIV FightStick TE S"},
+    {{0x0925, 0x0005}, gamepad_type_t::type_e::PS3    , "Sony PS3 Controller"},
+    {{0x0c12, 0x0e10}, gamepad_type_t::type_e::PS4    , "Armor Armor 3 Pad PS4"},
+    {{0x0c12, 0x0e15}, gamepad_type_t::type_e::PS4    , "Game:Pad 4"},
+    {{0x0c12, 0x0ef6}, gamepad_type_t::type_e::PS4    , "Hitbox Arcade Stick"},
+    {{0x0c12, 0x1cf6}, gamepad_type_t::type_e::PS4    , "EMIO PS4 Elite Controller"},
+    {{0x0e6f, 0x0105}, gamepad_type_t::type_e::Xbox360, "HSM3 Xbox360 dancepad"},
+    {{0x0e6f, 0x0113}, gamepad_type_t::type_e::Xbox360, "Afterglow AX.1 Gamepad for Xbox 360"},
+    {{0x0e6f, 0x011e}, gamepad_type_t::type_e::PS3    , "Rock Candy PS4"},
+    {{0x0e6f, 0x011f}, gamepad_type_t::type_e::Xbox360, "Rock Candy Gamepad Wired Controller"},
+    {{0x0e6f, 0x0128}, gamepad_type_t::type_e::PS3    , "Rock Candy PS3"},
+    {{0x0e6f, 0x0133}, gamepad_type_t::type_e::Xbox360, "Xbox 360 Wired Controller"},
+    {{0x0e6f, 0x0139}, gamepad_type_t::type_e::XboxOne, "Afterglow Prismatic Wired Controller"},
+    {{0x0e6f, 0x013a}, gamepad_type_t::type_e::XboxOne, "PDP Xbox One Controller"},
+    {{0x0e6f, 0x0146}, gamepad_type_t::type_e::XboxOne, "Rock Candy Wired Controller for Xbox One"},
+    {{0x0e6f, 0x0147}, gamepad_type_t::type_e::XboxOne, "PDP Marvel Xbox One Controller"},
+    {{0x0e6f, 0x015c}, gamepad_type_t::type_e::XboxOne, "PDP Xbox One Arcade Stick"},
+    {{0x0e6f, 0x0161}, gamepad_type_t::type_e::XboxOne, "PDP Xbox One Controller"},
+    {{0x0e6f, 0x0162}, gamepad_type_t::type_e::XboxOne, "PDP Xbox One Controller"},
+    {{0x0e6f, 0x0163}, gamepad_type_t::type_e::XboxOne, "PDP Xbox One Controller"},
+    {{0x0e6f, 0x0164}, gamepad_type_t::type_e::XboxOne, "PDP Battlefield One"},
+    {{0x0e6f, 0x0165}, gamepad_type_t::type_e::XboxOne, "PDP Titanfall 2"},
+    {{0x0e6f, 0x0180}, gamepad_type_t::type_e::Switch , "PDP Faceoff Wired Pro Controller for Nintendo Switch"},
+    {{0x0e6f, 0x0181}, gamepad_type_t::type_e::Switch , "PDP Faceoff Deluxe Wired Pro Controller for Nintendo Switch"},
+    {{0x0e6f, 0x0185}, gamepad_type_t::type_e::Switch , "PDP Wired Fight Pad Pro for Nintendo Switch"},
+    {{0x0e6f, 0x0201}, gamepad_type_t::type_e::Xbox360, "Pelican PL-3601 'TSZ' Wired Xbox 360 Controller"},
+    {{0x0e6f, 0x0203}, gamepad_type_t::type_e::PS3    , "Victrix Pro FS"},
+    {{0x0e6f, 0x0213}, gamepad_type_t::type_e::Xbox360, "Afterglow Gamepad for Xbox 360"},
+    {{0x0e6f, 0x0214}, gamepad_type_t::type_e::PS3    , "Afterglow PS3"},
+    {{0x0e6f, 0x021f}, gamepad_type_t::type_e::Xbox360, "Rock Candy Gamepad for Xbox 360"},
+    {{0x0e6f, 0x0246}, gamepad_type_t::type_e::XboxOne, "Rock Candy Gamepad for Xbox One 2015"},
+    {{0x0e6f, 0x0301}, gamepad_type_t::type_e::Xbox360, "Logic3 Controller"},
+    {{0x0e6f, 0x0346}, gamepad_type_t::type_e::XboxOne, "Rock Candy Gamepad for Xbox One 2016"},
+    {{0x0e6f, 0x0401}, gamepad_type_t::type_e::Xbox360, "Logic3 Controller"},
+    {{0x0e6f, 0x0413}, gamepad_type_t::type_e::Xbox360, "Afterglow AX.1 Gamepad for Xbox 360"},
+    {{0x0e6f, 0x0501}, gamepad_type_t::type_e::Xbox360, "PDP Xbox 360 Controller"},
+    {{0x0e6f, 0x1314}, gamepad_type_t::type_e::PS3    , "PDP Afterglow Wireless PS3 controller"},
+    {{0x0e6f, 0xf900}, gamepad_type_t::type_e::Xbox360, "PDP Afterglow AX.1"},
+    {{0x0e8f, 0x0008}, gamepad_type_t::type_e::PS3    , "Green Asia"},
+    {{0x0e8f, 0x3075}, gamepad_type_t::type_e::PS3    , "SpeedLink Strike FX"},
+    {{0x0f0d, 0x0009}, gamepad_type_t::type_e::PS3    , "HORI BDA GP1"},
+    {{0x0f0d, 0x000a}, gamepad_type_t::type_e::Xbox360, "Hori Co. DOA4 FightStick"},
+    {{0x0f0d, 0x000c}, gamepad_type_t::type_e::Xbox360, "Hori PadEX Turbo"},
+    {{0x0f0d, 0x000d}, gamepad_type_t::type_e::Xbox360, "Hori Fighting Stick EX2"},
+    {{0x0f0d, 0x0016}, gamepad_type_t::type_e::Xbox360, "Hori Real Arcade Pro.EX"},
+    {{0x0f0d, 0x001b}, gamepad_type_t::type_e::Xbox360, "Hori Real Arcade Pro VX"},
+    {{0x0f0d, 0x004d}, gamepad_type_t::type_e::PS3    , "Horipad 3"},
+    {{0x0f0d, 0x0055}, gamepad_type_t::type_e::PS4    , "HORIPAD 4 FPS"},
+    {{0x0f0d, 0x005e}, gamepad_type_t::type_e::PS3    , "HORI Fighting commander PS4"},
+    {{0x0f0d, 0x005f}, gamepad_type_t::type_e::PS3    , "HORI Fighting commander PS3"},
+    {{0x0f0d, 0x0063}, gamepad_type_t::type_e::XboxOne, "Hori Real Arcade Pro Hayabusa (USA) Xbox One"},
+    {{0x0f0d, 0x0066}, gamepad_type_t::type_e::PS4    , "HORIPAD 4 FPS Plus"},
+    {{0x0f0d, 0x0067}, gamepad_type_t::type_e::XboxOne, "HORIPAD ONE"},
+    {{0x0f0d, 0x006a}, gamepad_type_t::type_e::PS3    , "Real Arcade Pro 4"},
+    {{0x0f0d, 0x006e}, gamepad_type_t::type_e::PS3    , "HORI horipad4 PS3"},
+    {{0x0f0d, 0x0078}, gamepad_type_t::type_e::XboxOne, "Hori Real Arcade Pro V Kai Xbox One"},
+    {{0x0f0d, 0x0087}, gamepad_type_t::type_e::PS3    , "HORI fighting mini stick"},
+    {{0x0f0d, 0x008a}, gamepad_type_t::type_e::PS4    , "HORI Real Arcade Pro 4"},
+    {{0x0f0d, 0x0092}, gamepad_type_t::type_e::Switch , "HORI Pokken Tournament DX Pro Pad"},
+    {{0x0f0d, 0x009c}, gamepad_type_t::type_e::PS4    , "HORI TAC PRO"},
+    {{0x0f0d, 0x00a0}, gamepad_type_t::type_e::PS4    , "HORI TAC4"},
+    {{0x0f0d, 0x00c1}, gamepad_type_t::type_e::Switch , "HORI Pad Switch"},
+    {{0x0f0d, 0x00dc}, gamepad_type_t::type_e::Switch , "HORI Battle Pad"},
+    {{0x0f0d, 0x00ee}, gamepad_type_t::type_e::PS4    , "HORI mini wired gamepad"},
+    {{0x0f0d, 0x00f6}, gamepad_type_t::type_e::Switch , "HORI Wireless Switch Pad"},
+    {{0x0f30, 0x1100}, gamepad_type_t::type_e::PS3    , "Quanba Q1 fight stick"},
+    {{0x11c9, 0x55f0}, gamepad_type_t::type_e::Xbox360, "Nacon GC-100XF"},
+    {{0x11ff, 0x3331}, gamepad_type_t::type_e::PS3    , "SRXJ-PH2400"},
+    {{0x12ab, 0x0004}, gamepad_type_t::type_e::Xbox360, "Honey Bee Xbox360 dancepad"},
+    {{0x12ab, 0x0301}, gamepad_type_t::type_e::Xbox360, "PDP AFTERGLOW AX.1"},
+    {{0x12ab, 0x0303}, gamepad_type_t::type_e::Xbox360, "Mortal Kombat Klassic FightStick"},
+    {{0x1345, 0x1000}, gamepad_type_t::type_e::PS3    , "PS2 ACME GA-D5"},
+    {{0x1430, 0x4748}, gamepad_type_t::type_e::Xbox360, "RedOctane Guitar Hero X-plorer"},
+    {{0x1430, 0xf801}, gamepad_type_t::type_e::Xbox360, "RedOctane Controller"},
+    {{0x146b, 0x0601}, gamepad_type_t::type_e::Xbox360, "BigBen Interactive XBOX 360 Controller"},
+    {{0x146b, 0x0d01}, gamepad_type_t::type_e::PS4    , "Nacon Revolution Pro Controller"},
+    {{0x146b, 0x0d02}, gamepad_type_t::type_e::PS4    , "Nacon Revolution Pro Controller V2"},
+    {{0x1532, 0x0037}, gamepad_type_t::type_e::Xbox360, "Razer Sabertooth"},
+    {{0x1532, 0x0a00}, gamepad_type_t::type_e::XboxOne, "Razer Atrox Arcade Stick"},
+    {{0x1532, 0x0a03}, gamepad_type_t::type_e::XboxOne, "Razer Wildcat"},
+    {{0x1532, 0x1000}, gamepad_type_t::type_e::PS4    , "Razer Raiju PS4 Controller"},
+    {{0x1532, 0x1004}, gamepad_type_t::type_e::PS4    , "Razer Raiju 2 Ultimate Edition (USB)"},
+    {{0x1532, 0x1007}, gamepad_type_t::type_e::PS4    , "Razer Raiju 2 Tournament Edition (USB)"},
+    {{0x1532, 0x1008}, gamepad_type_t::type_e::PS4    , "Razer Panthera Evo Fightstick"},
+    {{0x1532, 0x1009}, gamepad_type_t::type_e::PS4    , "Razer Raiju 2 Ultimate Edition (BT)"},
+    {{0x1532, 0x100a}, gamepad_type_t::type_e::PS4    , "Razer Raiju 2 Tournament Edition (BT)"},
+    {{0x15e4, 0x3f00}, gamepad_type_t::type_e::Xbox360, "Power A Mini Pro Elite"},
+    {{0x15e4, 0x3f0a}, gamepad_type_t::type_e::Xbox360, "Xbox Airflo wired controller"},
+    {{0x15e4, 0x3f10}, gamepad_type_t::type_e::Xbox360, "Batarang Xbox 360 controller"},
+    {{0x162e, 0xbeef}, gamepad_type_t::type_e::Xbox360, "Joytech Neo-Se Take2"},
+    {{0x1689, 0xfd00}, gamepad_type_t::type_e::Xbox360, "Razer Onza Tournament Edition"},
+    {{0x1689, 0xfd01}, gamepad_type_t::type_e::Xbox360, "Razer Onza Classic Edition"},
+    {{0x1689, 0xfe00}, gamepad_type_t::type_e::Xbox360, "Razer Sabertooth"},
+    {{0x1a34, 0x0836}, gamepad_type_t::type_e::PS3    , "Afterglow PS3"},
+    {{0x1bad, 0x0002}, gamepad_type_t::type_e::Xbox360, "Harmonix Rock Band Guitar"},
+    {{0x1bad, 0x0003}, gamepad_type_t::type_e::Xbox360, "Harmonix Rock Band Drumkit"},
+    {{0x1bad, 0xf016}, gamepad_type_t::type_e::Xbox360, "Mad Catz Xbox 360 Controller"},
+    {{0x1bad, 0xf018}, gamepad_type_t::type_e::Xbox360, "Mad Catz Street Fighter IV SE Fighting Stick"},
+    {{0x1bad, 0xf019}, gamepad_type_t::type_e::Xbox360, "Mad Catz Brawlstick for Xbox 360"},
+    {{0x1bad, 0xf021}, gamepad_type_t::type_e::Xbox360, "Mad Cats Ghost Recon FS GamePad"},
+    {{0x1bad, 0xf023}, gamepad_type_t::type_e::Xbox360, "MLG Pro Circuit Controller (Xbox)"},
+    {{0x1bad, 0xf025}, gamepad_type_t::type_e::Xbox360, "Mad Catz Call Of Duty"},
+    {{0x1bad, 0xf027}, gamepad_type_t::type_e::Xbox360, "Mad Catz FPS Pro"},
+    {{0x1bad, 0xf028}, gamepad_type_t::type_e::Xbox360, "Street Fighter IV FightPad"},
+    {{0x1bad, 0xf02e}, gamepad_type_t::type_e::Xbox360, "Mad Catz Fightpad"},
+    {{0x1bad, 0xf036}, gamepad_type_t::type_e::Xbox360, "Mad Catz MicroCon GamePad Pro"},
+    {{0x1bad, 0xf038}, gamepad_type_t::type_e::Xbox360, "Street Fighter IV FightStick TE"},
+    {{0x1bad, 0xf039}, gamepad_type_t::type_e::Xbox360, "Mad Catz MvC2 TE"},
+    {{0x1bad, 0xf03a}, gamepad_type_t::type_e::Xbox360, "Mad Catz SFxT Fightstick Pro"},
+    {{0x1bad, 0xf03d}, gamepad_type_t::type_e::Xbox360, "Street Fighter IV Arcade Stick TE - Chun Li"},
+    {{0x1bad, 0xf03e}, gamepad_type_t::type_e::Xbox360, "Mad Catz MLG FightStick TE"},
+    {{0x1bad, 0xf03f}, gamepad_type_t::type_e::Xbox360, "Mad Catz FightStick SoulCaliber"},
+    {{0x1bad, 0xf042}, gamepad_type_t::type_e::Xbox360, "Mad Catz FightStick TES+"},
+    {{0x1bad, 0xf080}, gamepad_type_t::type_e::Xbox360, "Mad Catz FightStick TE2"},
+    {{0x1bad, 0xf501}, gamepad_type_t::type_e::Xbox360, "HoriPad EX2 Turbo"},
+    {{0x1bad, 0xf502}, gamepad_type_t::type_e::Xbox360, "Hori Real Arcade Pro.VX SA"},
+    {{0x1bad, 0xf503}, gamepad_type_t::type_e::Xbox360, "Hori Fighting Stick VX"},
+    {{0x1bad, 0xf504}, gamepad_type_t::type_e::Xbox360, "Hori Real Arcade Pro. EX"},
+    {{0x1bad, 0xf505}, gamepad_type_t::type_e::Xbox360, "Hori Fighting Stick EX2B"},
+    {{0x1bad, 0xf506}, gamepad_type_t::type_e::Xbox360, "Hori Real Arcade Pro.EX Premium VLX"},
+    {{0x1bad, 0xf900}, gamepad_type_t::type_e::Xbox360, "Harmonix Xbox 360 Controller"},
+    {{0x1bad, 0xf901}, gamepad_type_t::type_e::Xbox360, "Gamestop Xbox 360 Controller"},
+    {{0x1bad, 0xf903}, gamepad_type_t::type_e::Xbox360, "Tron Xbox 360 controller"},
+    {{0x1bad, 0xf904}, gamepad_type_t::type_e::Xbox360, "PDP Versus Fighting Pad"},
+    {{0x1bad, 0xf906}, gamepad_type_t::type_e::Xbox360, "MortalKombat FightStick"},
+    {{0x1bad, 0xfa01}, gamepad_type_t::type_e::Xbox360, "MadCatz GamePad"},
+    {{0x1bad, 0xfd00}, gamepad_type_t::type_e::Xbox360, "Razer Onza TE"},
+    {{0x1bad, 0xfd01}, gamepad_type_t::type_e::Xbox360, "Razer Onza"},
+    {{0x20bc, 0x5500}, gamepad_type_t::type_e::PS3    , "ShanWan PS3"},
+    {{0x20d6, 0x576d}, gamepad_type_t::type_e::PS3    , "Power A PS3"},
+    {{0x20d6, 0xa711}, gamepad_type_t::type_e::Switch , "PowerA Wired Controller Plus/PowerA Wired Gamcube Controller"},
+    {{0x24c6, 0x5000}, gamepad_type_t::type_e::Xbox360, "Razer Atrox Arcade Stick"},
+    {{0x24c6, 0x5300}, gamepad_type_t::type_e::Xbox360, "PowerA MINI PROEX Controller"},
+    {{0x24c6, 0x5303}, gamepad_type_t::type_e::Xbox360, "Xbox Airflo wired controller"},
+    {{0x24c6, 0x530a}, gamepad_type_t::type_e::Xbox360, "Xbox 360 Pro EX Controller"},
+    {{0x24c6, 0x531a}, gamepad_type_t::type_e::Xbox360, "PowerA Pro Ex"},
+    {{0x24c6, 0x5397}, gamepad_type_t::type_e::Xbox360, "FUS1ON Tournament Controller"},
+    {{0x24c6, 0x541a}, gamepad_type_t::type_e::XboxOne, "PowerA Xbox One Mini Wired Controller"},
+    {{0x24c6, 0x542a}, gamepad_type_t::type_e::XboxOne, "Xbox ONE spectra"},
+    {{0x24c6, 0x543a}, gamepad_type_t::type_e::XboxOne, "PowerA Xbox One wired controller"},
+    {{0x24c6, 0x5500}, gamepad_type_t::type_e::Xbox360, "Hori XBOX 360 EX 2 with Turbo"},
+    {{0x24c6, 0x5501}, gamepad_type_t::type_e::Xbox360, "Hori Real Arcade Pro VX-SA"},
+    {{0x24c6, 0x5502}, gamepad_type_t::type_e::Xbox360, "Hori Fighting Stick VX Alt"},
+    {{0x24c6, 0x5503}, gamepad_type_t::type_e::Xbox360, "Hori Fighting Edge"},
+    {{0x24c6, 0x5506}, gamepad_type_t::type_e::Xbox360, "Hori SOULCALIBUR V Stick"},
+    {{0x24c6, 0x550d}, gamepad_type_t::type_e::Xbox360, "Hori GEM Xbox controller"},
+    {{0x24c6, 0x550e}, gamepad_type_t::type_e::Xbox360, "Hori Real Arcade Pro V Kai 360"},
+    {{0x24c6, 0x551a}, gamepad_type_t::type_e::XboxOne, "PowerA FUSION Pro Controller"},
+    {{0x24c6, 0x561a}, gamepad_type_t::type_e::XboxOne, "PowerA FUSION Controller"},
+    {{0x24c6, 0x5b02}, gamepad_type_t::type_e::Xbox360, "Thrustmaster"},
+    {{0x24c6, 0x5b03}, gamepad_type_t::type_e::Xbox360, "Thrustmaster Ferrari 458 Racing Wheel"},
+    {{0x24c6, 0x5d04}, gamepad_type_t::type_e::Xbox360, "Razer Sabertooth"},
+    {{0x24c6, 0xfafe}, gamepad_type_t::type_e::Xbox360, "Rock Candy Gamepad for Xbox 360"},
+    {{0x2563, 0x0523}, gamepad_type_t::type_e::PS3    , "Digiflip GP006"},
+    {{0x25f0, 0x83c3}, gamepad_type_t::type_e::PS3    , "Gioteck vx2"},
+    {{0x2c22, 0x2000}, gamepad_type_t::type_e::PS3    , "Quanba Drone"},
+    {{0x4001, 0x0104}, gamepad_type_t::type_e::PS4    , "PS4 Fun Controller"},
+    {{0x7545, 0x0104}, gamepad_type_t::type_e::PS4    , "Armor 3, Level Up Cobra"},
+    {{0x8380, 0x0003}, gamepad_type_t::type_e::PS3    , "BTP 2163"},
+    {{0x8888, 0x0308}, gamepad_type_t::type_e::PS3    , "Sony PS3 Controller"},
+    {{0x9886, 0x0025}, gamepad_type_t::type_e::PS4    , "Astro C40"},
+};
 
-    return res;
+static constexpr size_t s_known_gamepad_count = sizeof(s_known_gamepads) / sizeof(*s_known_gamepads);
+static constexpr gamepad_type_t s_unknown_gamepad = { gamepad_type_t::type_e::Unknown, "Unknown gamepad" };
+
+static constexpr uint32_t known_gamepad_key(uint16_t vendor_id, uint16_t product_id)
+{
+    return (uint32_t(vendor_id) << 16) | product_id;
 }
 
-static int32_t internal_get_gamepad_state(gamepad_context_t* p_context, gamepad_state_t* p_gamepad_state)
+// Checks [begin, end) halves by halves, the recursion stays log2(count) deep.
+static constexpr bool are_known_gamepads_sorted(size_t begin, size_t end)
 {
-    memcpy(p_gamepad_state, &p_context->gamepadState, sizeof(gamepad_state_t));
-    return gamepad::success;
+    return end - begin < 2 ||
+        (are_known_gamepads_sorted(begin, begin + (end - begin) / 2) &&
+         known_gamepad_key(s_known_gamepads[begin + (end - begin) / 2 - 1].id.vendorID, s_known_gamepads[begin + (end - begin) / 2 - 1].id.productID) <
+         known_gamepad_key(s_known_gamepads[begin + (end - begin) / 2].id.vendorID, s_known_gamepads[begin + (end - begin) / 2].id.productID) &&
+         are_known_gamepads_sorted(begin + (end - begin) / 2, end));
 }
 
-static int32_t internal_get_gamepad_id(gamepad_context_t* p_context, gamepad_id_t* p_gamepad_id)
+static_assert(are_known_gamepads_sorted(0, s_known_gamepad_count), "s_known_gamepads must be sorted by vendor then product id, without duplicates.");
+
+const gamepad_type_t& get_gamepad_type(gamepad_id_t const& id)
 {
-    p_gamepad_id->id = p_context->id.id;
-    return gamepad::success;
+    const uint32_t key = known_gamepad_key(id.vendorID, id.productID);
+    const known_gamepad_t* p_known = std::lower_bound(s_known_gamepads, s_known_gamepads + s_known_gamepad_count, key,
+        [](known_gamepad_t const& known, uint32_t key) { return known_gamepad_key(known.id.vendorID, known.id.productID) < key; });
+
+    if (p_known != s_known_gamepads + s_known_gamepad_count && known_gamepad_key(p_known->id.vendorID, p_known->id.productID) == key)
+        return p_known->type_infos;
+
+    return s_unknown_gamepad;
 }
 
-static int32_t internal_set_gamepad_vibration(gamepad_context_t* p_context, float left_strength, float right_strength)
+int32_t update_gamepad_state(uint32_t index)
 {
-    uint8_t buff[5] = {
-        0,
-        0,
-        static_cast<uint8_t>(left_strength * 255),
-        static_cast<uint8_t>(right_strength * 255),
-        2
-    };
+    if (index >= gamepad::max_connected_gamepads)
+        return gamepad::invalid_parameter;
+
+    return call_internal_action(index, &update_and_publish_gamepad_state, index);
+}
 
+int32_t update_all_gamepads(uint32_t* p_changed_mask)
+{
+    pending_connection_events_t pending;
     int32_t res;
-    if ((res = (DeviceOutIo(p_context, IOCTL_XINPUT_SET_GAMEPAD_STATE, buff, sizeof(buff)) == ERROR_SUCCESS ? gamepad::success : gamepad::failed)) != gamepad::success)
+
+    if (p_changed_mask == nullptr)
+        return gamepad::invalid_parameter;
+
     {
-        p_context->dead = 1;
+        std::lock_guard<gamepad_mutex_t> lk(s_gamepad_mutex);
+
+        res = internal_update_all_gamepads(p_changed_mask);
+
+        take_connection_events(pending);
     }
 
+    dispatch_connection_events(pending);
     return res;
 }
 
-static int32_t internal_set_gamepad_led(gamepad_context_t* p_context, uint8_t r, uint8_t g, uint8_t b)
+// Lock-free once the discovery runs. Returns false when empty slots must still be looked up with the lock held.
+static bool start_device_discovery()
 {
-    char buff[5] = {
-                    0,              // XInput User Index
-                    XINPUT_LED_OFF, // LED Status
-                    0,
-                    0,
-                    1 };
+    if (s_discovery_started.load(std::memory_order_acquire))
+        return true;
 
-    DeviceOutIo(p_context, IOCTL_XINPUT_SET_GAMEPAD_STATE, buff, sizeof(buff));
-
-    return gamepad::failed;
-}
+    pending_connection_events_t pending;
+    bool started;
 
-void internal_free_all_contexts()
-{
-    for (uint32_t i = 0; i < gamepad::max_connected_gamepads; ++i)
     {
-        internal_free_context(&s_gamepads[i]);
+        std::lock_guard<gamepad_mutex_t> lk(s_gamepad_mutex);
+
+        started = internal_start_discovery();
+
+        take_connection_events(pending);
     }
-}
 
-#elif defined(GAMEPAD_OS_LINUX)
+    dispatch_connection_events(pending);
 
-struct axis_t
+    if (started)
+        s_discovery_started.store(true, std::memory_order_release);
+
+    return started;
+}
+
+int32_t get_gamepad_state(uint32_t index, gamepad_state_t* p_gamepad_state)
 {
-    int axis_id;
-    float min;
-    float max;
-    float normalized_min;
-    float normalized_max;
-    float* mapped_value;
-};
+    if (index >= gamepad::max_connected_gamepads || p_gamepad_state == nullptr)
+        return gamepad::invalid_parameter;
 
-struct gamepad_context_t
+    // Connected gamepads are read from their published state, without any lock.
+    if (read_published_gamepad_state(index, p_gamepad_state))
+        return gamepad::success;
+
+    // Nothing connected there. Once the discovery runs, the published state is all there is to know.
+    if (start_device_discovery())
+        return gamepad::failed;
+
+    return call_internal_action(index, &internal_get_gamepad_state, p_gamepad_state);
+}
+
+int32_t get_all_gamepad_states(gamepad_states_soa_t const& states, uint32_t* p_connected_mask)
 {
-    int eventFd;
-    int ledFd;
-    char* devicePath;
+    gamepad_state_t state;
+    publish_snapshot_t snapshot;
+    bool consistent;
 
-    int8_t dead;
-    gamepad_id_t id;
+    if (states.buttons == nullptr || states.lx == nullptr || states.ly == nullptr || states.rx == nullptr ||
+        states.ry == nullptr || states.lt == nullptr || states.rt == nullptr || p_connected_mask == nullptr)
+    {
+        return gamepad::invalid_parameter;
+    }
 
-    std::vector<axis_t> axis;
+    // Lock-free like get_gamepad_state(), read again when anything got published meanwhile.
+    uint32_t slot_count;
+    do
+    {
+        consistent = begin_publish_snapshot(snapshot);
+        if (!consistent)
+            continue;
 
-    struct ff_effect rumbleEffect;
-    //struct ff_effect effects[NUM_EFFECTS];
+        // No slot sequence to check, nothing was published if the publish sequences didn't move.
+        // Disconnected slots are published as zeroes.
+        slot_count = s_slot_count.load(std::memory_order_acquire);
+        clear_gamepad_mask(p_connected_mask);
+        for (uint32_t i = 0; i < slot_count; ++i)
+        {
+            published_state_t const& published = get_published_state(i);
+            published_buffer_t const& buffer = published.buffers[published.latest.load(std::memory_order_relaxed)];
+            uint32_t words[sizeof(gamepad_state_t) / sizeof(uint32_t)];
+
+            for (size_t j = 0; j < sizeof(words) / sizeof(*words); ++j)
+                words[j] = buffer.words[j].load(std::memory_order_relaxed);
+
+            memcpy(&state, words, sizeof(state));
+            if (buffer.connected.load(std::memory_order_relaxed) != 0)
+                set_gamepad_mask_bit(p_connected_mask, i);
+
+            states.buttons[i] = state.buttons;
+            states.lx[i] = state.left_stick.x;
+            states.ly[i] = state.left_stick.y;
+            states.rx[i] = state.right_stick.x;
+            states.ry[i] = state.right_stick.y;
+            states.lt[i] = state.left_trigger;
+            states.rt[i] = state.right_trigger;
+        }
 
-    gamepad_state_t gamepadState;
-};
+        consistent = end_publish_snapshot(snapshot);
+    } while (!consistent);
 
-//static void get_available_effects(gamepad_context_t* p_context)
-//{
-//    if (p_context->eventFd != -1)
-//    {
-//        unsigned char ffFeatures[1 + FF_MAX / 8 / sizeof(unsigned char)] = { 0 };
-//        if (ioctl(p_context->eventFd, EVIOCGBIT(EV_FF, sizeof(ffFeatures) * sizeof(unsigned char)), ffFeatures) >= 0)
-//        {
-//        }
-//    }
-//}
+    // The slots past s_slot_count never had a gamepad, a column at a time.
+    const uint32_t tail_count = max_connected_gamepads - slot_count;
+    memset(states.buttons + slot_count, 0, tail_count * sizeof(*states.buttons));
+    for (float* column : { states.lx, states.ly, states.rx, states.ry, states.lt, states.rt })
+        memset(column + slot_count, 0, tail_count * sizeof(*column));
 
-static int32_t play_effect(gamepad_context_t* p_context, struct ff_effect* p_effect)
+    // Like get_gamepad_state(), the lock is only taken while there's nothing and the discovery needs it.
+    if (is_gamepad_mask_empty(p_connected_mask) && !start_device_discovery())
+        call_internal_action(0, &internal_get_gamepad_state, &state);
+
+    return gamepad::success;
+}
+
+int32_t get_gamepad_changes(uint32_t index, uint64_t last_seen_sequence, uint64_t* p_sequence, uint32_t* p_dirty_mask)
 {
-    if (p_effect->id == -1 || p_context->eventFd == -1)
-        return gamepad::failed;
+    if (index >= gamepad::max_connected_gamepads || p_sequence == nullptr || p_dirty_mask == nullptr)
+        return gamepad::invalid_parameter;
 
-    struct input_event play;
+    read_published_gamepad_changes(index, last_seen_sequence, p_sequence, p_dirty_mask);
+    return gamepad::success;
+}
 
-    play.type = EV_FF;
-    play.code = p_effect->id;
-    play.value = 1;
+int32_t get_gamepad_latency(uint32_t index, gamepad_latency_t* p_latency, bool reset)
+{
+    if (index >= gamepad::max_connected_gamepads || p_latency == nullptr)
+        return gamepad::invalid_parameter;
 
-    if (write(p_context->eventFd, (const void*)&play, sizeof(play)) == -1)
+    slot_chunk_t* p_chunk = get_slot_chunk(index);
+    if (p_chunk == nullptr)
     {
-        //std::cout << "Failed to play effect " << p_effect->id << std::endl;
-        return gamepad::failed;
+        memset(p_latency, 0, sizeof(*p_latency));
+        return gamepad::success;
     }
 
+    copy_latency_stats(p_chunk->latency_stats[index % slot_chunk_size].read, p_latency->read, reset);
+    copy_latency_stats(p_chunk->latency_stats[index % slot_chunk_size].visible, p_latency->visible, reset);
     return gamepad::success;
 }
 
-static void stop_effect(gamepad_context_t* p_context, struct ff_effect* p_effect)
+int32_t get_gamepad_stats(gamepad_stats_t* p_stats, bool reset)
 {
-    if (p_effect->id == -1 || p_context->eventFd == -1)
-        return;
+    if (p_stats == nullptr)
+        return gamepad::invalid_parameter;
 
-    struct input_event play;
-
-    play.type = EV_FF;
-    play.code = p_effect->id;
-    play.value = 0;
+#if defined(GAMEPAD_ENABLE_STATS)
+    for (uint32_t i = 0; i < static_cast<uint32_t>(stat_e::count); ++i)
+        p_stats->*s_stat_fields[i] = reset ? s_stats[i].exchange(0, std::memory_order_relaxed) : s_stats[i].load(std::memory_order_relaxed);
 
-    write(p_context->eventFd, (const void*)&play, sizeof(play));
-    //if (write(p_context->eventFd, (const void*)&play, sizeof(play)) < 0)
-    //{
-    //
-    //}
+    return gamepad::success;
+#else
+    (void)reset;
+    memset(p_stats, 0, sizeof(*p_stats));
+    return gamepad::failed;
+#endif
 }
 
-static int32_t register_effect(gamepad_context_t* p_context, struct ff_effect* p_effect)
+uint64_t get_latency_percentile(latency_histogram_t const& histogram, double percentile)
 {
-    if (p_context->eventFd == -1 || ioctl(p_context->eventFd, EVIOCSFF, p_effect) < 0)
+    if (histogram.count == 0)
+        return 0;
+
+    double target = histogram.count * std::min(std::max(percentile, 0.0), 100.0) / 100.0;
+    uint64_t rank = std::max<uint64_t>(static_cast<uint64_t>(target), 1);
+    if (static_cast<double>(rank) < target)
+        ++rank;
+
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < latency_bucket_count; ++i)
     {
-        p_effect->id = -1;
-        return gamepad::failed;
+        count += histogram.buckets[i];
+        if (count >= rank)
+            return std::min(get_latency_bucket_max(i), histogram.max_us);
     }
 
-    return gamepad::success;
+    return histogram.max_us;
 }
 
-static void unregister_effect(gamepad_context_t* p_context, struct ff_effect* p_effect)
+int32_t get_gamepad_id(uint32_t index, gamepad_id_t* p_gamepad_id)
 {
-    if (p_effect->id == -1 || p_context->eventFd == -1)
-        return;
+    if (index >= gamepad::max_connected_gamepads || p_gamepad_id == nullptr)
+        return gamepad::invalid_parameter;
 
-    stop_effect(p_context, p_effect);
+    return call_internal_action(index, &internal_get_gamepad_id, p_gamepad_id);
+}
 
-    //if (ioctl(p_context->eventFd, EVIOCRMFF, p_effect->id) < -1)
-    //{        
-    //}
-    ioctl(p_context->eventFd, EVIOCRMFF, p_effect->id);
-    p_effect->id = -1;
+///////////////////////////////////////////////////////////////////////////////
+// Haptics scheduler
+
+struct rumble_pattern_t
+{
+    bool active;
+    std::chrono::steady_clock::time_point start;
+    rumble_envelope_t envelope;
+    // Sample patterns when sample_rate_hz != 0, envelope otherwise.
+    std::vector<float> left_samples;
+    std::vector<float> right_samples;
+    uint32_t sample_rate_hz;
+    // Moves whenever the pattern is started or cancelled, a write computed for an older one is dropped.
+    uint32_t generation;
+    // Last strengths the scheduler sent for this pattern, -1 before the first one.
+    float last_strengths[2];
+};
+
+static int32_t write_scheduled_vibration(uint32_t index, float left_strength, float right_strength);
+
+// The scheduler calls the sink with s_gamepad_mutex held and s_haptics_mutex released, the sink is replaceable for tests.
+// Lock order: s_gamepad_mutex before s_haptics_mutex.
+static std::mutex s_haptics_mutex;
+static std::condition_variable s_haptics_cv;
+static std::thread s_haptics_thread;
+static bool s_haptics_exit = false;
+static rumble_pattern_t s_rumble_patterns[max_connected_gamepads];
+static int32_t (*s_haptics_sink)(uint32_t index, float left_strength, float right_strength) = &write_scheduled_vibration;
+
+// Must be called with s_gamepad_mutex held.
+static int32_t write_scheduled_vibration(uint32_t index, float left_strength, float right_strength)
+{
+    gamepad_context_t* p_context;
+    int32_t res;
+    if ((res = internal_get_gamepad(index, &p_context)) != gamepad::success)
+        return res;
+
+    std::unique_lock<std::mutex> reader_lk = internal_lock_reader(p_context);
+    return internal_write_gamepad_vibration(p_context, left_strength, right_strength);
 }
 
-static bool is_gamepad(const char* device_path)
+static inline float clamp_strength(float strength)
 {
-    bool res = false;
-    unsigned char evbit[1 + EV_CNT / 8 / sizeof(unsigned char)] = { 0 };
-    unsigned char keybit[1 + KEY_CNT / 8 / sizeof(unsigned char)] = { 0 };
-    unsigned char absbit[1 + ABS_CNT / 8 / sizeof(unsigned char)] = { 0 };
+    return strength < 0.0f ? 0.0f : (strength > 1.0f ? 1.0f : strength);
+}
 
-    int fd = open(device_path, O_RDONLY);
-    if (fd == -1)
+// Returns false once the pattern is over.
+static bool get_pattern_strengths(rumble_pattern_t const& pattern, uint64_t elapsed_ms, float& left_strength, float& right_strength)
+{
+    if (pattern.sample_rate_hz != 0)
+    {
+        uint64_t sample = elapsed_ms * pattern.sample_rate_hz / 1000;
+        if (sample >= pattern.left_samples.size())
+            return false;
+
+        left_strength = pattern.left_samples[sample];
+        right_strength = pattern.right_samples[sample];
+        return true;
+    }
+
+    rumble_envelope_t const& envelope = pattern.envelope;
+    float factor;
+
+    if (elapsed_ms < envelope.attack_ms)
+    {
+        factor = static_cast<float>(elapsed_ms) / envelope.attack_ms;
+    }
+    else if ((elapsed_ms -= envelope.attack_ms) < envelope.sustain_ms)
+    {
+        factor = 1.0f;
+    }
+    else if ((elapsed_ms -= envelope.sustain_ms) < envelope.decay_ms)
+    {
+        factor = 1.0f - static_cast<float>(elapsed_ms) / envelope.decay_ms;
+    }
+    else
+    {
         return false;
+    }
+
+    left_strength = envelope.left_strength * factor;
+    right_strength = envelope.right_strength * factor;
+    return true;
+}
+
+static void haptics_thread_proc()
+{
+    struct scheduled_write_t
+    {
+        uint32_t index;
+        uint32_t generation;
+        float left_strength;
+        float right_strength;
+    };
+
+    std::vector<scheduled_write_t> writes;
+    auto next_tick = std::chrono::steady_clock::now();
 
-    if (ioctl(fd, EVIOCGBIT(0, sizeof(evbit)), evbit) > 0 &&
-        ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keybit)), keybit) > 0 &&
-        ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(absbit)), absbit) > 0)
+    while (true)
     {
-        if (testBit(EV_KEY, evbit) &&
-            testBit(EV_ABS, evbit) &&
-            testBit(ABS_HAT0X, absbit))
         {
-            if (testBit(ABS_X, absbit)  && testBit(ABS_Y, absbit) &&
-                testBit(ABS_RX, absbit) && testBit(ABS_RY, absbit) &&
-                testBit(ABS_Z, absbit)  && testBit(ABS_RZ, absbit))
+            std::unique_lock<std::mutex> lk(s_haptics_mutex);
+
+            s_haptics_cv.wait_until(lk, next_tick, []() { return s_haptics_exit; });
+            s_haptics_cv.wait(lk, []()
             {
-                res = true;
-            }
-            else if (testBit(ABS_X, absbit)   && testBit(ABS_Y, absbit) &&
-                     testBit(ABS_Z, absbit)   && testBit(ABS_RZ, absbit) &&
-                     testBit(ABS_GAS, absbit) && testBit(ABS_BRAKE, absbit))
+                if (s_haptics_exit)
+                    return true;
+
+                for (auto const& pattern : s_rumble_patterns)
+                {
+                    if (pattern.active)
+                        return true;
+                }
+                return false;
+            });
+
+            if (s_haptics_exit)
+                break;
+
+            auto now = std::chrono::steady_clock::now();
+            next_tick = std::max(next_tick + std::chrono::milliseconds(haptics_tick_ms), now);
+
+            // One write per gamepad and per tick, only when its strengths changed.
+            writes.clear();
+            for (uint32_t i = 0; i < max_connected_gamepads; ++i)
             {
-                res = true;
+                rumble_pattern_t& pattern = s_rumble_patterns[i];
+                if (!pattern.active)
+                    continue;
+
+                float left_strength;
+                float right_strength;
+                uint64_t elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - pattern.start).count();
+                if (!get_pattern_strengths(pattern, elapsed_ms, left_strength, right_strength))
+                {
+                    pattern.active = false;
+                    left_strength = 0.0f;
+                    right_strength = 0.0f;
+                }
+
+                if (left_strength != pattern.last_strengths[0] || right_strength != pattern.last_strengths[1])
+                    writes.emplace_back(scheduled_write_t{ i, pattern.generation, left_strength, right_strength });
             }
         }
-    }
 
-    close(fd);
+        // Each write is checked and sent under s_gamepad_mutex, so a set_gamepad_vibration() or a new pattern
+        // since the tick is never overwritten by a stale value.
+        for (auto const& write : writes)
+        {
+            pending_connection_events_t pending;
 
-    return res;
+            {
+                std::lock_guard<gamepad_mutex_t> gamepad_lk(s_gamepad_mutex);
+
+                bool current;
+                {
+                    std::lock_guard<std::mutex> lk(s_haptics_mutex);
+                    rumble_pattern_t& pattern = s_rumble_patterns[write.index];
+                    current = pattern.generation == write.generation;
+                    if (current)
+                    {
+                        pattern.last_strengths[0] = write.left_strength;
+                        pattern.last_strengths[1] = write.right_strength;
+                    }
+                }
+
+                if (current)
+                    s_haptics_sink(write.index, write.left_strength, write.right_strength);
+
+                take_connection_events(pending);
+            }
+
+            dispatch_connection_events(pending);
+        }
+    }
 }
 
-static void get_axis_min_max(gamepad_context_t* p_context, int axis_id, bool invert_min_max, float default_min, float default_max, float& min, float& max)
+// Must be called with s_haptics_mutex held.
+static void start_rumble_pattern(rumble_pattern_t& pattern)
 {
-    struct input_absinfo absinfo;
-    if (ioctl(p_context->eventFd, EVIOCGABS(axis_id), &absinfo) < 0)
+    pattern.active = true;
+    pattern.start = std::chrono::steady_clock::now();
+    ++pattern.generation;
+    pattern.last_strengths[0] = pattern.last_strengths[1] = -1.0f;
+
+    if (!s_haptics_thread.joinable())
     {
-        // Failed to retrieve infos, device did not inform the OS of the ranges ?
-        // Set some default values
-        absinfo.minimum = default_min;
-        absinfo.maximum = default_max;
+        s_haptics_exit = false;
+        register_threads_cleanup();
+        s_haptics_thread = std::thread(haptics_thread_proc);
     }
 
-    if (invert_min_max)
+    s_haptics_cv.notify_one();
+}
+
+static void cancel_rumble_pattern(uint32_t index)
+{
+    std::lock_guard<std::mutex> lk(s_haptics_mutex);
+    s_rumble_patterns[index].active = false;
+    ++s_rumble_patterns[index].generation;
+}
+
+static void stop_haptics_thread()
+{
     {
-        min = absinfo.maximum;
-        max = absinfo.minimum;
+        std::lock_guard<std::mutex> lk(s_haptics_mutex);
+        if (!s_haptics_thread.joinable())
+            return;
+
+        s_haptics_exit = true;
+        for (auto& pattern : s_rumble_patterns)
+            pattern.active = false;
     }
-    else
+
+    s_haptics_cv.notify_one();
+    s_haptics_thread.join();
+}
+
+int32_t play_gamepad_rumble_envelope(uint32_t index, rumble_envelope_t const& envelope)
+{
+    if (index >= gamepad::max_connected_gamepads || envelope.left_strength < 0.0f || envelope.right_strength < 0.0f)
+        return gamepad::invalid_parameter;
+
+    std::lock_guard<std::mutex> lk(s_haptics_mutex);
+
+    rumble_pattern_t& pattern = s_rumble_patterns[index];
+    pattern.envelope = envelope;
+    pattern.envelope.left_strength = clamp_strength(envelope.left_strength);
+    pattern.envelope.right_strength = clamp_strength(envelope.right_strength);
+    pattern.sample_rate_hz = 0;
+    start_rumble_pattern(pattern);
+
+    return gamepad::success;
+}
+
+int32_t play_gamepad_rumble_samples(uint32_t index, float const* left_samples, float const* right_samples, uint32_t sample_count, uint32_t sample_rate_hz)
+{
+    if (index >= gamepad::max_connected_gamepads || left_samples == nullptr || right_samples == nullptr || sample_count == 0 || sample_rate_hz == 0)
+        return gamepad::invalid_parameter;
+
+    std::lock_guard<std::mutex> lk(s_haptics_mutex);
+
+    rumble_pattern_t& pattern = s_rumble_patterns[index];
+    pattern.left_samples.resize(sample_count);
+    pattern.right_samples.resize(sample_count);
+    for (uint32_t i = 0; i < sample_count; ++i)
     {
-        min = absinfo.minimum;
-        max = absinfo.maximum;
+        pattern.left_samples[i] = clamp_strength(left_samples[i]);
+        pattern.right_samples[i] = clamp_strength(right_samples[i]);
     }
+    pattern.sample_rate_hz = sample_rate_hz;
+    start_rumble_pattern(pattern);
+
+    return gamepad::success;
 }
 
-static int32_t get_gamepad_infos(gamepad_context_t* p_context)
+int32_t stop_gamepad_rumble_pattern(uint32_t index)
 {
-    struct input_id inpid;
-    unsigned char absbit[1 + ABS_CNT / 8 / sizeof(unsigned char)] = { 0 };
-    float axis_min, axis_max;
+    if (index >= gamepad::max_connected_gamepads)
+        return gamepad::invalid_parameter;
 
-    if (ioctl(p_context->eventFd, EVIOCGID, &inpid) < 0)
-        return gamepad::failed;
+    // Sent now, whatever got uploaded this frame.
+    cancel_rumble_pattern(index);
+    return call_internal_action(index, &internal_write_gamepad_vibration, 0.0f, 0.0f);
+}
 
-    if (ioctl(p_context->eventFd, EVIOCGBIT(EV_ABS, sizeof(absbit)), absbit) < 0)
-        return gamepad::failed;
+int32_t set_gamepad_vibration(uint32_t index, float left_strength, float right_strength)
+{
+    if (index >= gamepad::max_connected_gamepads || left_strength < 0.0f || right_strength < 0.0f)
+        return gamepad::invalid_parameter;
 
-    p_context->id.productID = inpid.product;
-    p_context->id.vendorID = inpid.vendor;
+    if (left_strength > 1.0f)
+        left_strength = 1.0f;
 
-    if (testBit(ABS_X, absbit)  && testBit(ABS_Y, absbit) &&
-        testBit(ABS_RX, absbit) && testBit(ABS_RY, absbit) &&
-        testBit(ABS_Z, absbit)  && testBit(ABS_RZ, absbit))
-    {// XUSB ABS_X, ABS_Y, ABS_RX, ABS_RY, ABS_Z, ABS_RZ mode
-        // This mode seems to be used when the gamepad is wired.
-        get_axis_min_max(p_context, ABS_X, false, -32768.0f, 32767.0f, axis_min, axis_max);
-        p_context->axis.emplace_back(axis_t{
-            ABS_X,
-            axis_min,
-            axis_max,
-            -1.0f,
-            1.0f,
-            &p_context->gamepadState.left_stick.x
-        });
+    if (right_strength > 1.0f)
+        right_strength = 1.0f;
 
-        get_axis_min_max(p_context, ABS_Y, true, -32768.0f, 32767.0f, axis_min, axis_max);
-        p_context->axis.emplace_back(axis_t{
-            ABS_Y,
-            axis_min,
-            axis_max,
-            -1.0f,
-            1.0f,
-            &p_context->gamepadState.left_stick.y
-        });
+    // Cancelled before the write, so the scheduler drops whatever it computed for the pattern.
+    cancel_rumble_pattern(index);
+    return call_internal_action(index, &internal_set_gamepad_vibration, left_strength, right_strength);
+}
 
-        get_axis_min_max(p_context, ABS_RX, false, -32768.0f, 32767.0f, axis_min, axis_max);
-        p_context->axis.emplace_back(axis_t{
-            ABS_RX,
-            axis_min,
-            axis_max,
-            -1.0f,
-            1.0f,
-            &p_context->gamepadState.right_stick.x
-        });
+int32_t set_gamepad_led(uint32_t index, uint8_t r, uint8_t g, uint8_t b)
+{
+    if (index >= gamepad::max_connected_gamepads)
+        return gamepad::invalid_parameter;
 
-        get_axis_min_max(p_context, ABS_RY, true, -32768.0f, 32767.0f, axis_min, axis_max);
-        p_context->axis.emplace_back(axis_t{
-            ABS_RY,
-            axis_min,
-            axis_max,
-            -1.0f,
-            1.0f,
-            &p_context->gamepadState.right_stick.y
-        });
+    return call_internal_action(index, &internal_set_gamepad_led, r, g, b);
+}
 
-        get_axis_min_max(p_context, ABS_Z, false, 0.0f, 1023.0f, axis_min, axis_max);
-        p_context->axis.emplace_back(axis_t{
-            ABS_Z,
-            axis_min,
-            axis_max,
-            0.0f,
-            1.0f,
-            &p_context->gamepadState.left_trigger
-        });
+int32_t get_gamepad_events(uint32_t index, gamepad_event_t* p_events, uint32_t max_events, uint32_t* p_event_count, uint32_t* p_dropped_count)
+{
+    if (index >= gamepad::max_connected_gamepads || (p_events == nullptr && max_events != 0) || p_event_count == nullptr)
+        return gamepad::invalid_parameter;
 
-        get_axis_min_max(p_context, ABS_RZ, false, 0.0f, 1023.0f, axis_min, axis_max);
-        p_context->axis.emplace_back(axis_t{
-            ABS_RZ,
-            axis_min,
-            axis_max,
-            0.0f,
-            1.0f,
-            &p_context->gamepadState.right_trigger
-        });
-    }
-    else if (testBit(ABS_X, absbit)   && testBit(ABS_Y, absbit) &&
-             testBit(ABS_Z, absbit)   && testBit(ABS_RZ, absbit) &&
-             testBit(ABS_GAS, absbit) && testBit(ABS_BRAKE, absbit))
-    {// XUSB ABS_X, ABS_Y, ABS_Z, ABS_RZ, ABS_GAS, ABS_BRAKE mode
-        // This mode seems to be used when the gamepad is wireless.
-        get_axis_min_max(p_context, ABS_X, false, 0.0f, 65535.0f, axis_min, axis_max);
-        p_context->axis.emplace_back(axis_t{
-            ABS_X,
-            axis_min,
-            axis_max,
-            -1.0f,
-            1.0f,
-            &p_context->gamepadState.left_stick.x
-        });
+    *p_event_count = 0;
+    return call_internal_action(index, &internal_get_gamepad_events, p_events, max_events, p_event_count, p_dropped_count);
+}
 
-        get_axis_min_max(p_context, ABS_Y, true, 0.0f, 65535.0f, axis_min, axis_max);
-        p_context->axis.emplace_back(axis_t{
-            ABS_Y,
-            axis_min,
-            axis_max,
-            -1.0f,
-            1.0f,
-            &p_context->gamepadState.left_stick.y
-        });
+int32_t start_gamepad_recording(uint32_t index, const char* path)
+{
+    if (index >= gamepad::max_connected_gamepads || path == nullptr)
+        return gamepad::invalid_parameter;
 
-        get_axis_min_max(p_context, ABS_Z, false, 0.0f, 65535.0f, axis_min, axis_max);
-        p_context->axis.emplace_back(axis_t{
-            ABS_Z,
-            axis_min,
-            axis_max,
+    return call_internal_action(index, &internal_start_gamepad_recording, path);
+}
+
+int32_t stop_gamepad_recording(uint32_t index)
+{
+    if (index >= gamepad::max_connected_gamepads)
+        return gamepad::invalid_parameter;
+
+    return call_internal_action(index, &internal_stop_gamepad_recording);
+}
+
+int32_t start_gamepad_replay(const char* path, replay_speed_e speed, uint32_t* p_index)
+{
+    if (path == nullptr || p_index == nullptr)
+        return gamepad::invalid_parameter;
+
+    return internal_start_gamepad_replay(path, speed, p_index);
+}
+
+int32_t stop_gamepad_replay(uint32_t index)
+{
+    if (index >= gamepad::max_connected_gamepads)
+        return gamepad::invalid_parameter;
+
+    return internal_stop_gamepad_replay(index);
+}
+
+int32_t set_gamepad_connection_callback(connection_callback_t callback, void* user_param)
+{
+    pending_connection_events_t pending;
+
+    {
+        std::lock_guard<gamepad_mutex_t> lk(s_gamepad_mutex);
+
+        s_connection_callback = nullptr;
+        s_connection_events.clear();
+
+        if (callback != nullptr)
+        {
+            gamepad_context_t* p_context;
+
+            // Report the gamepads that are already connected, this also starts the device discovery.
+            // The callback is still unset here so the discovery doesn't queue them a second time.
+            for (uint32_t i = 0; i < max_connected_gamepads; ++i)
+            {
+                if (internal_get_gamepad(i, &p_context) == gamepad::success)
+                    s_connection_events.emplace_back(connection_event_t{ i, true });
+            }
+            s_connection_callback = callback;
+            s_connection_callback_param = user_param;
+        }
+
+        take_connection_events(pending);
+    }
+
+    dispatch_connection_events(pending);
+    return gamepad::success;
+}
+
+int32_t start_gamepad_reader_thread()
+{
+    std::lock_guard<std::mutex> lk(s_reader_thread_mutex);
+    return internal_start_reader_thread();
+}
+
+int32_t start_gamepad_reader_threads(uint32_t thread_count, bool pin_threads)
+{
+    if (thread_count == 0 || thread_count > max_reader_threads)
+        return gamepad::invalid_parameter;
+
+    std::lock_guard<std::mutex> lk(s_reader_thread_mutex);
+    return internal_start_reader_threads(thread_count, pin_threads);
+}
+
+int32_t stop_gamepad_reader_thread()
+{
+    std::lock_guard<std::mutex> lk(s_reader_thread_mutex);
+    internal_stop_reader_thread();
+    return gamepad::success;
+}
+
+static void stop_all_threads()
+{
+    stop_haptics_thread();
+    stop_gamepad_reader_thread();
+    internal_stop_threads();
+}
+
+// free_gamepad_resources() is optional, but a std::thread must not be destroyed while joinable. The atexit handler
+// is registered after the static objects are built, so it runs before their destructors.
+static void register_threads_cleanup()
+{
+    static std::once_flag s_once;
+    std::call_once(s_once, []() { std::atexit(&stop_all_threads); });
+}
+
+void free_gamepad_resources()
+{
+    stop_all_threads();
+
+    std::lock_guard<gamepad_mutex_t> lock(s_gamepad_mutex);
+
+    internal_free_all_contexts();
+    s_connection_events.clear();
+    for (auto& p_context : s_released_contexts)
+        internal_free_context(&p_context);
+    s_released_contexts.clear();
+    s_discovery_started.store(false, std::memory_order_release);
+
+    for (uint32_t i = 0; i < max_connected_gamepads; ++i)
+        unpublish_gamepad_state(i);
+}
+
+#if defined(GAMEPAD_OS_WINDOWS)
+
+struct gamepad_context_t
+{
+    HANDLE       hDevice;
+    PWSTR        devicePath;
+
+    uint8_t      dead;
+    uint16_t     type;
+    gamepad_id_t id;
+
+    gamepad_state_t gamepadState;
+};
+
+static HRESULT DeviceIo(gamepad_context_t* context, DWORD ioControlCode, LPVOID inBuff, DWORD inBuffSize, LPVOID outBuff, DWORD outBuffSize, LPOVERLAPPED pOverlapped)
+{
+    HRESULT result;
+    int BytesReturned;
+    DWORD lpBytesReturned;
+
+    lpBytesReturned = 0;
+    BytesReturned = DeviceIoControl(context->hDevice, ioControlCode, inBuff, inBuffSize, outBuff, outBuffSize, &lpBytesReturned, pOverlapped);
+    if (BytesReturned)
+        return ERROR_SUCCESS;
+
+    if (GetLastError() == ERROR_IO_PENDING && pOverlapped)
+        result = E_PENDING;
+    else
+        result = E_FAIL;
+    return result;
+}
+
+static HRESULT DeviceInIo(gamepad_context_t* context, DWORD nioctl, void* buff, size_t buff_size)
+{
+    return DeviceIo(context, nioctl, nullptr, 0, buff, buff_size, nullptr);
+}
+
+static HRESULT DeviceOutIo(gamepad_context_t* context, DWORD nioctl, void* buff, size_t buff_size)
+{
+    return DeviceIo(context, nioctl, buff, buff_size, nullptr, 0, nullptr);
+}
+
+static HRESULT DeviceInOutIo(gamepad_context_t* context, DWORD nioctl, void* in_buff, size_t in_buff_size, void* out_buff, size_t out_buff_size)
+{
+    return DeviceIo(context, nioctl, in_buff, in_buff_size, out_buff, out_buff_size, nullptr);
+}
+
+static int32_t parse_buffer(gamepad_state_t* p_gamepad_state, GamepadState0100 &buff)
+{
+    if (buff.status != 1) // Gamepad is offline
+        return gamepad::failed;
+
+    p_gamepad_state->left_stick.x = rerange_value(-32768.0f, 32767.0f, -1.0f, 1.0f, buff.sThumbLX);
+    p_gamepad_state->left_stick.y = rerange_value(-32768.0f, 32767.0f, -1.0f, 1.0f, buff.sThumbLY);
+
+    p_gamepad_state->right_stick.x = rerange_value(-32768.0f, 32767.0f, -1.0f, 1.0f, buff.sThumbRX);
+    p_gamepad_state->right_stick.y = rerange_value(-32768.0f, 32767.0f, -1.0f, 1.0f, buff.sThumbRY);
+
+    p_gamepad_state->buttons = buff.wButtons;
+
+    p_gamepad_state->left_trigger = rerange_value(0.0f, 255.0f, 0.0f, 1.0f, buff.bLeftTrigger);
+    p_gamepad_state->right_trigger = rerange_value(0.0f, 255.0f, 0.0f, 1.0f, buff.bRightTrigger);
+
+    return gamepad::success;
+}
+
+static int32_t parse_buffer(gamepad_state_t* p_gamepad_state, GamepadState0101 &buff)
+{
+    if (buff.status != 1) // Gamepad is offline
+        return gamepad::failed;
+
+    p_gamepad_state->left_stick.x = rerange_value(-32768.0f, 32767.0f, -1.0f, 1.0f, buff.sThumbLX);
+    p_gamepad_state->left_stick.y = rerange_value(-32768.0f, 32767.0f, -1.0f, 1.0f, buff.sThumbLY);
+
+    p_gamepad_state->right_stick.x = rerange_value(-32768.0f, 32767.0f, -1.0f, 1.0f, buff.sThumbRX);
+    p_gamepad_state->right_stick.y = rerange_value(-32768.0f, 32767.0f, -1.0f, 1.0f, buff.sThumbRY);
+
+    p_gamepad_state->buttons = buff.wButtons;
+
+    if (buff.bExtraButtons & 0x01)
+        p_gamepad_state->buttons |= button_share;
+
+    p_gamepad_state->left_trigger = rerange_value(0.0f, 255.0f, 0.0f, 1.0f, buff.bLeftTrigger);
+    p_gamepad_state->right_trigger = rerange_value(0.0f, 255.0f, 0.0f, 1.0f, buff.bRightTrigger);
+
+    return gamepad::success;
+}
+
+static int32_t get_gamepad_infos(gamepad_context_t* p_context)
+{
+    WORD buffer[6] = { 0 };
+    bool success = (DeviceInIo(p_context, IOCTL_XINPUT_GET_INFORMATION, buffer, sizeof(buffer)) >= 0 ? true : false);
+    if (success)
+    {
+        if (!(buffer[2] & 0x80))
+        {
+            for (int i = 0; i < (buffer[1] & 0xFF); ++i)
+            {
+                //dwUserIndex = i;
+                p_context->type = buffer[0];
+                p_context->id.id = 0;
+                p_context->id.vendorID = buffer[4];
+                p_context->id.productID = buffer[5];
+
+                {// This part might not be needed
+                    char buff[5] = {
+                        0,              // XInput User Index
+                        XINPUT_LED_OFF, // LED Status
+                        0,
+                        0,
+                        1 };
+
+                    DeviceOutIo(p_context, IOCTL_XINPUT_SET_GAMEPAD_STATE, buff, sizeof(buff));
+                }
+            }
+        }
+    }
+    return success;
+}
+
+static void close_device(gamepad_context_t* p_context)
+{
+    if (p_context->hDevice != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(p_context->hDevice);
+        p_context->hDevice = INVALID_HANDLE_VALUE;
+    }
+}
+
+static int32_t internal_create_context(gamepad_context_t** pp_context, PWSTR device_path)
+{
+    *pp_context = (gamepad_context_t*)malloc(sizeof(gamepad_context_t));
+
+    if (*pp_context == nullptr)
+        return gamepad::failed;
+
+    (*pp_context)->hDevice = INVALID_HANDLE_VALUE;
+    (*pp_context)->dead = false;
+
+    memset(&(*pp_context)->gamepadState, 0, sizeof(gamepad_state_t));
+
+    (*pp_context)->devicePath = _wcsdup(device_path);
+    if ((*pp_context)->devicePath == nullptr)
+        return gamepad::failed;
+
+    (*pp_context)->hDevice = CreateFileW((*pp_context)->devicePath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if ((*pp_context)->hDevice == INVALID_HANDLE_VALUE)
+        return gamepad::failed;
+
+    if (!get_gamepad_infos(*pp_context))
+        return gamepad::failed;
+
+    return gamepad::success;
+}
+
+static void internal_free_context(gamepad_context_t** pp_context)
+{
+    if (*pp_context == nullptr)
+        return;
+
+    close_device(*pp_context);
+
+    if ((*pp_context)->devicePath != nullptr)
+    {
+        free((*pp_context)->devicePath);
+        (*pp_context)->devicePath = nullptr;
+    }
+
+    free(*pp_context);
+    *pp_context = nullptr;
+}
+
+static int32_t internal_get_gamepad(uint32_t index, gamepad_context_t** pp_context)
+{
+    HDEVINFO device_info_set;
+    SP_DEVICE_INTERFACE_DATA interface_data;
+    SP_DEVICE_INTERFACE_DETAIL_DATA_W* data;
+    DWORD detail_size = MAX_PATH * sizeof(WCHAR);
+    DWORD idx = 0;
+
+    if (s_gamepads[index] != nullptr && !s_gamepads[index]->dead)
+    {
+        *pp_context = s_gamepads[index];
+        return gamepad::success;
+    }
+    *pp_context = nullptr;
+
+    // Didn't find the gamepad, going to check for new ones
+    device_info_set = SetupDiGetClassDevsW(&XUSB_INTERFACE_CLASS_GUID, NULL, NULL, DIGCF_DEVICEINTERFACE | DIGCF_PRESENT);
+
+    data = (SP_DEVICE_INTERFACE_DETAIL_DATA_W*)HeapAlloc(GetProcessHeap(), 0, sizeof(*data) + detail_size);
+    if (data == nullptr)
+        return gamepad::failed;
+
+    data->cbSize = sizeof(*data);
+
+    ZeroMemory(&interface_data, sizeof(interface_data));
+    interface_data.cbSize = sizeof(interface_data);
+
+    while (SetupDiEnumDeviceInterfaces(device_info_set, NULL, &XUSB_INTERFACE_CLASS_GUID, idx++, &interface_data))
+    {
+        if (!SetupDiGetDeviceInterfaceDetailW(device_info_set,
+            &interface_data, data, sizeof(*data) + detail_size, NULL, NULL))
+            continue;
+
+        bool found = false;
+        int free_device = -1;
+        for (uint32_t i = 0; i < max_connected_gamepads; ++i)
+        {
+            if (s_gamepads[i] != nullptr)
+            {
+                if (!s_gamepads[i]->dead)
+                {
+                    if (wcscmp(s_gamepads[i]->devicePath, data->DevicePath) == 0)
+                    {
+                        found = true;
+                        break;
+                    }
+                    continue;
+                }
+                internal_free_context(&s_gamepads[i]);
+                unpublish_gamepad_state(i);
+                queue_connection_event(i, false);
+            }
+            if (free_device == -1)
+            {
+                free_device = i;
+            }
+        }
+
+        if (!found && free_device != -1)
+        {
+            if (internal_create_context(&s_gamepads[free_device], data->DevicePath) != gamepad::success)
+            {
+                internal_free_context(&s_gamepads[free_device]);
+            }
+            else
+            {
+                publish_gamepad_context(free_device, s_gamepads[free_device]);
+                queue_connection_event(free_device, true);
+            }
+        }
+    }
+    HeapFree(GetProcessHeap(), 0, data);
+    SetupDiDestroyDeviceInfoList(device_info_set);
+
+    if(s_gamepads[index] != nullptr && !s_gamepads[index]->dead)
+    {
+        *pp_context = s_gamepads[index];
+        return gamepad::success;
+    }
+
+    return gamepad::failed;
+}
+
+// XInput has no arrival notification, new gamepads are only found by the lookups of empty slots above.
+static bool internal_start_discovery()
+{
+    return false;
+}
+
+static int32_t internal_update_gamepad_state(gamepad_context_t* p_context)
+{
+    union
+    {
+        GamepadState0100 state0100;
+        GamepadState0101 state0101;
+    } out_buff;
+
+    union
+    {
+        InGamepadState0100 state0100;
+        InGamepadState0101 state0101;
+    } in_buff;
+
+    DWORD inBuffSize;
+    DWORD outBuffSize;
+    unsigned int res;
+
+    memset(&out_buff, 0, sizeof(out_buff));
+    memset(&in_buff, 0, sizeof(in_buff));
+
+    if (p_context->type == 256)
+    {
+        in_buff.state0100.DeviceIndex = 0;
+        inBuffSize = sizeof(in_buff.state0100);
+        outBuffSize = sizeof(out_buff.state0100);
+    }
+    else
+    {
+        in_buff.state0101.wType = 257;
+        in_buff.state0101.DeviceIndex= 0;
+        inBuffSize = sizeof(in_buff.state0101);
+        outBuffSize = sizeof(out_buff.state0101);
+    }
+
+    res = DeviceInOutIo(p_context, IOCTL_XINPUT_GET_GAMEPAD_STATE, &in_buff, inBuffSize, &out_buff, outBuffSize);
+    if (res < 0)
+    {
+        p_context->dead = 1;
+        return gamepad::failed;
+    }
+
+    if (p_context->type == 256)
+    {
+        res = parse_buffer(&p_context->gamepadState, out_buff.state0100);
+    }
+    else
+    {
+        res = parse_buffer(&p_context->gamepadState, out_buff.state0101);
+    }
+
+    if (res != gamepad::success)
+    {
+        p_context->dead = 1;
+    }
+
+    return res;
+}
+
+static int32_t internal_update_all_gamepads(uint32_t* p_changed_mask)
+{
+    gamepad_context_t* p_context;
+    gamepad_state_t old_state;
+
+    clear_gamepad_mask(p_changed_mask);
+
+    // XInput has no readiness notification, poll every gamepad.
+    for (uint32_t i = 0; i < max_connected_gamepads; ++i)
+    {
+        if (s_gamepads[i] == nullptr || s_gamepads[i]->dead)
+            continue;
+
+        p_context = s_gamepads[i];
+        memcpy(&old_state, &p_context->gamepadState, sizeof(gamepad_state_t));
+        if (internal_update_gamepad_state(p_context) != gamepad::success)
+        {
+            unpublish_gamepad_state(i);
+            set_gamepad_mask_bit(p_changed_mask, i);
+        }
+        else if (memcmp(&old_state, &p_context->gamepadState, sizeof(gamepad_state_t)) != 0)
+        {
+            publish_gamepad_context(i, p_context);
+            set_gamepad_mask_bit(p_changed_mask, i);
+        }
+    }
+
+    return gamepad::success;
+}
+
+static int32_t internal_get_gamepad_state(gamepad_context_t* p_context, gamepad_state_t* p_gamepad_state)
+{
+    memcpy(p_gamepad_state, &p_context->gamepadState, sizeof(gamepad_state_t));
+    return gamepad::success;
+}
+
+static int32_t internal_get_gamepad_id(gamepad_context_t* p_context, gamepad_id_t* p_gamepad_id)
+{
+    p_gamepad_id->id = p_context->id.id;
+    return gamepad::success;
+}
+
+static int32_t internal_set_gamepad_vibration(gamepad_context_t* p_context, float left_strength, float right_strength)
+{
+    uint8_t buff[5] = {
+        0,
+        0,
+        static_cast<uint8_t>(left_strength * 255),
+        static_cast<uint8_t>(right_strength * 255),
+        2
+    };
+
+    int32_t res;
+    if ((res = (DeviceOutIo(p_context, IOCTL_XINPUT_SET_GAMEPAD_STATE, buff, sizeof(buff)) == ERROR_SUCCESS ? gamepad::success : gamepad::failed)) != gamepad::success)
+    {
+        p_context->dead = 1;
+    }
+
+    return res;
+}
+
+static int32_t internal_set_gamepad_led(gamepad_context_t* p_context, uint8_t r, uint8_t g, uint8_t b)
+{
+    char buff[5] = {
+                    0,              // XInput User Index
+                    XINPUT_LED_OFF, // LED Status
+                    0,
+                    0,
+                    1 };
+
+    DeviceOutIo(p_context, IOCTL_XINPUT_SET_GAMEPAD_STATE, buff, sizeof(buff));
+
+    return gamepad::failed;
+}
+
+// Vibration is always sent right away here.
+static int32_t internal_write_gamepad_vibration(gamepad_context_t* p_context, float left_strength, float right_strength)
+{
+    return internal_set_gamepad_vibration(p_context, left_strength, right_strength);
+}
+
+// XInput only reports snapshots, there are no events to queue.
+static int32_t internal_get_gamepad_events(gamepad_context_t* p_context, gamepad_event_t* p_events, uint32_t max_events, uint32_t* p_event_count, uint32_t* p_dropped_count)
+{
+    return gamepad::failed;
+}
+
+// Recordings are made of evdev events.
+static int32_t internal_start_gamepad_recording(gamepad_context_t* p_context, const char* path)
+{
+    return gamepad::failed;
+}
+
+static int32_t internal_stop_gamepad_recording(gamepad_context_t* p_context)
+{
+    return gamepad::failed;
+}
+
+static int32_t internal_start_gamepad_replay(const char* path, replay_speed_e speed, uint32_t* p_index)
+{
+    return gamepad::failed;
+}
+
+static int32_t internal_stop_gamepad_replay(uint32_t index)
+{
+    return gamepad::failed;
+}
+
+void internal_free_all_contexts()
+{
+    for (uint32_t i = 0; i < gamepad::max_connected_gamepads; ++i)
+    {
+        internal_free_context(&s_gamepads[i]);
+    }
+}
+
+static void internal_stop_threads()
+{
+}
+
+// Input is read by the application thread, there's no reader thread on this platform.
+static int32_t internal_start_reader_thread()
+{
+    return gamepad::failed;
+}
+
+static int32_t internal_start_reader_threads(uint32_t, bool)
+{
+    return gamepad::failed;
+}
+
+static void internal_stop_reader_thread()
+{
+}
+
+static std::unique_lock<std::mutex> internal_lock_reader(gamepad_context_t*)
+{
+    return std::unique_lock<std::mutex>();
+}
+
+#elif defined(GAMEPAD_OS_LINUX)
+
+struct axis_t
+{
+    int axis_id;
+    float min;
+    float max;
+    float normalized_min;
+    float normalized_max;
+    float* mapped_value;
+};
+
+// What an EV_ABS code does to the state, looked up by code when decoding.
+struct abs_dispatch_t
+{
+    enum class kind_e : uint8_t
+    {
+        ignored,
+        axis,
+        hat_x,
+        hat_y,
+    };
+
+    kind_e kind;
+    gamepad_event_t::axis_e event_axis;
+    axis_t axis;
+    // value * scale + bias replaces rerange_value(), it is within 2^-23 of it (1 ulp at 1.0).
+    float scale;
+    float bias;
+    // Narrow ranges (triggers) use a table of the exact rerange_value() results, lut_size is 0 otherwise.
+    const float* lut;
+    int32_t lut_min;
+    uint32_t lut_size;
+};
+
+// Largest axis range that gets a lookup table.
+static constexpr uint32_t max_axis_lut_size = 1024;
+
+// What get_gamepad_infos needs from the device. Recordings store it, so a replay maps its events the same way.
+struct device_capabilities_t
+{
+    struct input_id id;
+    unsigned char absbit[1 + ABS_CNT / 8 / sizeof(unsigned char)];
+    // Codes the device reported a range for, the others get default ranges.
+    unsigned char absinfobit[1 + ABS_CNT / 8 / sizeof(unsigned char)];
+    struct input_absinfo absinfo[ABS_CNT];
+};
+
+// Recording file: this header, zero padded to header_size, then the raw input_event stream as it was read.
+struct recording_header_t
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    // sizeof(struct input_event), recordings only replay where it matches.
+    uint32_t event_size;
+    uint32_t reserved;
+    device_capabilities_t capabilities;
+};
+
+static constexpr char recording_magic[8] = { 'G', 'P', 'A', 'D', 'R', 'E', 'C', '\0' };
+static constexpr uint32_t recording_version = 1;
+// Keeps the events aligned in the mapped file.
+static constexpr uint32_t recording_header_size = (sizeof(recording_header_t) + alignof(struct input_event) - 1) & ~static_cast<uint32_t>(alignof(struct input_event) - 1);
+
+struct replay_t
+{
+    int fd;
+    replay_speed_e speed;
+    const unsigned char* data;
+    size_t mappedSize;
+    // Index of the next event to replay.
+    size_t nextEvent;
+    // real_time: the first replayed event is due at startTime.
+    bool started;
+    uint64_t firstEventUs;
+    std::chrono::steady_clock::time_point startTime;
+};
+
+// Events per read() of a device: one report of a gamepad fits the smallest buffer, motion sensors and
+// high polling rates make the backlog grow between two updates.
+constexpr size_t min_read_buffer_events = 32;
+constexpr size_t max_read_buffer_events = 1024;
+static_assert(max_read_buffer_events <= max_pending_reports, "A full read buffer must fit in the pending reports.");
+constexpr uint32_t read_buffer_shrink_updates = 256;
+
+constexpr uint32_t no_reader_shard = 0xffffffff;
+
+struct gamepad_context_t
+{
+    int eventFd;
+    int ledFd;
+    char* devicePath;
+
+    // Set by the reader thread owning the gamepad, without s_gamepad_mutex.
+    std::atomic<int8_t> dead;
+    // start_gamepad_reader_threads() shard reading it, no_reader_shard when the update functions do.
+    uint32_t readerShard;
+    gamepad_id_t id;
+    device_capabilities_t capabilities;
+
+    // -1 unless the events are recorded.
+    int recordFd;
+    // Set for a replayed recording, eventFd is -1 then.
+    replay_t* replay;
+
+    // Set by SYN_DROPPED: the events are ignored until the next SYN_REPORT reloads the state.
+    bool syncDropped;
+    // Events stamped on the monotonic clock, their latency can be measured.
+    bool monotonicClock;
+    // Histograms of the slot, nullptr when the latency is not measured.
+    gamepad_latency_stats_t* latency;
+    // When the events being decoded were read.
+    uint64_t readTimeUs;
+
+    // read() target, sized by adapt_read_buffer.
+    std::vector<struct input_event> readBuffer;
+    uint32_t readSmallUpdates;
+
+#if defined(GAMEPAD_USE_IO_URING)
+    // An io_uring read into readBuffer is in flight, the buffer must not move.
+    bool uringArmed;
+    // It completed with uringResult, not decoded yet.
+    bool uringReady;
+    int32_t uringResult;
+    // Detached with its read in flight, in s_uring_detached_contexts until the read completes.
+    bool uringDetached;
+#endif
+
+    std::vector<axis_t> axis;
+
+    // Built from the axis by get_gamepad_infos, indexed by event code.
+    uint32_t keyButtons[KEY_CNT];
+    abs_dispatch_t absDispatch[ABS_CNT];
+    std::vector<float> axisLuts;
+
+    struct ff_effect rumbleEffect;
+    //struct ff_effect effects[NUM_EFFECTS];
+    // Last requested magnitudes, uploaded at most once per frame (see internal_set_gamepad_vibration).
+    uint16_t rumbleStrong;
+    uint16_t rumbleWeak;
+    bool rumblePending;
+    bool rumbleWrittenThisFrame;
+
+    gamepad_state_t gamepadState;
+    gamepad_event_queue_t eventQueue;
+};
+
+// GAMEPAD_DEVFS_ROOT and GAMEPAD_SYSFS_ROOT can point the enumeration to another tree (tests, benchmarks).
+static char s_devfs_root[PATH_MAX] = "/dev/input";
+static char s_sysfs_root[PATH_MAX] = "/sys/class/input";
+// Nodes that are not gamepads, keyed by (dev_t, inode) so a new node reusing the same name is probed again.
+static std::set<std::pair<dev_t, ino_t>> s_rejected_devices;
+// Slot of every attached device by node path (s_gamepad_mutex held), the hotplug events only carry the path.
+// Replays are not in it.
+static std::unordered_map<std::string, uint32_t> s_device_slots;
+
+static std::thread s_hotplug_thread;
+static int s_hotplug_wakeup_fd = -1;
+// Every opened gamepad eventFd, data.u32 is the gamepad slot.
+static int s_epoll_fd = -1;
+
+static std::thread s_reader_thread;
+static int s_reader_wakeup_fd = -1;
+// Read and written with s_gamepad_mutex held. There are no frames with the reader thread(s), rumble is uploaded right away.
+static bool s_reader_thread_running = false;
+
+// One per thread of start_gamepad_reader_threads(). The gamepads of its slots are in its epoll set rather than in
+// s_epoll_fd, its thread decodes and publishes them with only the shard mutex held. Anything else touching their
+// input takes s_gamepad_mutex, then the shard mutex.
+struct reader_shard_t
+{
+    std::mutex mutex;
+    int epollFd;
+    int wakeupFd;
+    std::thread thread;
+    // Guarded by mutex. Entry N is the gamepad of slot N * shard count + shard index.
+    std::vector<gamepad_context_t*> gamepads;
+};
+
+// Guarded by s_gamepad_mutex, only resized while none of the threads runs.
+static std::vector<std::unique_ptr<reader_shard_t>> s_reader_shards;
+
+#if defined(GAMEPAD_USE_IO_URING)
+// With io_uring, every gamepad keeps a read in flight and an update collects the completions and submits the
+// new reads in a single io_uring_enter, instead of an epoll_wait and a read() per gamepad. The ring is created
+// with the hotplug monitor, the epoll path is used when the kernel refuses it (or GAMEPAD_DISABLE_IO_URING is set).
+// evdev doesn't support non blocking io_uring reads, they would complete with -EAGAIN right away: every read is
+// linked behind a poll of the device, it only starts once there is something to read.
+// Guarded by s_gamepad_mutex.
+struct uring_t
+{
+    int fd;
+    // Set when the ring could not be created, the epoll path is used until the resources are freed.
+    bool unavailable;
+    unsigned toSubmit;
+
+    void* ringMemory;
+    size_t ringSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+};
+
+static uring_t s_uring = { -1, false, 0, MAP_FAILED, 0, nullptr, 0, nullptr, nullptr, 0, 0, nullptr, nullptr, 0, nullptr };
+// Guarded by s_gamepad_mutex. Gone gamepads whose read is being cancelled, the kernel may still write into them.
+static std::vector<gamepad_context_t*> s_uring_detached_contexts;
+
+// user_data of the cancel requests, the reads carry their context and the polls their context | uring_poll_tag.
+constexpr uint64_t uring_cancel_tag = 0;
+constexpr uint64_t uring_poll_tag = 1;
+
+static void uring_close()
+{
+    if (s_uring.sqes != nullptr)
+        munmap(s_uring.sqes, s_uring.sqesSize);
+
+    if (s_uring.ringMemory != MAP_FAILED)
+        munmap(s_uring.ringMemory, s_uring.ringSize);
+
+    if (s_uring.fd != -1)
+        close(s_uring.fd);
+
+    s_uring = uring_t{ -1, false, 0, MAP_FAILED, 0, nullptr, 0, nullptr, nullptr, 0, 0, nullptr, nullptr, 0, nullptr };
+}
+
+static bool uring_supports_read(int fd)
+{
+    unsigned char buffer[sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op)] = { 0 };
+    struct io_uring_probe* probe = reinterpret_cast<struct io_uring_probe*>(buffer);
+
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+        return false;
+
+    return IORING_OP_READ <= probe->last_op && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+        (probe->ops[IORING_OP_POLL_ADD].flags & IO_URING_OP_SUPPORTED) &&
+        (probe->ops[IORING_OP_ASYNC_CANCEL].flags & IO_URING_OP_SUPPORTED);
+}
+
+// Must be called with s_gamepad_mutex held.
+static void uring_setup()
+{
+    if (s_uring.fd != -1 || s_uring.unavailable)
+        return;
+
+    s_uring.unavailable = true;
+    if (getenv("GAMEPAD_DISABLE_IO_URING") != nullptr)
+        return;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // One read per gamepad and the cancels of the ones going away.
+    int fd = static_cast<int>(syscall(__NR_io_uring_setup, 4 * max_connected_gamepads, &params));
+    if (fd == -1)
+        return;
+
+    s_uring.fd = fd;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !uring_supports_read(fd))
+    {
+        uring_close();
+        s_uring.unavailable = true;
+        return;
+    }
+
+    s_uring.ringSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned), params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    s_uring.ringMemory = mmap(nullptr, s_uring.ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    s_uring.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(nullptr, s_uring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    s_uring.sqes = sqes != MAP_FAILED ? static_cast<struct io_uring_sqe*>(sqes) : nullptr;
+    if (s_uring.ringMemory == MAP_FAILED || s_uring.sqes == nullptr)
+    {
+        uring_close();
+        s_uring.unavailable = true;
+        return;
+    }
+
+    unsigned char* ring = static_cast<unsigned char*>(s_uring.ringMemory);
+    s_uring.sqHead = reinterpret_cast<unsigned*>(ring + params.sq_off.head);
+    s_uring.sqTail = reinterpret_cast<unsigned*>(ring + params.sq_off.tail);
+    s_uring.sqMask = *reinterpret_cast<unsigned*>(ring + params.sq_off.ring_mask);
+    s_uring.sqEntries = params.sq_entries;
+    s_uring.cqHead = reinterpret_cast<unsigned*>(ring + params.cq_off.head);
+    s_uring.cqTail = reinterpret_cast<unsigned*>(ring + params.cq_off.tail);
+    s_uring.cqMask = *reinterpret_cast<unsigned*>(ring + params.cq_off.ring_mask);
+    s_uring.cqes = reinterpret_cast<struct io_uring_cqe*>(ring + params.cq_off.cqes);
+
+    // Every slot of the submission ring points to the sqe of the same index.
+    unsigned* sq_array = reinterpret_cast<unsigned*>(ring + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; ++i)
+        sq_array[i] = i;
+
+    s_uring.unavailable = false;
+}
+
+// Submits the queued requests and waits for min_complete completions.
+static int uring_enter(unsigned min_complete)
+{
+    GAMEPAD_STAT_ADD(uring_enters, 1);
+    int submitted = static_cast<int>(syscall(__NR_io_uring_enter, s_uring.fd, s_uring.toSubmit, min_complete, IORING_ENTER_GETEVENTS, nullptr, 0));
+    if (submitted > 0)
+        s_uring.toSubmit -= static_cast<unsigned>(submitted);
+
+    return submitted;
+}
+
+// Returns the next sqe when there is room for count of them, a linked chain must be queued whole.
+static struct io_uring_sqe* uring_get_sqe(unsigned count = 1)
+{
+    unsigned tail = *s_uring.sqTail;
+    if (tail + count - __atomic_load_n(s_uring.sqHead, __ATOMIC_ACQUIRE) > s_uring.sqEntries)
+    {// Full, the kernel takes the queued ones first.
+        uring_enter(0);
+        if (tail + count - __atomic_load_n(s_uring.sqHead, __ATOMIC_ACQUIRE) > s_uring.sqEntries)
+            return nullptr;
+    }
+
+    struct io_uring_sqe* sqe = &s_uring.sqes[tail & s_uring.sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void uring_queue_sqe()
+{
+    __atomic_store_n(s_uring.sqTail, *s_uring.sqTail + 1, __ATOMIC_RELEASE);
+    ++s_uring.toSubmit;
+}
+
+// Hands the completions to their context, they are decoded by the next update of the gamepad.
+static void uring_reap()
+{
+    unsigned head = *s_uring.cqHead;
+    unsigned tail = __atomic_load_n(s_uring.cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head)
+    {
+        struct io_uring_cqe const& cqe = s_uring.cqes[head & s_uring.cqMask];
+        // The read linked to the poll completes as well, even when the poll failed.
+        if (cqe.user_data == uring_cancel_tag || (cqe.user_data & uring_poll_tag) != 0)
+            continue;
+
+        GAMEPAD_STAT_ADD(uring_completions, 1);
+
+        gamepad_context_t* p_context = reinterpret_cast<gamepad_context_t*>(static_cast<uintptr_t>(cqe.user_data));
+        p_context->uringArmed = false;
+        p_context->uringReady = true;
+        p_context->uringResult = cqe.res;
+
+        // The kernel is done with it, freed once s_gamepad_mutex is released.
+        if (p_context->uringDetached)
+        {
+            s_uring_detached_contexts.erase(std::find(s_uring_detached_contexts.begin(), s_uring_detached_contexts.end(), p_context));
+            s_released_contexts.emplace_back(p_context);
+        }
+    }
+    __atomic_store_n(s_uring.cqHead, head, __ATOMIC_RELEASE);
+}
+
+// Queues a read of the device into its buffer, submitted by the next uring_enter.
+static void uring_arm_read(gamepad_context_t* p_context)
+{
+    if (p_context->uringArmed || p_context->uringReady || p_context->dead || p_context->eventFd == -1)
+        return;
+
+    struct io_uring_sqe* sqe = uring_get_sqe(2);
+    if (sqe == nullptr)
+        return;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = p_context->eventFd;
+    sqe->poll_events = POLLIN;
+    sqe->user_data = reinterpret_cast<uintptr_t>(p_context) | uring_poll_tag;
+    uring_queue_sqe();
+
+    sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = p_context->eventFd;
+    sqe->addr = reinterpret_cast<uintptr_t>(p_context->readBuffer.data());
+    sqe->len = static_cast<uint32_t>(p_context->readBuffer.size() * sizeof(struct input_event));
+    // Current file position, devices have none.
+    sqe->off = static_cast<uint64_t>(-1);
+    sqe->user_data = reinterpret_cast<uintptr_t>(p_context);
+    uring_queue_sqe();
+    p_context->uringArmed = true;
+}
+
+// Cancels the poll and the read linked to it, false when the submission ring has no room for them.
+static bool uring_queue_cancel(gamepad_context_t* p_context)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(2);
+    if (sqe == nullptr)
+        return false;
+
+    for (uint64_t target : { reinterpret_cast<uintptr_t>(p_context) | uring_poll_tag, uint64_t(reinterpret_cast<uintptr_t>(p_context)) })
+    {
+        sqe = uring_get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = target;
+        sqe->user_data = uring_cancel_tag;
+        uring_queue_sqe();
+    }
+    return true;
+}
+
+// Must be called with s_gamepad_mutex held, before the context is freed: waits until its read is gone.
+static void uring_cancel_read(gamepad_context_t* p_context)
+{
+    if (s_uring.fd == -1 || !p_context->uringArmed)
+        return;
+
+    // Only wait with the cancel queued, the read of an idle gamepad would never complete by itself.
+    bool cancel_queued = false;
+    while (p_context->uringArmed)
+    {
+        if (!cancel_queued)
+            cancel_queued = uring_queue_cancel(p_context);
+
+        if (uring_enter(cancel_queued ? 1 : 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            break;
+
+        uring_reap();
+    }
+    p_context->uringReady = false;
+}
+
+// Must be called with s_gamepad_mutex held, when the gamepad goes away. Returns false when its read is still in
+// flight: the cancel is submitted without waiting, and the update reaping its completion releases the context.
+static bool uring_detach_context(gamepad_context_t* p_context)
+{
+    if (s_uring.fd == -1 || !p_context->uringArmed)
+        return true;
+
+    if (!uring_queue_cancel(p_context))
+    {// No room in the submission ring, unlikely as every update submits it whole.
+        uring_cancel_read(p_context);
+        return true;
+    }
+
+    p_context->uringDetached = true;
+    s_uring_detached_contexts.emplace_back(p_context);
+    uring_enter(0);
+    return false;
+}
+#endif
+
+//static void get_available_effects(gamepad_context_t* p_context)
+//{
+//    if (p_context->eventFd != -1)
+//    {
+//        unsigned char ffFeatures[1 + FF_MAX / 8 / sizeof(unsigned char)] = { 0 };
+//        if (ioctl(p_context->eventFd, EVIOCGBIT(EV_FF, sizeof(ffFeatures) * sizeof(unsigned char)), ffFeatures) >= 0)
+//        {
+//        }
+//    }
+//}
+
+static int32_t play_effect(gamepad_context_t* p_context, struct ff_effect* p_effect)
+{
+    if (p_effect->id == -1 || p_context->eventFd == -1)
+        return gamepad::failed;
+
+    struct input_event play;
+
+    play.type = EV_FF;
+    play.code = p_effect->id;
+    play.value = 1;
+
+    GAMEPAD_STAT_ADD(ff_writes, 1);
+    if (write(p_context->eventFd, (const void*)&play, sizeof(play)) == -1)
+    {
+        //std::cout << "Failed to play effect " << p_effect->id << std::endl;
+        GAMEPAD_STAT_ADD(ff_errors, 1);
+        return gamepad::failed;
+    }
+
+    return gamepad::success;
+}
+
+static void stop_effect(gamepad_context_t* p_context, struct ff_effect* p_effect)
+{
+    if (p_effect->id == -1 || p_context->eventFd == -1)
+        return;
+
+    struct input_event play;
+
+    play.type = EV_FF;
+    play.code = p_effect->id;
+    play.value = 0;
+
+    GAMEPAD_STAT_ADD(ff_writes, 1);
+    write(p_context->eventFd, (const void*)&play, sizeof(play));
+    //if (write(p_context->eventFd, (const void*)&play, sizeof(play)) < 0)
+    //{
+    //
+    //}
+}
+
+static int32_t register_effect(gamepad_context_t* p_context, struct ff_effect* p_effect)
+{
+    if (p_context->eventFd == -1)
+    {
+        p_effect->id = -1;
+        return gamepad::failed;
+    }
+
+    GAMEPAD_STAT_ADD(ff_uploads, 1);
+    if (ioctl(p_context->eventFd, EVIOCSFF, p_effect) < 0)
+    {
+        GAMEPAD_STAT_ADD(ff_errors, 1);
+        p_effect->id = -1;
+        return gamepad::failed;
+    }
+
+    return gamepad::success;
+}
+
+static void unregister_effect(gamepad_context_t* p_context, struct ff_effect* p_effect)
+{
+    if (p_effect->id == -1 || p_context->eventFd == -1)
+        return;
+
+    stop_effect(p_context, p_effect);
+
+    //if (ioctl(p_context->eventFd, EVIOCRMFF, p_effect->id) < -1)
+    //{        
+    //}
+    ioctl(p_context->eventFd, EVIOCRMFF, p_effect->id);
+    p_effect->id = -1;
+}
+
+static bool has_gamepad_layout(unsigned char const* evbit, unsigned char const* absbit)
+{
+    if (!testBit(EV_KEY, evbit) || !testBit(EV_ABS, evbit) || !testBit(ABS_HAT0X, absbit))
+        return false;
+
+    if (testBit(ABS_X, absbit)  && testBit(ABS_Y, absbit) &&
+        testBit(ABS_RX, absbit) && testBit(ABS_RY, absbit) &&
+        testBit(ABS_Z, absbit)  && testBit(ABS_RZ, absbit))
+    {
+        return true;
+    }
+
+    return testBit(ABS_X, absbit)   && testBit(ABS_Y, absbit) &&
+           testBit(ABS_Z, absbit)   && testBit(ABS_RZ, absbit) &&
+           testBit(ABS_GAS, absbit) && testBit(ABS_BRAKE, absbit);
+}
+
+// sysfs capabilities are hexadecimal longs separated by spaces, the most significant one first.
+static bool read_sysfs_bitmap(const char* path, unsigned char* bits, size_t bits_size)
+{
+    char buffer[512];
+    unsigned long words[16];
+    size_t word_count = 0;
+    ssize_t len;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    len = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (len <= 0)
+        return false;
+
+    buffer[len] = '\0';
+
+    for (char* it = buffer; *it != '\0' && word_count < (sizeof(words) / sizeof(*words));)
+    {
+        char* end;
+        unsigned long word = strtoul(it, &end, 16);
+        if (end == it)
+            break;
+
+        words[word_count++] = word;
+        it = end;
+    }
+
+    if (word_count == 0)
+        return false;
+
+    memset(bits, 0, bits_size);
+    for (size_t i = 0; i < word_count; ++i)
+    {
+        unsigned long word = words[word_count - i - 1];
+        for (size_t j = 0; j < sizeof(word) && i * sizeof(word) + j < bits_size; ++j)
+            bits[i * sizeof(word) + j] = static_cast<unsigned char>(word >> (j * 8));
+    }
+
+    return true;
+}
+
+static bool is_gamepad(const char* device_path)
+{
+    bool res = false;
+    unsigned char evbit[1 + EV_CNT / 8 / sizeof(unsigned char)] = { 0 };
+    unsigned char keybit[1 + KEY_CNT / 8 / sizeof(unsigned char)] = { 0 };
+    unsigned char absbit[1 + ABS_CNT / 8 / sizeof(unsigned char)] = { 0 };
+    char sysfs_path[sizeof(s_sysfs_root) + NAME_MAX + 32];
+    const char* device_name = strrchr(device_path, '/') + 1;
+    struct stat device_stat;
+
+    if (stat(device_path, &device_stat) == -1)
+        return false;
+
+    auto device_key = std::make_pair(device_stat.st_rdev, device_stat.st_ino);
+    if (s_rejected_devices.count(device_key) != 0)
+        return false;
+
+    // Reading the capabilities from sysfs is way cheaper than opening the device.
+    snprintf(sysfs_path, sizeof(sysfs_path), "%s/%s/device/capabilities/ev", s_sysfs_root, device_name);
+    if (read_sysfs_bitmap(sysfs_path, evbit, sizeof(evbit)))
+    {// Keyboards, mice and switches usually don't report EV_ABS, no need to read their axis.
+        snprintf(sysfs_path, sizeof(sysfs_path), "%s/%s/device/capabilities/abs", s_sysfs_root, device_name);
+        if (testBit(EV_KEY, evbit) && testBit(EV_ABS, evbit) && read_sysfs_bitmap(sysfs_path, absbit, sizeof(absbit)))
+            res = has_gamepad_layout(evbit, absbit);
+    }
+    else
+    {// No sysfs, ask the device.
+        int fd = open(device_path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)// The acls might not be set yet, don't remember this one.
+            return false;
+
+        if (ioctl(fd, EVIOCGBIT(0, sizeof(evbit)), evbit) > 0 &&
+            ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keybit)), keybit) > 0 &&
+            ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(absbit)), absbit) > 0)
+        {
+            res = has_gamepad_layout(evbit, absbit);
+        }
+
+        close(fd);
+    }
+
+    if (!res)
+        s_rejected_devices.insert(device_key);
+
+    return res;
+}
+
+static int32_t probe_device_capabilities(int fd, device_capabilities_t& capabilities)
+{
+    memset(&capabilities, 0, sizeof(capabilities));
+
+    if (ioctl(fd, EVIOCGID, &capabilities.id) < 0)
+        return gamepad::failed;
+
+    if (ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(capabilities.absbit)), capabilities.absbit) < 0)
+        return gamepad::failed;
+
+    for (int axis_id = 0; axis_id < ABS_CNT; ++axis_id)
+    {
+        if (testBit(axis_id, capabilities.absbit) && ioctl(fd, EVIOCGABS(axis_id), &capabilities.absinfo[axis_id]) >= 0)
+            capabilities.absinfobit[ucharIndexForBit(axis_id)] |= ucharValueForBit(axis_id);
+    }
+
+    return gamepad::success;
+}
+
+static void get_axis_min_max(gamepad_context_t* p_context, int axis_id, bool invert_min_max, float default_min, float default_max, float& min, float& max)
+{
+    struct input_absinfo absinfo = p_context->capabilities.absinfo[axis_id];
+    if (!testBit(axis_id, p_context->capabilities.absinfobit))
+    {
+        // Failed to retrieve infos, device did not inform the OS of the ranges ?
+        // Set some default values
+        absinfo.minimum = default_min;
+        absinfo.maximum = default_max;
+    }
+
+    if (invert_min_max)
+    {
+        min = absinfo.maximum;
+        max = absinfo.minimum;
+    }
+    else
+    {
+        min = absinfo.minimum;
+        max = absinfo.maximum;
+    }
+}
+
+static_assert(offsetof(gamepad_state_t, left_stick.y)   - offsetof(gamepad_state_t, left_stick.x) == sizeof(float) * static_cast<int>(gamepad_event_t::axis_e::left_stick_y) &&
+              offsetof(gamepad_state_t, right_trigger) - offsetof(gamepad_state_t, left_stick.x) == sizeof(float) * static_cast<int>(gamepad_event_t::axis_e::right_trigger),
+              "gamepad_event_t::axis_e must follow the gamepad_state_t axes order.");
+
+static void build_dispatch_tables(gamepad_context_t* p_context)
+{
+    static const struct
+    {
+        uint16_t code;
+        uint32_t button;
+    } key_buttons[] = {
+        { BTN_A     , gamepad::button_a              },
+        { BTN_B     , gamepad::button_b              },
+        { BTN_X     , gamepad::button_x              },
+        { BTN_Y     , gamepad::button_y              },
+        { BTN_TL    , gamepad::button_left_shoulder  },
+        { BTN_TR    , gamepad::button_right_shoulder },
+        { BTN_SELECT, gamepad::button_back           },
+        { BTN_START , gamepad::button_start          },
+        { BTN_THUMBL, gamepad::button_left_thumb     },
+        { BTN_THUMBR, gamepad::button_right_thumb    },
+        { BTN_MODE  , gamepad::button_guide          },
+        { KEY_RECORD, gamepad::button_share          },
+        //{ BTN_TRIGGER_HAPPY5, gamepad::button_paddle1 },
+        //{ BTN_TRIGGER_HAPPY6, gamepad::button_paddle2 },
+        //{ BTN_TRIGGER_HAPPY7, gamepad::button_paddle3 },
+        //{ BTN_TRIGGER_HAPPY8, gamepad::button_paddle4 },
+    };
+
+    memset(p_context->keyButtons, 0, sizeof(p_context->keyButtons));
+    for (auto const& key_button : key_buttons)
+        p_context->keyButtons[key_button.code] = key_button.button;
+
+    for (auto& entry : p_context->absDispatch)
+        entry.kind = abs_dispatch_t::kind_e::ignored;
+
+    p_context->absDispatch[ABS_HAT0X].kind = abs_dispatch_t::kind_e::hat_x;
+    p_context->absDispatch[ABS_HAT0Y].kind = abs_dispatch_t::kind_e::hat_y;
+
+    // Reserve every table first, the entries point into axisLuts.
+    size_t lut_total_size = 0;
+    for (auto const& axis : p_context->axis)
+    {
+        float range = fabsf(axis.max - axis.min) + 1.0f;
+        if (range <= max_axis_lut_size)
+            lut_total_size += static_cast<size_t>(range);
+    }
+    p_context->axisLuts.clear();
+    p_context->axisLuts.reserve(lut_total_size);
+
+    for (auto const& axis : p_context->axis)
+    {
+        abs_dispatch_t& entry = p_context->absDispatch[axis.axis_id];
+        entry.kind = abs_dispatch_t::kind_e::axis;
+        entry.event_axis = static_cast<gamepad_event_t::axis_e>(axis.mapped_value - &p_context->gamepadState.left_stick.x);
+        entry.axis = axis;
+
+        entry.scale = (axis.normalized_max - axis.normalized_min) / (axis.max - axis.min);
+        entry.bias = axis.normalized_min - axis.min * entry.scale;
+
+        entry.lut = nullptr;
+        entry.lut_min = static_cast<int32_t>(std::min(axis.min, axis.max));
+        entry.lut_size = 0;
+
+        float range = fabsf(axis.max - axis.min) + 1.0f;
+        if (range <= max_axis_lut_size)
+        {
+            entry.lut_size = static_cast<uint32_t>(range);
+            entry.lut = p_context->axisLuts.data() + p_context->axisLuts.size();
+            for (uint32_t i = 0; i < entry.lut_size; ++i)
+                p_context->axisLuts.emplace_back(rerange_value(axis.min, axis.max, axis.normalized_min, axis.normalized_max, static_cast<float>(entry.lut_min + static_cast<int32_t>(i))));
+        }
+    }
+}
+
+static inline float transform_axis_value(abs_dispatch_t const& entry, int32_t value)
+{
+    uint32_t lut_index = static_cast<uint32_t>(value) - static_cast<uint32_t>(entry.lut_min);
+    if (lut_index < entry.lut_size)
+        return entry.lut[lut_index];
+
+    return value * entry.scale + entry.bias;
+}
+
+// Builds the axis from p_context->capabilities, probed from the device or read from a recording.
+static int32_t get_gamepad_infos(gamepad_context_t* p_context)
+{
+    const unsigned char* absbit = p_context->capabilities.absbit;
+    float axis_min, axis_max;
+
+    p_context->id.productID = p_context->capabilities.id.product;
+    p_context->id.vendorID = p_context->capabilities.id.vendor;
+
+    if (testBit(ABS_X, absbit)  && testBit(ABS_Y, absbit) &&
+        testBit(ABS_RX, absbit) && testBit(ABS_RY, absbit) &&
+        testBit(ABS_Z, absbit)  && testBit(ABS_RZ, absbit))
+    {// XUSB ABS_X, ABS_Y, ABS_RX, ABS_RY, ABS_Z, ABS_RZ mode
+        // This mode seems to be used when the gamepad is wired.
+        get_axis_min_max(p_context, ABS_X, false, -32768.0f, 32767.0f, axis_min, axis_max);
+        p_context->axis.emplace_back(axis_t{
+            ABS_X,
+            axis_min,
+            axis_max,
+            -1.0f,
+            1.0f,
+            &p_context->gamepadState.left_stick.x
+        });
+
+        get_axis_min_max(p_context, ABS_Y, true, -32768.0f, 32767.0f, axis_min, axis_max);
+        p_context->axis.emplace_back(axis_t{
+            ABS_Y,
+            axis_min,
+            axis_max,
+            -1.0f,
+            1.0f,
+            &p_context->gamepadState.left_stick.y
+        });
+
+        get_axis_min_max(p_context, ABS_RX, false, -32768.0f, 32767.0f, axis_min, axis_max);
+        p_context->axis.emplace_back(axis_t{
+            ABS_RX,
+            axis_min,
+            axis_max,
+            -1.0f,
+            1.0f,
+            &p_context->gamepadState.right_stick.x
+        });
+
+        get_axis_min_max(p_context, ABS_RY, true, -32768.0f, 32767.0f, axis_min, axis_max);
+        p_context->axis.emplace_back(axis_t{
+            ABS_RY,
+            axis_min,
+            axis_max,
+            -1.0f,
+            1.0f,
+            &p_context->gamepadState.right_stick.y
+        });
+
+        get_axis_min_max(p_context, ABS_Z, false, 0.0f, 1023.0f, axis_min, axis_max);
+        p_context->axis.emplace_back(axis_t{
+            ABS_Z,
+            axis_min,
+            axis_max,
+            0.0f,
+            1.0f,
+            &p_context->gamepadState.left_trigger
+        });
+
+        get_axis_min_max(p_context, ABS_RZ, false, 0.0f, 1023.0f, axis_min, axis_max);
+        p_context->axis.emplace_back(axis_t{
+            ABS_RZ,
+            axis_min,
+            axis_max,
+            0.0f,
+            1.0f,
+            &p_context->gamepadState.right_trigger
+        });
+    }
+    else if (testBit(ABS_X, absbit)   && testBit(ABS_Y, absbit) &&
+             testBit(ABS_Z, absbit)   && testBit(ABS_RZ, absbit) &&
+             testBit(ABS_GAS, absbit) && testBit(ABS_BRAKE, absbit))
+    {// XUSB ABS_X, ABS_Y, ABS_Z, ABS_RZ, ABS_GAS, ABS_BRAKE mode
+        // This mode seems to be used when the gamepad is wireless.
+        get_axis_min_max(p_context, ABS_X, false, 0.0f, 65535.0f, axis_min, axis_max);
+        p_context->axis.emplace_back(axis_t{
+            ABS_X,
+            axis_min,
+            axis_max,
+            -1.0f,
+            1.0f,
+            &p_context->gamepadState.left_stick.x
+        });
+
+        get_axis_min_max(p_context, ABS_Y, true, 0.0f, 65535.0f, axis_min, axis_max);
+        p_context->axis.emplace_back(axis_t{
+            ABS_Y,
+            axis_min,
+            axis_max,
+            -1.0f,
+            1.0f,
+            &p_context->gamepadState.left_stick.y
+        });
+
+        get_axis_min_max(p_context, ABS_Z, false, 0.0f, 65535.0f, axis_min, axis_max);
+        p_context->axis.emplace_back(axis_t{
+            ABS_Z,
+            axis_min,
+            axis_max,
             -1.0f,
             1.0f,
             &p_context->gamepadState.right_stick.x
         });
 
-        get_axis_min_max(p_context, ABS_RZ, true, 0.0f, 65535.0f, axis_min, axis_max);
-        p_context->axis.emplace_back(axis_t{
-            ABS_RZ,
-            axis_min,
-            axis_max,
-            -1.0f,
-            1.0f,
-            &p_context->gamepadState.right_stick.y
-        });
+        get_axis_min_max(p_context, ABS_RZ, true, 0.0f, 65535.0f, axis_min, axis_max);
+        p_context->axis.emplace_back(axis_t{
+            ABS_RZ,
+            axis_min,
+            axis_max,
+            -1.0f,
+            1.0f,
+            &p_context->gamepadState.right_stick.y
+        });
+
+        get_axis_min_max(p_context, ABS_BRAKE, false, 0.0f, 1023.0f, axis_min, axis_max);
+        p_context->axis.emplace_back(axis_t{
+            ABS_BRAKE,
+            axis_min,
+            axis_max,
+            0.0f,
+            1.0f,
+            &p_context->gamepadState.left_trigger
+        });
+
+        get_axis_min_max(p_context, ABS_GAS, false, 0.0f, 1023.0f, axis_min, axis_max);
+        p_context->axis.emplace_back(axis_t{
+            ABS_GAS,
+            axis_min,
+            axis_max,
+            0.0f,
+            1.0f,
+            &p_context->gamepadState.right_trigger
+        });
+    }
+    else
+    {
+        return gamepad::failed;
+    }
+
+    build_dispatch_tables(p_context);
+
+    return gamepad::success;
+}
+
+static void close_device(gamepad_context_t* p_context)
+{
+    //for (int i = 0; i < NUM_EFFECTS; ++i)
+    //    unregister_effect(&p_context->effects[i]);
+    unregister_effect(p_context, &p_context->rumbleEffect);
+
+    if (p_context->eventFd != -1)
+    {
+        close(p_context->eventFd);
+        p_context->eventFd = -1;
+    }
+    if (p_context->recordFd != -1)
+    {
+        close(p_context->recordFd);
+        p_context->recordFd = -1;
+    }
+    if (p_context->replay != nullptr)
+    {
+        if (p_context->replay->data != MAP_FAILED)
+            munmap(const_cast<unsigned char*>(p_context->replay->data), p_context->replay->mappedSize);
+
+        close(p_context->replay->fd);
+        delete p_context->replay;
+        p_context->replay = nullptr;
+    }
+    if (p_context->ledFd != -1)
+    {
+        close(p_context->ledFd);
+        p_context->ledFd = -1;
+    }
+}
+
+// Returned by internal_create_context while the node can't be opened for writing yet.
+static constexpr int32_t write_access_pending = 1;
+
+static int32_t init_context(gamepad_context_t** pp_context, const char* device_path)
+{
+    *pp_context = new gamepad_context_t;
+
+    if (*pp_context == nullptr)
+        return gamepad::failed;
+
+    //for (int i = 0; i < NUM_EFFECTS; ++i)
+    //    (*pp_context)->effects[i].id = -1;
+    (*pp_context)->rumbleEffect.id = -1;
+    (*pp_context)->rumbleStrong = 0;
+    (*pp_context)->rumbleWeak = 0;
+    (*pp_context)->rumblePending = false;
+    (*pp_context)->rumbleWrittenThisFrame = false;
+
+    (*pp_context)->eventFd = -1;
+    (*pp_context)->ledFd = -1;
+    (*pp_context)->recordFd = -1;
+    (*pp_context)->replay = nullptr;
+    (*pp_context)->syncDropped = false;
+    (*pp_context)->monotonicClock = false;
+    (*pp_context)->latency = nullptr;
+    (*pp_context)->readTimeUs = 0;
+    (*pp_context)->readBuffer.resize(min_read_buffer_events);
+    (*pp_context)->readSmallUpdates = 0;
+#if defined(GAMEPAD_USE_IO_URING)
+    (*pp_context)->uringArmed = false;
+    (*pp_context)->uringReady = false;
+    (*pp_context)->uringResult = 0;
+    (*pp_context)->uringDetached = false;
+#endif
+    (*pp_context)->dead = false;
+    (*pp_context)->readerShard = no_reader_shard;
+
+    memset(&(*pp_context)->gamepadState, 0, sizeof(gamepad_state_t));
+    reset_event_queue((*pp_context)->eventQueue);
+
+    (*pp_context)->devicePath = strdup(device_path);
+    if ((*pp_context)->devicePath == nullptr)
+        return gamepad::failed;
+
+    return gamepad::success;
+}
+
+static void resync_gamepad_state(gamepad_context_t* p_context, uint64_t timestamp_us);
+
+static int32_t internal_create_context(gamepad_context_t** pp_context, const char* device_path, bool allow_read_only)
+{
+    if (init_context(pp_context, device_path) != gamepad::success)
+        return gamepad::failed;
+
+    int gamepad_fd = open(device_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (gamepad_fd == -1 && errno == EACCES)
+    {// When you plugin a new device, it takes some time to set the acls for write access (~40ms).
+     // The hotplug thread tries again later instead of sleeping here, then settles for no rumble.
+        if (!allow_read_only)
+        {
+            GAMEPAD_STAT_ADD(open_retries, 1);
+            return write_access_pending;
+        }
+
+        gamepad_fd = open(device_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    }
+
+    if (gamepad_fd == -1)
+    {
+        GAMEPAD_STAT_ADD(open_failures, 1);
+        return gamepad::failed;
+    }
+
+    GAMEPAD_STAT_ADD(device_opens, 1);
+
+    (*pp_context)->eventFd = gamepad_fd;
+
+    // Timestamp the events on the same clock as std::chrono::steady_clock, older kernels keep the realtime clock.
+    int clock_id = CLOCK_MONOTONIC;
+    (*pp_context)->monotonicClock = ioctl(gamepad_fd, EVIOCSCLOCKID, &clock_id) == 0;
+
+    // TODO: led
+    //led_path = "/sys/class/leds/xpad<ID>/brightness";
+
+    if (probe_device_capabilities(gamepad_fd, (*pp_context)->capabilities) != gamepad::success)
+        return gamepad::failed;
+
+    if (get_gamepad_infos(*pp_context) != gamepad::success)
+        return gamepad::failed;
+
+    // A stick already deflected or a button held while plugging shows up in the first state, not as events.
+    resync_gamepad_state(*pp_context, 0);
+    reset_event_queue((*pp_context)->eventQueue);
+    return gamepad::success;
+}
+
+static void internal_free_context(gamepad_context_t** pp_context)
+{
+    if (*pp_context == nullptr)
+        return;
+
+    close_device(*pp_context);
+    if ((*pp_context)->devicePath != nullptr)
+    {
+        free((*pp_context)->devicePath);
+        (*pp_context)->devicePath = nullptr;
+    }
+    delete *pp_context;
+    *pp_context = nullptr;
+}
+
+// Must be called with s_gamepad_mutex held.
+static int find_gamepad_device(const char* device_path)
+{
+    auto it = s_device_slots.find(device_path);
+    return it != s_device_slots.end() ? static_cast<int>(it->second) : -1;
+}
+
+// Must be called with s_gamepad_mutex held, the shard thread reads the gamepad from now on.
+static void give_gamepad_to_reader_shard(uint32_t index, gamepad_context_t* p_context)
+{
+    uint32_t shard_count = static_cast<uint32_t>(s_reader_shards.size());
+    reader_shard_t& shard = *s_reader_shards[index % shard_count];
+    struct epoll_event event;
+
+    event.events = EPOLLIN;
+    event.data.u64 = 0;
+    event.data.u32 = index;
+
+    std::lock_guard<std::mutex> lk(shard.mutex);
+    if (!p_context->dead)
+        epoll_ctl(shard.epollFd, EPOLL_CTL_ADD, p_context->eventFd, &event);
+
+    p_context->readerShard = index % shard_count;
+    shard.gamepads[index / shard_count] = p_context;
+}
+
+// Must be called with s_gamepad_mutex held, the caller decides whether the gamepad goes back to s_epoll_fd.
+static void take_gamepad_from_reader_shard(uint32_t index, gamepad_context_t* p_context)
+{
+    uint32_t shard_count = static_cast<uint32_t>(s_reader_shards.size());
+    reader_shard_t& shard = *s_reader_shards[p_context->readerShard];
+
+    std::lock_guard<std::mutex> lk(shard.mutex);
+    epoll_ctl(shard.epollFd, EPOLL_CTL_DEL, p_context->eventFd, nullptr);
+    shard.gamepads[index / shard_count] = nullptr;
+    p_context->readerShard = no_reader_shard;
+}
+
+// Stops polling a dead gamepad, in s_epoll_fd or in its shard epoll set: it would stay readable (EPOLLHUP) and wake
+// its reader every time. The hotplug thread releases it when its node goes away.
+static void stop_polling_gamepad(gamepad_context_t* p_context)
+{
+    if (p_context->eventFd == -1)
+        return;
+
+    int epoll_fd = p_context->readerShard == no_reader_shard ? s_epoll_fd : s_reader_shards[p_context->readerShard]->epollFd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, p_context->eventFd, nullptr);
+}
+
+// Must be called with s_gamepad_mutex held.
+static void attach_gamepad_context(uint32_t index, gamepad_context_t* p_context)
+{
+    struct epoll_event event;
+
+    event.events = EPOLLIN;
+    event.data.u64 = 0;
+    event.data.u32 = index;
+    // Replays have no fd, the update functions advance them.
+    if (p_context->eventFd != -1 && s_reader_shards.empty())
+        epoll_ctl(s_epoll_fd, EPOLL_CTL_ADD, p_context->eventFd, &event);
+
+    // Recorded timestamps are not comparable with the clock.
+    reset_latency_stats(index);
+    p_context->latency = p_context->monotonicClock && p_context->replay == nullptr ? &get_latency_stats(index) : nullptr;
+
+    s_gamepads[index] = p_context;
+    if (p_context->replay == nullptr)
+        s_device_slots[p_context->devicePath] = index;
+
+    publish_gamepad_context(index, p_context);
+    queue_connection_event(index, true);
+
+    // Once published: the shard thread only writes the slots of the gamepads it has.
+    if (p_context->eventFd != -1 && !s_reader_shards.empty())
+        give_gamepad_to_reader_shard(index, p_context);
+}
+
+// Must be called with s_gamepad_mutex held. The caller frees the context once the lock is released, unless it is
+// nullptr: an io_uring read still uses it, the update reaping its completion frees it.
+static gamepad_context_t* detach_gamepad_context(uint32_t index)
+{
+    gamepad_context_t* p_context = s_gamepads[index];
+    gamepad_context_t* p_released = p_context;
+
+    if (p_context->readerShard != no_reader_shard)
+        take_gamepad_from_reader_shard(index, p_context);
+    else if (p_context->eventFd != -1)
+        epoll_ctl(s_epoll_fd, EPOLL_CTL_DEL, p_context->eventFd, nullptr);
+
+#if defined(GAMEPAD_USE_IO_URING)
+    if (!uring_detach_context(p_context))
+        p_released = nullptr;
+#endif
+
+    s_gamepads[index] = nullptr;
+    if (p_context->replay == nullptr)
+        s_device_slots.erase(p_context->devicePath);
+
+    unpublish_gamepad_state(index);
+    queue_connection_event(index, false);
+
+    return p_released;
+}
+
+// Called from the hotplug thread. The device is opened and probed without s_gamepad_mutex,
+// the lock is only taken to publish the fully initialized context into a free slot.
+static int32_t add_gamepad_device(const char* device_path, bool allow_read_only)
+{
+    gamepad_context_t* p_context = nullptr;
+    std::vector<gamepad_context_t*> released_contexts;
+    pending_connection_events_t pending;
+    int32_t res;
+
+    {
+        std::lock_guard<gamepad_mutex_t> lk(s_gamepad_mutex);
+
+        int index = find_gamepad_device(device_path);
+        if (index != -1)
+        {
+            if (!s_gamepads[index]->dead)
+                return gamepad::success;
+
+            // The node is still there but its last read failed, open it again.
+            released_contexts.emplace_back(detach_gamepad_context(index));
+        }
+    }
+
+    GAMEPAD_STAT_ADD(nodes_probed, 1);
+    if (!is_gamepad(device_path))
+    {
+        res = gamepad::failed;
+    }
+    else if ((res = internal_create_context(&p_context, device_path, allow_read_only)) != gamepad::success)
+    {
+        internal_free_context(&p_context);
+    }
+
+    {
+        std::lock_guard<gamepad_mutex_t> lk(s_gamepad_mutex);
+
+        for (uint32_t i = 0; p_context != nullptr && i < max_connected_gamepads; ++i)
+        {
+            if (s_gamepads[i] != nullptr)
+            {
+                if (!s_gamepads[i]->dead)
+                    continue;
+
+                released_contexts.emplace_back(detach_gamepad_context(i));
+            }
+
+            attach_gamepad_context(i, p_context);
+            p_context = nullptr;
+            break;
+        }
+
+        take_connection_events(pending);
+    }
+
+    if (p_context != nullptr)
+    {// No free slot.
+        internal_free_context(&p_context);
+        res = gamepad::failed;
+    }
+
+    for (auto& p_released : released_contexts)
+        internal_free_context(&p_released);
+
+    dispatch_connection_events(pending);
+
+    return res;
+}
+
+// Called from the hotplug thread.
+static void remove_gamepad_device(const char* device_path)
+{
+    gamepad_context_t* p_context = nullptr;
+    pending_connection_events_t pending;
+
+    {
+        std::lock_guard<gamepad_mutex_t> lk(s_gamepad_mutex);
+
+        int index = find_gamepad_device(device_path);
+        if (index != -1)
+            p_context = detach_gamepad_context(index);
+
+        take_connection_events(pending);
+    }
+
+    internal_free_context(&p_context);
+    dispatch_connection_events(pending);
+}
+
+struct pending_device_t
+{
+    std::string device_path;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+// Called from the hotplug thread.
+static void try_add_gamepad_device(const char* device_path, std::vector<pending_device_t>& pending_devices)
+{
+    for (auto const& pending_device : pending_devices)
+    {
+        if (pending_device.device_path == device_path)
+            return;
+    }
+
+    if (add_gamepad_device(device_path, false) == write_access_pending)
+    {// Give udev 75ms to set the acls, the node is tried again on IN_ATTRIB or when the delay expires.
+        pending_devices.emplace_back(pending_device_t{
+            device_path,
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(75)
+        });
+    }
+}
+
+// Called from the hotplug thread.
+static void retry_pending_devices(std::vector<pending_device_t>& pending_devices, bool attributes_changed)
+{
+    auto now = std::chrono::steady_clock::now();
+
+    for (auto it = pending_devices.begin(); it != pending_devices.end();)
+    {
+        bool expired = now >= it->deadline;
+        if ((attributes_changed || expired) && add_gamepad_device(it->device_path.c_str(), expired) != write_access_pending)
+        {
+            it = pending_devices.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+// Called from the hotplug thread.
+static void scan_gamepad_devices(std::vector<pending_device_t>& pending_devices)
+{
+    DIR* input_dir;
+    struct dirent* input_dir_entry;
+    char device_path[sizeof(s_devfs_root) + NAME_MAX + 1];
+
+    input_dir = opendir(s_devfs_root);
+    if (input_dir == nullptr)
+        return;
+
+    GAMEPAD_STAT_ADD(directory_scans, 1);
+
+    while ((input_dir_entry = readdir(input_dir)) != nullptr)
+    {
+        if (strncmp(input_dir_entry->d_name, "event", 5) != 0)
+            continue;
+
+        snprintf(device_path, sizeof(device_path), "%s/%s", s_devfs_root, input_dir_entry->d_name);
+        try_add_gamepad_device(device_path, pending_devices);
+    }
+
+    closedir(input_dir);
+}
+
+static int open_hotplug_watch()
+{
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1)
+        return -1;
+
+    if (inotify_add_watch(inotify_fd, s_devfs_root, IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM) == -1)
+    {
+        close(inotify_fd);
+        return -1;
+    }
+
+    return inotify_fd;
+}
+
+static void hotplug_thread_proc()
+{
+    alignas(struct inotify_event) char buffer[4096];
+    char device_path[sizeof(s_devfs_root) + NAME_MAX + 1];
+    std::vector<pending_device_t> pending_devices;
+    struct pollfd fds[2];
+
+    // Without inotify (no input directory yet, no more watches...), rescan every second.
+    int inotify_fd = open_hotplug_watch();
+
+    fds[0].fd = s_hotplug_wakeup_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = inotify_fd;
+    fds[1].events = POLLIN;
+
+    scan_gamepad_devices(pending_devices);
+
+    while (true)
+    {
+        int timeout = (inotify_fd == -1 ? 1000 : -1);
+        if (!pending_devices.empty())
+        {
+            auto now = std::chrono::steady_clock::now();
+            auto deadline = pending_devices.front().deadline;
+            for (auto const& pending_device : pending_devices)
+                deadline = std::min(deadline, pending_device.deadline);
+
+            timeout = (deadline <= now ? 0 : static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count()) + 1);
+        }
+
+        int res = poll(fds, inotify_fd == -1 ? 1 : 2, timeout);
+        if (res == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        // internal_stop_threads asked us to leave.
+        if (fds[0].revents != 0)
+            break;
+
+        if (inotify_fd == -1)
+        {
+            if (res == 0)
+            {
+                if ((inotify_fd = open_hotplug_watch()) != -1)
+                    fds[1].fd = inotify_fd;
+
+                scan_gamepad_devices(pending_devices);
+            }
+            retry_pending_devices(pending_devices, false);
+            continue;
+        }
+
+        ssize_t len = (res > 0 ? read(inotify_fd, buffer, sizeof(buffer)) : 0);
+        bool attributes_changed = false;
+
+        for (char* it = buffer; it < buffer + len; it += sizeof(struct inotify_event) + reinterpret_cast<struct inotify_event*>(it)->len)
+        {
+            struct inotify_event* event = reinterpret_cast<struct inotify_event*>(it);
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {// We lost some events, check everything again.
+                scan_gamepad_devices(pending_devices);
+                continue;
+            }
+
+            if (event->len == 0 || strncmp(event->name, "event", 5) != 0)
+                continue;
+
+            snprintf(device_path, sizeof(device_path), "%s/%s", s_devfs_root, event->name);
+
+            if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+            {
+                for (auto pending_it = pending_devices.begin(); pending_it != pending_devices.end(); ++pending_it)
+                {
+                    if (pending_it->device_path == device_path)
+                    {
+                        pending_devices.erase(pending_it);
+                        break;
+                    }
+                }
+                remove_gamepad_device(device_path);
+            }
+            else
+            {// IN_CREATE, IN_MOVED_TO or IN_ATTRIB: udev sets the acls after the node has been created,
+             // so a device we couldn't open yet will be tried again when its attributes change.
+                attributes_changed = attributes_changed || (event->mask & IN_ATTRIB);
+                try_add_gamepad_device(device_path, pending_devices);
+            }
+        }
+
+        retry_pending_devices(pending_devices, attributes_changed);
+    }
+
+    if (inotify_fd != -1)
+        close(inotify_fd);
+}
+
+static void load_device_roots()
+{
+    const char* root;
+
+    if ((root = getenv("GAMEPAD_DEVFS_ROOT")) != nullptr)
+        snprintf(s_devfs_root, sizeof(s_devfs_root), "%s", root);
+
+    if ((root = getenv("GAMEPAD_SYSFS_ROOT")) != nullptr)
+        snprintf(s_sysfs_root, sizeof(s_sysfs_root), "%s", root);
+}
+
+// Must be called with s_gamepad_mutex held.
+static int32_t setup_hotplug_monitor()
+{
+    if (s_hotplug_thread.joinable())
+        return gamepad::success;
+
+    load_device_roots();
+
+    if (s_epoll_fd == -1 && (s_epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        return gamepad::failed;
+
+#if defined(GAMEPAD_USE_IO_URING)
+    uring_setup();
+#endif
+
+    s_hotplug_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s_hotplug_wakeup_fd == -1)
+        return gamepad::failed;
+
+    // Devices are enumerated, opened and probed by the hotplug thread, like the IOKit run loop does on macOS.
+    register_threads_cleanup();
+    s_hotplug_thread = std::thread(hotplug_thread_proc);
+
+    return gamepad::success;
+}
+
+static int32_t internal_get_gamepad(uint32_t index, gamepad_context_t** pp_context)
+{
+    if (s_gamepads[index] != nullptr && !s_gamepads[index]->dead)
+    {
+        *pp_context = s_gamepads[index];
+        return gamepad::success;
+    }
+    *pp_context = nullptr;
+
+    // The hotplug thread keeps the slots up to date, an empty slot costs nothing.
+    setup_hotplug_monitor();
+
+    return gamepad::failed;
+}
+
+// The hotplug thread attaches and publishes the gamepads.
+static bool internal_start_discovery()
+{
+    return setup_hotplug_monitor() == gamepad::success;
+}
+
+static inline uint64_t get_event_timestamp_us(struct input_event const& event)
+{
+    return static_cast<uint64_t>(event.input_event_sec) * 1000000 + event.input_event_usec;
+}
+
+static inline void set_button_value(uint32_t& buttons, uint32_t value, bool activated)
+{
+    if (activated)
+        buttons |= value;
+    else
+        buttons &= ~value;
+}
+
+static inline void apply_key_value(gamepad_context_t* p_context, uint16_t code, int32_t value)
+{
+    if (code < KEY_CNT && p_context->keyButtons[code] != gamepad::button_none)
+        set_button_value(p_context->gamepadState.buttons, p_context->keyButtons[code], value);
+}
+
+static inline void apply_abs_value(gamepad_context_t* p_context, uint16_t code, int32_t value, uint64_t timestamp_us)
+{
+    if (code >= ABS_CNT)
+        return;
+
+    switch (p_context->absDispatch[code].kind)
+    {
+        case abs_dispatch_t::kind_e::hat_x:
+            if (value == 0)
+            {
+                set_button_value(p_context->gamepadState.buttons, gamepad::button_left, false);
+                set_button_value(p_context->gamepadState.buttons, gamepad::button_right, false);
+            }
+            else
+            {
+                set_button_value(p_context->gamepadState.buttons, gamepad::button_left, value < 0);
+                set_button_value(p_context->gamepadState.buttons, gamepad::button_right, value > 0);
+            }
+            break;
+
+        case abs_dispatch_t::kind_e::hat_y:
+            if (value == 0)
+            {
+                set_button_value(p_context->gamepadState.buttons, gamepad::button_up, false);
+                set_button_value(p_context->gamepadState.buttons, gamepad::button_down, false);
+            }
+            else
+            {
+                set_button_value(p_context->gamepadState.buttons, gamepad::button_up, value < 0);
+                set_button_value(p_context->gamepadState.buttons, gamepad::button_down, value > 0);
+            }
+            break;
+
+        case abs_dispatch_t::kind_e::axis:
+        {
+            abs_dispatch_t const& entry = p_context->absDispatch[code];
+            float mapped_value = transform_axis_value(entry, value);
+            // Several raw values can map to the same one, only a real change is stored and queued.
+            if (mapped_value == *entry.axis.mapped_value)
+                break;
+
+            *entry.axis.mapped_value = mapped_value;
+            push_axis_event(p_context->eventQueue, timestamp_us, entry.event_axis, mapped_value);
+            break;
+        }
+
+        case abs_dispatch_t::kind_e::ignored:
+            break;
+    }
+}
+
+// Reloads every mapped key and axis from the kernel. Used when the device is opened and after a SYN_DROPPED,
+// the changes are queued as events like decoded ones.
+static void resync_gamepad_state(gamepad_context_t* p_context, uint64_t timestamp_us)
+{
+    p_context->syncDropped = false;
+    // Replays have no device, they keep the state their events built.
+    if (p_context->eventFd == -1)
+        return;
+
+    GAMEPAD_STAT_ADD(resyncs, 1);
+
+    unsigned char keybit[1 + KEY_CNT / 8 / sizeof(unsigned char)] = { 0 };
+    if (ioctl(p_context->eventFd, EVIOCGKEY(sizeof(keybit)), keybit) >= 0)
+    {
+        for (uint16_t code = 0; code < KEY_CNT; ++code)
+        {
+            if (p_context->keyButtons[code] != gamepad::button_none)
+                apply_key_value(p_context, code, testBit(code, keybit));
+        }
+    }
+
+    for (uint16_t code = 0; code < ABS_CNT; ++code)
+    {
+        struct input_absinfo absinfo;
+        if (p_context->absDispatch[code].kind != abs_dispatch_t::kind_e::ignored && ioctl(p_context->eventFd, EVIOCGABS(code), &absinfo) >= 0)
+            apply_abs_value(p_context, code, absinfo.value, timestamp_us);
+    }
+}
+
+// Folds the events into the gamepad state and queues them.
+static void decode_gamepad_events(gamepad_context_t* p_context, struct input_event const* events, int num_events)
+{
+    // Summed here, the shared counters are only touched once per call.
+    uint32_t syn_count = 0;
+    uint32_t key_count = 0;
+    uint32_t abs_count = 0;
+
+    for (int i = 0; i < num_events; ++i)
+    {
+        auto const& event_code = events[i].code;
+        uint64_t timestamp_us = get_event_timestamp_us(events[i]);
+        uint32_t old_buttons = p_context->gamepadState.buttons;
+        switch (events[i].type)
+        {
+            case EV_SYN:
+                ++syn_count;
+                if (event_code == SYN_DROPPED)
+                {// The kernel buffer overflowed, the events up to the next report are incomplete.
+                    p_context->syncDropped = true;
+                    GAMEPAD_STAT_ADD(sync_drops, 1);
+                }
+                else if (event_code == SYN_REPORT)
+                {
+                    if (p_context->syncDropped)
+                        resync_gamepad_state(p_context, timestamp_us);
+
+                    if (p_context->latency != nullptr)
+                        record_report_read(*p_context->latency, timestamp_us, p_context->readTimeUs);
+                }
+                break;
+
+            case EV_KEY:
+                ++key_count;
+                if (!p_context->syncDropped)
+                    apply_key_value(p_context, event_code, events[i].value);
+                break;
+
+            case EV_ABS:
+                ++abs_count;
+                if (!p_context->syncDropped)
+                    apply_abs_value(p_context, event_code, events[i].value, timestamp_us);
+                break;
+        }
+
+        if (p_context->gamepadState.buttons != old_buttons)
+            push_button_events(p_context->eventQueue, timestamp_us, old_buttons, p_context->gamepadState.buttons);
+    }
+
+    GAMEPAD_STAT_ADD(syn_events, syn_count);
+    GAMEPAD_STAT_ADD(key_events, key_count);
+    GAMEPAD_STAT_ADD(abs_events, abs_count);
+    GAMEPAD_STAT_ADD(other_events, static_cast<uint32_t>(num_events) - syn_count - key_count - abs_count);
+}
+
+static void begin_rumble_frame(gamepad_context_t* p_context);
+static int32_t read_gamepad_events(gamepad_context_t* p_context);
+static int32_t read_replay_events(gamepad_context_t* p_context);
+#if defined(GAMEPAD_USE_IO_URING)
+static int32_t uring_read_gamepad_events(gamepad_context_t* p_context);
+#endif
+
+// Number of replayed gamepads, guarded by s_gamepad_mutex.
+static uint32_t s_replay_count = 0;
+
+static int32_t internal_update_gamepad_state(gamepad_context_t* p_context)
+{
+    begin_rumble_frame(p_context);
+    if (p_context->replay != nullptr)
+        return read_replay_events(p_context);
+
+    int32_t res;
+#if defined(GAMEPAD_USE_IO_URING)
+    if (s_uring.fd != -1 && p_context->readerShard == no_reader_shard)
+        res = uring_read_gamepad_events(p_context);
+    else
+#endif
+    res = read_gamepad_events(p_context);
+
+    if (p_context->dead)
+        stop_polling_gamepad(p_context);
+
+    return res;
+}
+
+// Appends the events as they were read, a failed write ends the recording.
+static void record_gamepad_events(gamepad_context_t* p_context, struct input_event const* events, int num_events)
+{
+    ssize_t size = static_cast<ssize_t>(num_events * sizeof(*events));
+    if (write(p_context->recordFd, events, size) != size)
+    {
+        close(p_context->recordFd);
+        p_context->recordFd = -1;
+    }
+}
+
+// Follows the backlog: doubled when a read fills it, halved after read_buffer_shrink_updates updates that
+// used less than a quarter of it.
+static void adapt_read_buffer(gamepad_context_t* p_context, size_t update_events, bool filled)
+{
+    size_t size = p_context->readBuffer.size();
+    if (filled && size < max_read_buffer_events)
+    {
+        p_context->readBuffer.resize(size * 2);
+        p_context->readSmallUpdates = 0;
+    }
+    else if (update_events < size / 4 && size > min_read_buffer_events)
+    {
+        if (++p_context->readSmallUpdates == read_buffer_shrink_updates)
+        {
+            p_context->readBuffer.resize(size / 2);
+            p_context->readBuffer.shrink_to_fit();
+            p_context->readSmallUpdates = 0;
+        }
+    }
+    else
+    {
+        p_context->readSmallUpdates = 0;
+    }
+}
+
+static int32_t read_gamepad_events(gamepad_context_t* p_context)
+{
+    ssize_t read_size;
+    size_t update_events = 0;
+    uint32_t data_reads = 0;
+    while (true)
+    {
+        struct input_event* events = p_context->readBuffer.data();
+        size_t buffer_size = p_context->readBuffer.size() * sizeof(*events);
+        if ((read_size = read(p_context->eventFd, events, buffer_size)) <= 0)
+            break;
+
+        size_t num_events = static_cast<size_t>(read_size) / sizeof(*events);
+        ++data_reads;
+        update_events += num_events;
+        if (p_context->recordFd != -1)
+            record_gamepad_events(p_context, events, static_cast<int>(num_events));
+
+        if (p_context->latency != nullptr)
+            p_context->readTimeUs = get_monotonic_us();
+
+        decode_gamepad_events(p_context, events, static_cast<int>(num_events));
+
+        // evdev hands out everything it queued up to the buffer size (it has no FIONREAD), a short read means
+        // the queue is empty: the read that would only return EAGAIN is skipped.
+        bool filled = static_cast<size_t>(read_size) == buffer_size;
+        if (filled)
+            adapt_read_buffer(p_context, update_events, true);
+        else
+            break;
+    }
+
+    GAMEPAD_STAT_ADD(reads, data_reads + (read_size > 0 ? 0 : 1));
+    GAMEPAD_STAT_ADD(reads_with_data, data_reads);
+    if (read_size < 0)
+    {
+        if (errno != EWOULDBLOCK && errno != EAGAIN)
+        {
+            GAMEPAD_STAT_ADD(read_errors, 1);
+            p_context->dead = 1;
+            return gamepad::failed;
+        }
+
+        GAMEPAD_STAT_ADD(reads_would_block, 1);
+    }
+
+    adapt_read_buffer(p_context, update_events, false);
+    return gamepad::success;
+}
+
+#if defined(GAMEPAD_USE_IO_URING)
+// Decodes the completed read of the device, like read_gamepad_events does with its read() calls.
+static int32_t uring_decode_completion(gamepad_context_t* p_context)
+{
+    if (!p_context->uringReady)
+        return gamepad::success;
+
+    p_context->uringReady = false;
+    int32_t result = p_context->uringResult;
+    GAMEPAD_STAT_ADD(reads, 1);
+    if (result < 0)
+    {
+        // Reads are cancelled when the thread that submitted them exits, they are armed again.
+        if (result == -ECANCELED || result == -EAGAIN || result == -EINTR)
+        {
+            GAMEPAD_STAT_ADD(reads_would_block, 1);
+            return gamepad::success;
+        }
+
+        GAMEPAD_STAT_ADD(read_errors, 1);
+        p_context->dead = 1;
+        return gamepad::failed;
+    }
+
+    struct input_event* events = p_context->readBuffer.data();
+    size_t num_events = static_cast<size_t>(result) / sizeof(*events);
+    GAMEPAD_STAT_ADD(reads_with_data, result > 0 ? 1 : 0);
+    if (p_context->recordFd != -1)
+        record_gamepad_events(p_context, events, static_cast<int>(num_events));
+
+    if (p_context->latency != nullptr)
+        p_context->readTimeUs = get_monotonic_us();
+
+    decode_gamepad_events(p_context, events, static_cast<int>(num_events));
+    // Not in flight anymore, the buffer can be resized before the next read.
+    adapt_read_buffer(p_context, num_events, num_events == p_context->readBuffer.size());
+    return gamepad::success;
+}
+
+static inline bool is_uring_gamepad(gamepad_context_t const* p_context)
+{
+    return p_context != nullptr && !p_context->dead && p_context->eventFd != -1 && p_context->readerShard == no_reader_shard;
+}
+
+// Must be called with s_gamepad_mutex held. One gamepad through the ring: the completions already there, then
+// the ones the submission brings right away.
+static int32_t uring_read_gamepad_events(gamepad_context_t* p_context)
+{
+    uring_reap();
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        if (uring_decode_completion(p_context) != gamepad::success)
+            return gamepad::failed;
+
+        uring_arm_read(p_context);
+        if (pass == 0)
+        {
+            uring_enter(0);
+            uring_reap();
+        }
+    }
+
+    return gamepad::success;
+}
+
+// Must be called with s_gamepad_mutex held. Every gamepad with a single io_uring_enter, the reads armed after
+// the submission are left queued for the next update.
+static void uring_read_all_gamepads(uint32_t* p_changed_mask)
+{
+    gamepad_state_t old_states[max_connected_gamepads];
+    bool updated[max_connected_gamepads] = {};
+    // No gamepad past the allocated slots.
+    const uint32_t slot_count = s_slot_count.load(std::memory_order_relaxed);
+
+    for (uint32_t i = 0; i < slot_count; ++i)
+    {
+        if (is_uring_gamepad(s_gamepads[i]))
+            memcpy(&old_states[i], &s_gamepads[i]->gamepadState, sizeof(gamepad_state_t));
+    }
+
+    uring_reap();
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        for (uint32_t i = 0; i < slot_count; ++i)
+        {
+            gamepad_context_t* p_context = s_gamepads[i];
+            if (!is_uring_gamepad(p_context))
+                continue;
+
+            if (uring_decode_completion(p_context) != gamepad::success)
+            {
+                stop_polling_gamepad(p_context);
+                unpublish_gamepad_state(i);
+                set_gamepad_mask_bit(p_changed_mask, i);
+                continue;
+            }
+
+            updated[i] = true;
+            uring_arm_read(p_context);
+        }
+
+        if (pass == 0)
+        {
+            uring_enter(0);
+            uring_reap();
+        }
+    }
+
+    for (uint32_t i = 0; i < slot_count; ++i)
+    {
+        gamepad_context_t* p_context = s_gamepads[i];
+        if (!updated[i] || !is_uring_gamepad(p_context))
+            continue;
+
+        if (memcmp(&old_states[i], &p_context->gamepadState, sizeof(gamepad_state_t)) != 0)
+        {
+            publish_gamepad_context(i, p_context);
+            set_gamepad_mask_bit(p_changed_mask, i);
+        }
+        record_reports_visible(i);
+    }
+}
+#endif
+
+// Maps the whole file again when it grew, a recorder can still be appending to it.
+static bool map_replay(replay_t& replay)
+{
+    struct stat file_stat;
+    if (fstat(replay.fd, &file_stat) == -1)
+        return false;
+
+    size_t size = static_cast<size_t>(file_stat.st_size);
+    if (replay.data != MAP_FAILED && size <= replay.mappedSize)
+        return true;
+
+    if (replay.data != MAP_FAILED)
+        munmap(const_cast<unsigned char*>(replay.data), replay.mappedSize);
+
+    replay.data = static_cast<const unsigned char*>(mmap(nullptr, size, PROT_READ, MAP_SHARED, replay.fd, 0));
+    replay.mappedSize = replay.data != MAP_FAILED ? size : 0;
+    return replay.data != MAP_FAILED;
+}
+
+// Decodes the events that are due, like read_gamepad_events does with the ones the device queued.
+static int32_t read_replay_events(gamepad_context_t* p_context)
+{
+    replay_t& replay = *p_context->replay;
+    size_t event_count = (replay.mappedSize - recording_header_size) / sizeof(struct input_event);
+
+    if (replay.nextEvent == event_count)
+    {
+        if (!map_replay(replay))
+        {
+            p_context->dead = 1;
+            return gamepad::failed;
+        }
+        // A partially written event at the end is left for later.
+        event_count = (replay.mappedSize - recording_header_size) / sizeof(struct input_event);
+    }
+
+    struct input_event const* events = reinterpret_cast<struct input_event const*>(replay.data + recording_header_size);
+    size_t end_event = event_count;
+    if (replay.speed == replay_speed_e::real_time && replay.nextEvent < event_count)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (!replay.started)
+        {
+            replay.started = true;
+            replay.firstEventUs = get_event_timestamp_us(events[replay.nextEvent]);
+            replay.startTime = now;
+        }
+
+        int64_t elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(now - replay.startTime).count();
+        for (end_event = replay.nextEvent; end_event < event_count; ++end_event)
+        {
+            if (static_cast<int64_t>(get_event_timestamp_us(events[end_event]) - replay.firstEventUs) > elapsed_us)
+                break;
+        }
+    }
+
+    // Same chunks as the device reads.
+    while (replay.nextEvent < end_event)
+    {
+        size_t chunk = std::min<size_t>(32, end_event - replay.nextEvent);
+        decode_gamepad_events(p_context, events + replay.nextEvent, static_cast<int>(chunk));
+        replay.nextEvent += chunk;
+    }
+
+    return gamepad::success;
+}
+
+// Must be called with s_gamepad_mutex held.
+static int32_t epoll_read_all_gamepads(uint32_t* p_changed_mask)
+{
+    struct epoll_event events[max_connected_gamepads];
+    gamepad_state_t old_state;
+
+    // Only the gamepads with pending events are read, idle ones cost nothing.
+    int event_count = epoll_wait(s_epoll_fd, events, max_connected_gamepads, 0);
+    if (event_count == -1)
+        return errno == EINTR ? gamepad::success : gamepad::failed;
+
+    for (int i = 0; i < event_count; ++i)
+    {
+        uint32_t index = events[i].data.u32;
+        gamepad_context_t* p_context = s_gamepads[index];
+        if (p_context == nullptr)
+            continue;
+
+        memcpy(&old_state, &p_context->gamepadState, sizeof(gamepad_state_t));
+        if (p_context->dead || read_gamepad_events(p_context) != gamepad::success)
+        {
+            stop_polling_gamepad(p_context);
+            unpublish_gamepad_state(index);
+            set_gamepad_mask_bit(p_changed_mask, index);
+            continue;
+        }
+
+        if (memcmp(&old_state, &p_context->gamepadState, sizeof(gamepad_state_t)) != 0)
+        {
+            publish_gamepad_context(index, p_context);
+            set_gamepad_mask_bit(p_changed_mask, index);
+        }
+        record_reports_visible(index);
+    }
+
+    return gamepad::success;
+}
+
+static int32_t internal_update_all_gamepads(uint32_t* p_changed_mask)
+{
+    gamepad_state_t old_state;
+
+    clear_gamepad_mask(p_changed_mask);
+
+    if (setup_hotplug_monitor() != gamepad::success)
+        return gamepad::failed;
+
+    // No gamepad past the allocated slots.
+    const uint32_t slot_count = s_slot_count.load(std::memory_order_relaxed);
+
+    for (uint32_t i = 0; i < slot_count; ++i)
+    {
+        if (s_gamepads[i] != nullptr && !s_gamepads[i]->dead)
+            begin_rumble_frame(s_gamepads[i]);
+    }
+
+#if defined(GAMEPAD_USE_IO_URING)
+    if (s_uring.fd != -1)
+        uring_read_all_gamepads(p_changed_mask);
+    else
+#endif
+    if (epoll_read_all_gamepads(p_changed_mask) != gamepad::success)
+        return gamepad::failed;
+
+    // Replays have no fd to poll.
+    for (uint32_t i = 0; s_replay_count != 0 && i < slot_count; ++i)
+    {
+        gamepad_context_t* p_context = s_gamepads[i];
+        if (p_context == nullptr || p_context->replay == nullptr || p_context->dead)
+            continue;
+
+        memcpy(&old_state, &p_context->gamepadState, sizeof(gamepad_state_t));
+        if (read_replay_events(p_context) != gamepad::success)
+        {
+            unpublish_gamepad_state(i);
+            set_gamepad_mask_bit(p_changed_mask, i);
+        }
+        else if (memcmp(&old_state, &p_context->gamepadState, sizeof(gamepad_state_t)) != 0)
+        {
+            publish_gamepad_context(i, p_context);
+            set_gamepad_mask_bit(p_changed_mask, i);
+        }
+    }
+
+    return gamepad::success;
+}
+
+static int32_t internal_get_gamepad_state(gamepad_context_t* p_context, gamepad_state_t* p_gamepad_state)
+{
+    memcpy(p_gamepad_state, &p_context->gamepadState, sizeof(gamepad_state_t));
+    return gamepad::success;
+}
+
+static int32_t internal_get_gamepad_id(gamepad_context_t* p_context, gamepad_id_t* p_gamepad_id)
+{
+    p_gamepad_id->id = p_context->id.id;
+    return gamepad::success;
+}
+
+static int32_t upload_rumble(gamepad_context_t* p_context)
+{
+    struct ff_effect* p_effect = &p_context->rumbleEffect;
+
+    p_context->rumblePending = false;
+    p_context->rumbleWrittenThisFrame = true;
+
+    p_effect->type = FF_RUMBLE;
+    p_effect->u.rumble.strong_magnitude = p_context->rumbleStrong;
+    p_effect->u.rumble.weak_magnitude = p_context->rumbleWeak;
+    // Played until it is removed, the magnitudes are changed in place.
+    p_effect->replay.length = 0;
+    p_effect->replay.delay = 0;
+
+    // The effect keeps playing, uploading it again with its id only changes the magnitudes.
+    if (p_effect->id != -1)
+    {
+        GAMEPAD_STAT_ADD(ff_uploads, 1);
+        if (ioctl(p_context->eventFd, EVIOCSFF, p_effect) == 0)
+            return gamepad::success;
+
+        GAMEPAD_STAT_ADD(ff_errors, 1);
+    }
+
+    p_effect->id = -1;
+    if (register_effect(p_context, p_effect) != gamepad::success)
+    {
+        //std::cout << "register_effect failed." << std::endl;
+        return gamepad::failed;
+    }
+
+    return play_effect(p_context, p_effect);
+}
+
+// A frame starts with every update, the rumble change requested during the last one is uploaded now.
+static void begin_rumble_frame(gamepad_context_t* p_context)
+{
+    p_context->rumbleWrittenThisFrame = false;
+    if (p_context->rumblePending)
+        upload_rumble(p_context);
+}
+
+static int32_t internal_write_gamepad_vibration(gamepad_context_t* p_context, float left_strength, float right_strength)
+{
+    uint16_t strong = static_cast<uint16_t>(left_strength * 65535);
+    uint16_t weak = static_cast<uint16_t>(right_strength * 65535);
+
+    if (strong == p_context->rumbleStrong && weak == p_context->rumbleWeak && !p_context->rumblePending)
+        return gamepad::success;
+
+    p_context->rumbleStrong = strong;
+    p_context->rumbleWeak = weak;
+
+    return upload_rumble(p_context);
+}
+
+static int32_t internal_set_gamepad_vibration(gamepad_context_t* p_context, float left_strength, float right_strength)
+{
+    uint16_t strong = static_cast<uint16_t>(left_strength * 65535);
+    uint16_t weak = static_cast<uint16_t>(right_strength * 65535);
+
+    if (strong == p_context->rumbleStrong && weak == p_context->rumbleWeak)
+        return gamepad::success;
+
+    p_context->rumbleStrong = strong;
+    p_context->rumbleWeak = weak;
+
+    // One upload per frame, the following changes are merged and uploaded when the next frame begins.
+    // A stop is never held back.
+    if (p_context->rumbleWrittenThisFrame && !s_reader_thread_running && (strong != 0 || weak != 0))
+    {
+        p_context->rumblePending = true;
+        return gamepad::success;
+    }
+
+    return upload_rumble(p_context);
+}
+
+static int32_t internal_set_gamepad_led(gamepad_context_t* p_context, uint8_t r, uint8_t g, uint8_t b)
+{
+    return gamepad::failed;
+}
+
+static int32_t internal_get_gamepad_events(gamepad_context_t* p_context, gamepad_event_t* p_events, uint32_t max_events, uint32_t* p_event_count, uint32_t* p_dropped_count)
+{
+    *p_event_count = pop_events(p_context->eventQueue, p_events, max_events, p_dropped_count);
+    return gamepad::success;
+}
+
+static int32_t internal_start_gamepad_recording(gamepad_context_t* p_context, const char* path)
+{
+    unsigned char header_buffer[recording_header_size] = {};
+    recording_header_t header;
+
+    if (p_context->recordFd != -1)
+        return gamepad::failed;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return gamepad::failed;
 
-        get_axis_min_max(p_context, ABS_BRAKE, false, 0.0f, 1023.0f, axis_min, axis_max);
-        p_context->axis.emplace_back(axis_t{
-            ABS_BRAKE,
-            axis_min,
-            axis_max,
-            0.0f,
-            1.0f,
-            &p_context->gamepadState.left_trigger
-        });
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, recording_magic, sizeof(header.magic));
+    header.version = recording_version;
+    header.header_size = recording_header_size;
+    header.event_size = sizeof(struct input_event);
+    header.capabilities = p_context->capabilities;
+    memcpy(header_buffer, &header, sizeof(header));
 
-        get_axis_min_max(p_context, ABS_GAS, false, 0.0f, 1023.0f, axis_min, axis_max);
-        p_context->axis.emplace_back(axis_t{
-            ABS_GAS,
-            axis_min,
-            axis_max,
-            0.0f,
-            1.0f,
-            &p_context->gamepadState.right_trigger
-        });
-    }
-    else
+    // The whole header lands before any event, a replay of the file can start at any time.
+    if (write(fd, header_buffer, sizeof(header_buffer)) != static_cast<ssize_t>(sizeof(header_buffer)))
     {
+        close(fd);
         return gamepad::failed;
     }
 
+    p_context->recordFd = fd;
     return gamepad::success;
 }
 
-static void close_device(gamepad_context_t* p_context)
+static int32_t internal_stop_gamepad_recording(gamepad_context_t* p_context)
 {
-    //for (int i = 0; i < NUM_EFFECTS; ++i)
-    //    unregister_effect(&p_context->effects[i]);
-    unregister_effect(p_context, &p_context->rumbleEffect);
+    if (p_context->recordFd == -1)
+        return gamepad::failed;
 
-    if (p_context->eventFd != -1)
-    {
-        close(p_context->eventFd);
-        p_context->eventFd = -1;
-    }
-    if (p_context->ledFd != -1)
+    close(p_context->recordFd);
+    p_context->recordFd = -1;
+    return gamepad::success;
+}
+
+static int32_t open_replay(gamepad_context_t* p_context, const char* path, replay_speed_e speed)
+{
+    recording_header_t header;
+
+    p_context->replay = new replay_t;
+    p_context->replay->speed = speed;
+    p_context->replay->data = static_cast<const unsigned char*>(MAP_FAILED);
+    p_context->replay->mappedSize = 0;
+    p_context->replay->nextEvent = 0;
+    p_context->replay->started = false;
+    p_context->replay->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (p_context->replay->fd == -1 || !map_replay(*p_context->replay) || p_context->replay->mappedSize < recording_header_size)
+        return gamepad::failed;
+
+    memcpy(&header, p_context->replay->data, sizeof(header));
+    if (memcmp(header.magic, recording_magic, sizeof(header.magic)) != 0 || header.version != recording_version ||
+        header.header_size != recording_header_size || header.event_size != sizeof(struct input_event))
     {
-        close(p_context->ledFd);
-        p_context->ledFd = -1;
+        return gamepad::failed;
     }
+
+    p_context->capabilities = header.capabilities;
+    return get_gamepad_infos(p_context);
 }
 
-static int32_t internal_create_context(gamepad_context_t** pp_context, const char* device_path)
+// Like add_gamepad_device, the file is opened and mapped without s_gamepad_mutex.
+static int32_t internal_start_gamepad_replay(const char* path, replay_speed_e speed, uint32_t* p_index)
 {
-    *pp_context = new gamepad_context_t;
+    gamepad_context_t* p_context = nullptr;
+    pending_connection_events_t pending;
 
-    if (*pp_context == nullptr)
+    if (init_context(&p_context, path) != gamepad::success || open_replay(p_context, path, speed) != gamepad::success)
+    {
+        internal_free_context(&p_context);
         return gamepad::failed;
+    }
 
-    //for (int i = 0; i < NUM_EFFECTS; ++i)
-    //    (*pp_context)->effects[i].id = -1;
-    (*pp_context)->rumbleEffect.id = -1;
+    {
+        std::lock_guard<gamepad_mutex_t> lk(s_gamepad_mutex);
 
-    (*pp_context)->eventFd = -1;
-    (*pp_context)->ledFd = -1;
-    (*pp_context)->dead = false;
+        for (uint32_t i = 0; i < max_connected_gamepads; ++i)
+        {
+            if (s_gamepads[i] != nullptr)
+                continue;
 
-    memset(&(*pp_context)->gamepadState, 0, sizeof(gamepad_state_t));
+            attach_gamepad_context(i, p_context);
+            ++s_replay_count;
+            *p_index = i;
+            p_context = nullptr;
+            break;
+        }
 
-    (*pp_context)->devicePath = strdup(device_path);
-    if ((*pp_context)->devicePath == nullptr)
-        return gamepad::failed;
+        take_connection_events(pending);
+    }
 
-    int gamepad_fd = open(device_path, O_RDWR | O_NONBLOCK);
-    for (int i = 0; i < 75 && gamepad_fd == -1 && errno == EACCES; ++i)
-    {// When you plugin a new device, it takes some time to set the acls for write access
-     // So sleep for 1ms and retry 75 times for a total of 75ms retry, it success on ~40ms on my computer
-        usleep(1000);
-        gamepad_fd = open(device_path, O_RDWR | O_NONBLOCK);
+    if (p_context != nullptr)
+    {// No free slot.
+        internal_free_context(&p_context);
+        return gamepad::failed;
     }
 
-    if (gamepad_fd == -1)// Try without write permission (no rumble)
-        gamepad_fd = open(device_path, O_RDONLY);
+    dispatch_connection_events(pending);
+    return gamepad::success;
+}
+
+static int32_t internal_stop_gamepad_replay(uint32_t index)
+{
+    gamepad_context_t* p_context = nullptr;
+    pending_connection_events_t pending;
 
-    if (gamepad_fd == -1)
-        return gamepad::failed;
+    {
+        std::lock_guard<gamepad_mutex_t> lk(s_gamepad_mutex);
 
-    (*pp_context)->eventFd = gamepad_fd;
+        if (s_gamepads[index] == nullptr || s_gamepads[index]->replay == nullptr)
+            return gamepad::failed;
 
-    // TODO: led
-    //led_path = "/sys/class/leds/xpad<ID>/brightness";
+        p_context = detach_gamepad_context(index);
+        --s_replay_count;
 
-    return get_gamepad_infos(*pp_context);
+        take_connection_events(pending);
+    }
+
+    internal_free_context(&p_context);
+    dispatch_connection_events(pending);
+    return gamepad::success;
 }
 
-static void internal_free_context(gamepad_context_t** pp_context)
+void internal_free_all_contexts()
 {
-    if (*pp_context == nullptr)
-        return;
+    for (uint32_t i = 0; i < gamepad::max_connected_gamepads; ++i)
+    {
+#if defined(GAMEPAD_USE_IO_URING)
+        if (s_gamepads[i] != nullptr)
+            uring_cancel_read(s_gamepads[i]);
+#endif
+        internal_free_context(&s_gamepads[i]);
+    }
+    s_device_slots.clear();
+    s_replay_count = 0;
+
+#if defined(GAMEPAD_USE_IO_URING)
+    // Waited for here, the ring goes away. They end up in s_released_contexts, a context whose read could not be
+    // cancelled is leaked rather than freed under the kernel.
+    std::vector<gamepad_context_t*> detached_contexts(s_uring_detached_contexts);
+    for (auto p_context : detached_contexts)
+        uring_cancel_read(p_context);
+    s_uring_detached_contexts.clear();
+
+    uring_close();
+#endif
 
-    close_device(*pp_context);
-    if ((*pp_context)->devicePath != nullptr)
+    if (s_epoll_fd != -1)
     {
-        free((*pp_context)->devicePath);
-        (*pp_context)->devicePath = nullptr;
+        close(s_epoll_fd);
+        s_epoll_fd = -1;
     }
-    delete *pp_context;
-    *pp_context = nullptr;
+
+    s_rejected_devices.clear();
 }
 
-static int32_t internal_get_gamepad(uint32_t index, gamepad_context_t** pp_context)
+static void internal_stop_threads()
 {
-    DIR* input_dir;
-    struct dirent* input_dir_entry;
-    uint32_t device_path_len = 32;
-    char* device_path;
-    uint32_t entry_len;
+    if (!s_hotplug_thread.joinable())
+        return;
 
-    if (s_gamepads[index] != nullptr && !s_gamepads[index]->dead)
+    uint64_t value = 1;
+    write(s_hotplug_wakeup_fd, &value, sizeof(value));
+    s_hotplug_thread.join();
+
+    close(s_hotplug_wakeup_fd);
+    s_hotplug_wakeup_fd = -1;
+}
+
+static void reader_thread_proc(int epoll_fd, int uring_fd)
+{
+    struct pollfd fds[3];
+    uint32_t changed_mask[gamepad_mask_words];
+    int32_t res;
+
+    fds[0].fd = s_reader_wakeup_fd;
+    fds[0].events = POLLIN;
+    // An epoll fd is readable when one of its gamepads is.
+    fds[1].fd = epoll_fd;
+    fds[1].events = POLLIN;
+    // The ring is readable when reads completed, -1 (ignored) without io_uring.
+    fds[2].fd = uring_fd;
+    fds[2].events = POLLIN;
+
+    while (true)
     {
-        *pp_context = s_gamepads[index];
+        if (poll(fds, 3, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        // internal_stop_reader_thread asked us to leave.
+        if (fds[0].revents != 0)
+            break;
+
+        pending_connection_events_t pending;
+        {
+            std::lock_guard<gamepad_mutex_t> lk(s_gamepad_mutex);
+
+            res = internal_update_all_gamepads(changed_mask);
+
+            take_connection_events(pending);
+        }
+
+        dispatch_connection_events(pending);
+
+        if (res != gamepad::success)
+            break;
+    }
+}
+
+static int32_t internal_start_reader_thread()
+{
+    int epoll_fd;
+    int uring_fd = -1;
+
+    if (s_reader_thread.joinable())
         return gamepad::success;
+
+    {
+        std::lock_guard<gamepad_mutex_t> lk(s_gamepad_mutex);
+        if (setup_hotplug_monitor() != gamepad::success)
+            return gamepad::failed;
+
+        // s_epoll_fd stays open until free_gamepad_resources, which stops this thread first.
+        epoll_fd = s_epoll_fd;
+#if defined(GAMEPAD_USE_IO_URING)
+        uring_fd = s_uring.fd;
+#endif
     }
-    *pp_context = nullptr;
 
-    // Didn't find the gamepad, going to check for new ones
-    input_dir = opendir("/dev/input");
-    if (input_dir == nullptr)
+    s_reader_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s_reader_wakeup_fd == -1)
         return gamepad::failed;
 
-    device_path = (char*)malloc(sizeof(char) * device_path_len);
-    strcpy(device_path, "/dev/input/");
+    register_threads_cleanup();
+    s_reader_thread = std::thread(reader_thread_proc, epoll_fd, uring_fd);
 
-    while ((input_dir_entry = readdir(input_dir)) != nullptr)
-    {
-        if (strncmp(input_dir_entry->d_name, "event", 5) != 0)
-            continue;
+    std::lock_guard<gamepad_mutex_t> lk(s_gamepad_mutex);
+    s_reader_thread_running = true;
 
-        //                     /dev/input/
-        entry_len = sizeof(char) * (11 + strlen(input_dir_entry->d_name) + 1);
-        if (entry_len > device_path_len)
-        {
-            free(device_path);
-            device_path_len = entry_len;
-            device_path = (char*)malloc(sizeof(char) * device_path_len);
-            strcpy(device_path, "/dev/input/");
-        }
+    return gamepad::success;
+}
+
+static void reader_shard_proc(reader_shard_t* p_shard, uint32_t shard_index, uint32_t shard_count)
+{
+    publish_sequence_t& publish_sequence = s_publish_sequences[1 + shard_index];
+    struct epoll_event events[64];
+    gamepad_state_t old_state;
 
-        strcpy(device_path + 11, input_dir_entry->d_name);
+    while (true)
+    {
+        int event_count = epoll_wait(p_shard->epollFd, events, sizeof(events) / sizeof(*events), -1);
+        if (event_count == -1)
+        {
+            if (errno == EINTR)
+                continue;
 
-        if (!is_gamepad(device_path))
-            continue;
+            break;
+        }
 
-        bool found = false;
-        int free_device = -1;
-        for (uint32_t i = 0; i < max_connected_gamepads; ++i)
+        bool exit = false;
+        std::lock_guard<std::mutex> lk(p_shard->mutex);
+        for (int i = 0; i < event_count; ++i)
         {
-            if (s_gamepads[i] != nullptr)
-            {
-                if (!s_gamepads[i]->dead)
-                {
-                    if (strcmp(s_gamepads[i]->devicePath, device_path) == 0)
-                    {
-                        found = true;
-                        break;
-                    }
-                    continue;
-                }
-                internal_free_context(&s_gamepads[i]);
-            }
-            if (free_device == -1)
+            uint32_t index = events[i].data.u32;
+            // internal_stop_reader_thread asked us to leave.
+            if (index == no_reader_shard)
             {
-                free_device = i;
+                exit = true;
+                continue;
             }
-        }
 
-        if (!found && free_device != -1)
-        {
-            if (internal_create_context(&s_gamepads[free_device], device_path) != gamepad::success)
+            gamepad_context_t* p_context = p_shard->gamepads[index / shard_count];
+            if (p_context == nullptr)
+                continue;
+
+            memcpy(&old_state, &p_context->gamepadState, sizeof(gamepad_state_t));
+            if (p_context->dead || read_gamepad_events(p_context) != gamepad::success)
             {
-                internal_free_context(&s_gamepads[free_device]);
+                stop_polling_gamepad(p_context);
+                unpublish_gamepad_state(index, publish_sequence);
+                continue;
             }
+
+            if (memcmp(&old_state, &p_context->gamepadState, sizeof(gamepad_state_t)) != 0)
+                publish_gamepad_context(index, p_context, publish_sequence);
+
+            record_reports_visible(index);
         }
+
+        if (exit)
+            break;
     }
+}
 
-    free(device_path);
-    closedir(input_dir);
+// Thread N runs on the Nth cpu of the process affinity mask (wrapping around).
+static void pin_reader_thread(std::thread& thread, uint32_t shard_index)
+{
+    cpu_set_t allowed;
+    cpu_set_t cpu;
 
-    if (s_gamepads[index] != nullptr && !s_gamepads[index]->dead)
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0)
+        return;
+
+    uint32_t nth = shard_index % static_cast<uint32_t>(CPU_COUNT(&allowed));
+    for (int i = 0; i < CPU_SETSIZE; ++i)
     {
-        *pp_context = s_gamepads[index];
-        return gamepad::success;
-    }
+        if (!CPU_ISSET(i, &allowed) || nth-- != 0)
+            continue;
 
-    return gamepad::failed;
+        CPU_ZERO(&cpu);
+        CPU_SET(i, &cpu);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(cpu), &cpu);
+        break;
+    }
 }
 
-static inline void set_button_value(uint32_t& buttons, uint32_t value, bool activated)
+static void close_reader_shard(reader_shard_t& shard)
 {
-    if (activated)
-        buttons |= value;
-    else
-        buttons &= ~value;
+    if (shard.epollFd != -1)
+        close(shard.epollFd);
+
+    if (shard.wakeupFd != -1)
+        close(shard.wakeupFd);
+
+    shard.epollFd = -1;
+    shard.wakeupFd = -1;
 }
 
-static int32_t internal_update_gamepad_state(gamepad_context_t* p_context)
+static int32_t internal_start_reader_threads(uint32_t thread_count, bool pin_threads)
 {
-    struct input_event events[32];
-    int num_events;
-    bool r = false;
-    while ((num_events = read(p_context->eventFd, events, (sizeof events))) > 0)
+    std::vector<std::unique_ptr<reader_shard_t>> shards;
+
+    if (s_reader_thread.joinable())
+        return gamepad::failed;
+
+    if (!s_reader_shards.empty())
+        return s_reader_shards.size() == thread_count ? gamepad::success : gamepad::failed;
+
+    for (uint32_t i = 0; i < thread_count; ++i)
+    {
+        std::unique_ptr<reader_shard_t> p_shard(new reader_shard_t);
+        struct epoll_event event;
+
+        p_shard->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        p_shard->wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        p_shard->gamepads.assign((max_connected_gamepads + thread_count - 1) / thread_count, nullptr);
+
+        event.events = EPOLLIN;
+        event.data.u64 = 0;
+        event.data.u32 = no_reader_shard;
+        if (p_shard->epollFd == -1 || p_shard->wakeupFd == -1 || epoll_ctl(p_shard->epollFd, EPOLL_CTL_ADD, p_shard->wakeupFd, &event) == -1)
+        {
+            close_reader_shard(*p_shard);
+            for (auto& p_created : shards)
+                close_reader_shard(*p_created);
+
+            return gamepad::failed;
+        }
+
+        shards.emplace_back(std::move(p_shard));
+    }
+
     {
-        r = true;
-        num_events /= sizeof(*events);
-        for (int i = 0; i < num_events; ++i)
+        std::lock_guard<gamepad_mutex_t> lk(s_gamepad_mutex);
+        if (setup_hotplug_monitor() != gamepad::success)
         {
-            auto const& event_code = events[i].code;
-            auto const& event_value = events[i].value;
-            switch (events[i].type)
-            {
-                case EV_KEY:
-                    switch (event_code)
-                    {
-                        case BTN_A             : set_button_value(p_context->gamepadState.buttons, gamepad::button_a             , event_value); break;
-                        case BTN_B             : set_button_value(p_context->gamepadState.buttons, gamepad::button_b             , event_value); break;
-                        case BTN_X             : set_button_value(p_context->gamepadState.buttons, gamepad::button_x             , event_value); break;
-                        case BTN_Y             : set_button_value(p_context->gamepadState.buttons, gamepad::button_y             , event_value); break;
-                        case BTN_TL            : set_button_value(p_context->gamepadState.buttons, gamepad::button_left_shoulder , event_value); break;
-                        case BTN_TR            : set_button_value(p_context->gamepadState.buttons, gamepad::button_right_shoulder, event_value); break;
-                        case BTN_SELECT        : set_button_value(p_context->gamepadState.buttons, gamepad::button_back          , event_value); break;
-                        case BTN_START         : set_button_value(p_context->gamepadState.buttons, gamepad::button_start         , event_value); break;
-                        case BTN_THUMBL        : set_button_value(p_context->gamepadState.buttons, gamepad::button_left_thumb    , event_value); break;
-                        case BTN_THUMBR        : set_button_value(p_context->gamepadState.buttons, gamepad::button_right_thumb   , event_value); break;
-                        case BTN_MODE          : set_button_value(p_context->gamepadState.buttons, gamepad::button_guide         , event_value); break;
-                        case KEY_RECORD        : set_button_value(p_context->gamepadState.buttons, gamepad::button_share         , event_value); break;
-                        //case BTN_TRIGGER_HAPPY5: set_button_value(p_context->gamepadState.buttons, gamepad::button_paddle1       , event_value); break;
-                        //case BTN_TRIGGER_HAPPY6: set_button_value(p_context->gamepadState.buttons, gamepad::button_paddle2       , event_value); break;
-                        //case BTN_TRIGGER_HAPPY7: set_button_value(p_context->gamepadState.buttons, gamepad::button_paddle3       , event_value); break;
-                        //case BTN_TRIGGER_HAPPY8: set_button_value(p_context->gamepadState.buttons, gamepad::button_paddle4       , event_value); break;
-                    }
-                    break;
+            for (auto& p_shard : shards)
+                close_reader_shard(*p_shard);
 
-                case EV_ABS:
-                    switch (event_code)
-                    {
-                        case ABS_HAT0X:
-                            if (event_value == 0)
-                            {
-                                set_button_value(p_context->gamepadState.buttons, gamepad::button_left, false);
-                                set_button_value(p_context->gamepadState.buttons, gamepad::button_right, false);
-                            }
-                            else
-                            {
-                                set_button_value(p_context->gamepadState.buttons, gamepad::button_left, event_value < 0);
-                                set_button_value(p_context->gamepadState.buttons, gamepad::button_right, event_value > 0);
-                            }
-                            break;
-
-                        case ABS_HAT0Y:
-                            if (event_value == 0)
-                            {
-                                set_button_value(p_context->gamepadState.buttons, gamepad::button_up, false);
-                                set_button_value(p_context->gamepadState.buttons, gamepad::button_down, false);
-                            }
-                            else
-                            {
-                                set_button_value(p_context->gamepadState.buttons, gamepad::button_up, event_value < 0);
-                                set_button_value(p_context->gamepadState.buttons, gamepad::button_down, event_value > 0);
-                            }
-                            break;
-
-                        default:
-                            for (auto const& axis : p_context->axis)
-                            {
-                                if (axis.axis_id == event_code)
-                                {
-                                    *axis.mapped_value = rerange_value(axis.min, axis.max, axis.normalized_min, axis.normalized_max, event_value);
-                                    break;
-                                }
-                            }
-                            break;
+            return gamepad::failed;
+        }
 
-                    }
-                    break;
+        s_reader_shards = std::move(shards);
+        for (uint32_t i = 0; i < max_connected_gamepads; ++i)
+        {
+            gamepad_context_t* p_context = s_gamepads[i];
+            if (p_context == nullptr || p_context->eventFd == -1)
+                continue;
+
+            epoll_ctl(s_epoll_fd, EPOLL_CTL_DEL, p_context->eventFd, nullptr);
+#if defined(GAMEPAD_USE_IO_URING)
+            // A read that completed meanwhile is lost, the state is loaded again like after a SYN_DROPPED.
+            if (p_context->uringArmed)
+            {
+                uring_cancel_read(p_context);
+                resync_gamepad_state(p_context, p_context->monotonicClock ? get_monotonic_us() : 0);
+                publish_gamepad_context(i, p_context);
             }
+#endif
+            give_gamepad_to_reader_shard(i, p_context);
         }
+
+        s_reader_shard_count.store(thread_count, std::memory_order_release);
+        s_reader_thread_running = true;
     }
 
-    if (errno != EWOULDBLOCK && errno != EAGAIN)
+    register_threads_cleanup();
+    // The threads only use their shard, s_reader_shards doesn't change until they are joined.
+    for (uint32_t i = 0; i < thread_count; ++i)
     {
-        p_context->dead = 1;
-        return gamepad::failed;
+        s_reader_shards[i]->thread = std::thread(reader_shard_proc, s_reader_shards[i].get(), i, thread_count);
+        if (pin_threads)
+            pin_reader_thread(s_reader_shards[i]->thread, i);
     }
 
     return gamepad::success;
 }
 
-static int32_t internal_get_gamepad_state(gamepad_context_t* p_context, gamepad_state_t* p_gamepad_state)
-{
-    memcpy(p_gamepad_state, &p_context->gamepadState, sizeof(gamepad_state_t));
-    return gamepad::success;
-}
-
-static int32_t internal_get_gamepad_id(gamepad_context_t* p_context, gamepad_id_t* p_gamepad_id)
-{
-    p_gamepad_id->id = p_context->id.id;
-    return gamepad::success;
-}
-
-static int32_t internal_set_gamepad_vibration(gamepad_context_t* p_context, float left_strength, float right_strength)
+static void stop_reader_shards()
 {
-    struct ff_effect* p_effect = &p_context->rumbleEffect;
-
-    int32_t res;
+    if (s_reader_shards.empty())
+        return;
 
-    if (p_effect->id != -1)
+    uint64_t value = 1;
+    for (auto& p_shard : s_reader_shards)
     {
-        unregister_effect(p_context, p_effect);
+        write(p_shard->wakeupFd, &value, sizeof(value));
+        p_shard->thread.join();
     }
 
-    p_effect->type = FF_RUMBLE;
-    p_effect->id = -1;
-    p_effect->u.rumble.strong_magnitude = static_cast<uint16_t>(left_strength * 65535);
-    p_effect->u.rumble.weak_magnitude = static_cast<uint16_t>(right_strength * 65535);
-    p_effect->replay.length = 0xffffu;
-    p_effect->replay.delay = 0;
-
-    if ((res = register_effect(p_context, p_effect)) != gamepad::success)
+    std::lock_guard<gamepad_mutex_t> lk(s_gamepad_mutex);
+    for (uint32_t i = 0; i < max_connected_gamepads; ++i)
     {
-        //std::cout << "register_effect failed." << std::endl;
-        return res;
+        gamepad_context_t* p_context = s_gamepads[i];
+        if (p_context == nullptr || p_context->readerShard == no_reader_shard)
+            continue;
+
+        take_gamepad_from_reader_shard(i, p_context);
+        if (!p_context->dead)
+        {
+            struct epoll_event event;
+
+            event.events = EPOLLIN;
+            event.data.u64 = 0;
+            event.data.u32 = i;
+            epoll_ctl(s_epoll_fd, EPOLL_CTL_ADD, p_context->eventFd, &event);
+        }
     }
 
-    return play_effect(p_context, p_effect);
+    for (auto& p_shard : s_reader_shards)
+        close_reader_shard(*p_shard);
+
+    s_reader_shards.clear();
+    s_reader_shard_count.store(0, std::memory_order_release);
+    s_reader_thread_running = false;
 }
 
-static int32_t internal_set_gamepad_led(gamepad_context_t* p_context, uint8_t r, uint8_t g, uint8_t b)
+static void internal_stop_reader_thread()
 {
-    return gamepad::failed;
+    stop_reader_shards();
+
+    if (!s_reader_thread.joinable())
+        return;
+
+    uint64_t value = 1;
+    write(s_reader_wakeup_fd, &value, sizeof(value));
+    s_reader_thread.join();
+
+    close(s_reader_wakeup_fd);
+    s_reader_wakeup_fd = -1;
+
+    std::lock_guard<gamepad_mutex_t> lk(s_gamepad_mutex);
+    s_reader_thread_running = false;
 }
 
-void internal_free_all_contexts()
+static std::unique_lock<std::mutex> internal_lock_reader(gamepad_context_t* p_context)
 {
-    for (uint32_t i = 0; i < gamepad::max_connected_gamepads; ++i)
-    {
-        internal_free_context(&s_gamepads[i]);
-    }
+    if (p_context->readerShard == no_reader_shard)
+        return std::unique_lock<std::mutex>();
+
+    return std::unique_lock<std::mutex>(s_reader_shards[p_context->readerShard]->mutex);
 }
 
-#elif defined(GAMEPAD_OS_APPLE)
+#elif defined(GAMEPAD_OS_APPLE) || defined(GAMEPAD_OS_SIMULATED)
 
 #endif
 
@@ -740,36 +740,64 @@ static int32_t internal_create_context(gamepad_context_t** pp_context, IOHIDDevi
 
 static void device_removal_callback(void* inContext, IOReturn inResult, void* inSender, IOHIDDeviceRef inIOHIDDeviceRef)
 {
-    std::lock_guard<std::mutex> lk(s_gamepad_mutex);
-    for (int i = 0; i < max_connected_gamepads; ++i)
+    pending_connection_events_t pending;
+
     {
-        if (s_gamepads[i]->device_handle == inIOHIDDeviceRef)
+        std::lock_guard<gamepad_mutex_t> lk(s_gamepad_mutex);
+        for (int i = 0; i < max_connected_gamepads; ++i)
         {
-            internal_free_context(&s_gamepads[i]);
-            break;
+            if (s_gamepads[i] != nullptr && s_gamepads[i]->device_handle == inIOHIDDeviceRef)
+            {
+                internal_free_context(&s_gamepads[i]);
+                unpublish_gamepad_state(i);
+                queue_connection_event(i, false);
+                break;
+            }
         }
+
+        take_connection_events(pending);
     }
+
+    dispatch_connection_events(pending);
 }
 
 static void device_matching_callback(void* inContext, IOReturn inResult, void* inSender,
                                    IOHIDDeviceRef inIOHIDDeviceRef)
 {
-    std::lock_guard<std::mutex> lk(s_gamepad_mutex);
+    pending_connection_events_t pending;
 
-    // Add a device if it's of a type we want
-    if (IOHIDDeviceConformsTo(inIOHIDDeviceRef, kHIDPage_GenericDesktop, kHIDUsage_GD_Joystick) ||
-        IOHIDDeviceConformsTo(inIOHIDDeviceRef, kHIDPage_GenericDesktop, kHIDUsage_GD_GamePad) ||
-        IOHIDDeviceConformsTo(inIOHIDDeviceRef, kHIDPage_GenericDesktop, kHIDUsage_GD_MultiAxisController))
     {
-        for (int i = 0; i < max_connected_gamepads; ++i)
+        std::lock_guard<gamepad_mutex_t> lk(s_gamepad_mutex);
+
+        // Add a device if it's of a type we want
+        if (IOHIDDeviceConformsTo(inIOHIDDeviceRef, kHIDPage_GenericDesktop, kHIDUsage_GD_Joystick) ||
+            IOHIDDeviceConformsTo(inIOHIDDeviceRef, kHIDPage_GenericDesktop, kHIDUsage_GD_GamePad) ||
+            IOHIDDeviceConformsTo(inIOHIDDeviceRef, kHIDPage_GenericDesktop, kHIDUsage_GD_MultiAxisController))
         {
-            if (s_gamepads[i] == nullptr || s_gamepads[i]->dead)
+            for (int i = 0; i < max_connected_gamepads; ++i)
             {
-                internal_create_context(&s_gamepads[i], inIOHIDDeviceRef);
-                break;
+                if (s_gamepads[i] == nullptr || s_gamepads[i]->dead)
+                {
+                    internal_free_context(&s_gamepads[i]);
+                    if (internal_create_context(&s_gamepads[i], inIOHIDDeviceRef) == gamepad::success)
+                    {
+                        publish_gamepad_context(i, s_gamepads[i]);
+                        queue_connection_event(i, true);
+                    }
+                    else
+                    {
+                        internal_free_context(&s_gamepads[i]);
+                        unpublish_gamepad_state(i);
+                    }
+                    break;
+                }
             }
         }
+
+        take_connection_events(pending);
     }
+
+    dispatch_connection_events(pending);
 }
 
 static int32_t setup_hid_manager()
@@ -796,6 +824,7 @@ static int32_t setup_hid_manager()
     IOHIDManagerRegisterDeviceMatchingCallback(HIDManager, device_matching_callback, nullptr);
     IOHIDManagerRegisterDeviceRemovalCallback(HIDManager, device_removal_callback, nullptr);
 
+    register_threads_cleanup();
     s_hotplug_thread = std::thread([]()
     {
         IOHIDManagerScheduleWithRunLoop(HIDManager, CFRunLoopGetCurrent(), OurRunLoop);
@@ -831,6 +860,12 @@ static int32_t internal_get_gamepad(uint32_t index, gamepad_context_t** pp_conte
     return gamepad::failed;
 }
 
+// The HID manager callbacks attach and publish the gamepads.
+static bool internal_start_discovery()
+{
+    return setup_hid_manager() == gamepad::success;
+}
+
 static int32_t internal_update_gamepad_state(gamepad_context_t* p_context)
 {
     IOHIDValueRef value;
@@ -936,6 +971,38 @@ static int32_t internal_update_gamepad_state(gamepad_context_t* p_context)
     return gamepad::success;
 }
 
+static int32_t internal_update_all_gamepads(uint32_t* p_changed_mask)
+{
+    gamepad_context_t* p_context;
+    gamepad_state_t old_state;
+
+    clear_gamepad_mask(p_changed_mask);
+
+    if (setup_hid_manager() != gamepad::success)
+        return gamepad::failed;
+
+    for (uint32_t i = 0; i < max_connected_gamepads; ++i)
+    {
+        if (s_gamepads[i] == nullptr || s_gamepads[i]->dead)
+            continue;
+
+        p_context = s_gamepads[i];
+        memcpy(&old_state, &p_context->gamepad_state, sizeof(gamepad_state_t));
+        if (internal_update_gamepad_state(p_context) != gamepad::success)
+        {
+            unpublish_gamepad_state(i);
+            set_gamepad_mask_bit(p_changed_mask, i);
+        }
+        else if (memcmp(&old_state, &p_context->gamepad_state, sizeof(gamepad_state_t)) != 0)
+        {
+            publish_gamepad_context(i, p_context);
+            set_gamepad_mask_bit(p_changed_mask, i);
+        }
+    }
+
+    return gamepad::success;
+}
+
 static int32_t internal_get_gamepad_state(gamepad_context_t* p_context, gamepad_state_t* p_gamepad_state)
 {
     memcpy(p_gamepad_state, &p_context->gamepad_state, sizeof(gamepad_state_t));
@@ -958,6 +1025,39 @@ static int32_t internal_set_gamepad_led(gamepad_context_t* p_context, uint8_t r,
     return gamepad::failed;
 }
 
+// Vibration is always sent right away here.
+static int32_t internal_write_gamepad_vibration(gamepad_context_t* p_context, float left_strength, float right_strength)
+{
+    return internal_set_gamepad_vibration(p_context, left_strength, right_strength);
+}
+
+// Not implemented with IOKit yet, the values are only folded into the state.
+static int32_t internal_get_gamepad_events(gamepad_context_t* p_context, gamepad_event_t* p_events, uint32_t max_events, uint32_t* p_event_count, uint32_t* p_dropped_count)
+{
+    return gamepad::failed;
+}
+
+// Recordings are made of evdev events.
+static int32_t internal_start_gamepad_recording(gamepad_context_t* p_context, const char* path)
+{
+    return gamepad::failed;
+}
+
+static int32_t internal_stop_gamepad_recording(gamepad_context_t* p_context)
+{
+    return gamepad::failed;
+}
+
+static int32_t internal_start_gamepad_replay(const char* path, replay_speed_e speed, uint32_t* p_index)
+{
+    return gamepad::failed;
+}
+
+static int32_t internal_stop_gamepad_replay(uint32_t index)
+{
+    return gamepad::failed;
+}
+
 static void internal_free_all_contexts()
 {
     for (uint32_t i = 0; i < gamepad::max_connected_gamepads; ++i)
@@ -967,9 +1067,6 @@ static void internal_free_all_contexts()
 
     if (HIDManager != nullptr)
     {
-        s_stopper.Signal();
-        s_hotplug_thread.join();
-
         // This closes all devices as well
         IOHIDManagerClose(HIDManager, kIOHIDOptionsTypeNone);
         CFRelease(HIDManager);
@@ -977,4 +1074,33 @@ static void internal_free_all_contexts()
     }
 }
 
-}//namespace gamepad
\ No newline at end of file
+static void internal_stop_threads()
+{
+    if (s_hotplug_thread.joinable())
+    {
+        s_stopper.Signal();
+        s_hotplug_thread.join();
+    }
+}
+
+// Input is read by the application thread, there's no reader thread on this platform.
+static int32_t internal_start_reader_thread()
+{
+    return gamepad::failed;
+}
+
+static int32_t internal_start_reader_threads(uint32_t, bool)
+{
+    return gamepad::failed;
+}
+
+static void internal_stop_reader_thread()
+{
+}
+
+static std::unique_lock<std::mutex> internal_lock_reader(gamepad_context_t*)
+{
+    return std::unique_lock<std::mutex>();
+}
+
+}//namespace gamepad
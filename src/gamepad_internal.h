@@ -17,7 +17,10 @@
 
 #pragma once
 
-#if defined(WIN64) || defined(_WIN64) || defined(__MINGW64__) \
+// The simulated backend replaces the OS one, see gamepad_simulated.cpp.
+#if defined(GAMEPAD_SIMULATED_BACKEND)
+    #define GAMEPAD_OS_SIMULATED
+#elif defined(WIN64) || defined(_WIN64) || defined(__MINGW64__) \
  || defined(WIN32) || defined(_WIN32) || defined(__MINGW32__)
     #define GAMEPAD_OS_WINDOWS
 #elif defined(__linux__) || defined(linux)
@@ -36,6 +39,7 @@
 #define WIN32_LEAN_AND_MEAN
 #define VC_EXTRALEAN
 #include <Windows.h>
+#include <intrin.h>
 
 #include <SetupAPI.h>
 #include <winioctl.h>
@@ -160,11 +164,36 @@ struct GamepadState0101
 
 #elif defined(GAMEPAD_OS_LINUX)
 
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
 #include <linux/joystick.h>
+#if defined(GAMEPAD_USE_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 /* Number of bits for 1 unsigned char */
@@ -188,6 +217,11 @@ struct GamepadState0101
 #define NUM_EFFECTS (FF_EFFECT_MAX-FF_EFFECT_MIN+1)
 #define EFFECT_INDEX(EFFECT_ID) (EFFECT_ID-FF_EFFECT_MIN)
 
+#elif defined(GAMEPAD_OS_SIMULATED)
+
+#include <stdlib.h>
+#include <string.h>
+
 #elif defined(GAMEPAD_OS_APPLE)
 
 #include <thread>
@@ -0,0 +1,409 @@
+/* Copyright (C) Nemirtingas
+ * This file is part of gamepad.
+ *
+ * gamepad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * gamepad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gamepad.  If not, see <https://www.gnu.org/licenses/>
+ */
+
+#include <gamepad/gamepad.h>
+
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define GAMEPAD_PROCESSING_SSE2
+    #include <emmintrin.h>
+    #include <immintrin.h>
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+        #define GAMEPAD_PROCESSING_AVX2
+        #define GAMEPAD_TARGET_AVX2
+    #elif defined(__GNUC__) || defined(__clang__)
+        #define GAMEPAD_PROCESSING_AVX2
+        #define GAMEPAD_TARGET_AVX2 __attribute__((target("avx2")))
+    #endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    #define GAMEPAD_PROCESSING_NEON
+    #include <arm_neon.h>
+#endif
+
+namespace gamepad
+{
+
+// The kernels work on columns, padded to a multiple of the widest vector.
+static constexpr uint32_t processing_lanes = 8;
+
+typedef void (*processing_kernel_t)(gamepad_processing_t const& processing, gamepad_states_soa_t const& columns, uint32_t count);
+
+///////////////////////////////////////////////////////////////////////////////
+// Scalar, the reference: the vector kernels run the same operations in the same order so they give the same results.
+
+static inline void scalar_stick_deadzone(deadzone_mode_e mode, float deadzone, float& x, float& y)
+{
+    switch (mode)
+    {
+        case deadzone_mode_e::axial:
+            x = (fabsf(x) <= deadzone ? 0.0f : x);
+            y = (fabsf(y) <= deadzone ? 0.0f : y);
+            break;
+
+        case deadzone_mode_e::radial:
+            if (x * x + y * y <= deadzone * deadzone)
+                x = y = 0.0f;
+            break;
+
+        case deadzone_mode_e::scaled_radial:
+        {
+            float magnitude = sqrtf(x * x + y * y);
+            if (magnitude <= deadzone)
+            {
+                x = y = 0.0f;
+            }
+            else
+            {// Rescale [deadzone, 1.0] to [0.0, 1.0], keeping the direction.
+                float scale = (std::min(magnitude, 1.0f) - deadzone) / ((1.0f - deadzone) * magnitude);
+                x = x * scale;
+                y = y * scale;
+            }
+            break;
+        }
+
+        case deadzone_mode_e::none:
+            break;
+    }
+}
+
+static void process_columns_scalar(gamepad_processing_t const& processing, gamepad_states_soa_t const& columns, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        scalar_stick_deadzone(processing.deadzone_mode, processing.left_thumb_deadzone, columns.lx[i], columns.ly[i]);
+        scalar_stick_deadzone(processing.deadzone_mode, processing.right_thumb_deadzone, columns.rx[i], columns.ry[i]);
+
+        uint32_t buttons = columns.buttons[i] & ~(button_left_trigger | button_right_trigger);
+        if (columns.lt[i] > processing.trigger_threshold)
+            buttons |= button_left_trigger;
+        if (columns.rt[i] > processing.trigger_threshold)
+            buttons |= button_right_trigger;
+
+        columns.buttons[i] = buttons;
+    }
+}
+
+#if defined(GAMEPAD_PROCESSING_SSE2)
+///////////////////////////////////////////////////////////////////////////////
+// SSE2, 4 gamepads at once.
+
+static inline __m128 sse2_abs(__m128 v)
+{
+    return _mm_andnot_ps(_mm_set1_ps(-0.0f), v);
+}
+
+static inline void sse2_stick_deadzone(deadzone_mode_e mode, float deadzone, float* px, float* py)
+{
+    __m128 x = _mm_loadu_ps(px);
+    __m128 y = _mm_loadu_ps(py);
+    __m128 dz = _mm_set1_ps(deadzone);
+
+    switch (mode)
+    {
+        case deadzone_mode_e::axial:
+            x = _mm_andnot_ps(_mm_cmple_ps(sse2_abs(x), dz), x);
+            y = _mm_andnot_ps(_mm_cmple_ps(sse2_abs(y), dz), y);
+            break;
+
+        case deadzone_mode_e::radial:
+        {
+            __m128 inside = _mm_cmple_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(dz, dz));
+            x = _mm_andnot_ps(inside, x);
+            y = _mm_andnot_ps(inside, y);
+            break;
+        }
+
+        case deadzone_mode_e::scaled_radial:
+        {
+            __m128 magnitude = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)));
+            __m128 inside = _mm_cmple_ps(magnitude, dz);
+            // Lanes inside the deadzone might divide by 0, they are masked out anyway.
+            __m128 scale = _mm_div_ps(_mm_sub_ps(_mm_min_ps(magnitude, _mm_set1_ps(1.0f)), dz), _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(1.0f), dz), magnitude));
+            x = _mm_andnot_ps(inside, _mm_mul_ps(x, scale));
+            y = _mm_andnot_ps(inside, _mm_mul_ps(y, scale));
+            break;
+        }
+
+        case deadzone_mode_e::none:
+            return;
+    }
+
+    _mm_storeu_ps(px, x);
+    _mm_storeu_ps(py, y);
+}
+
+static void process_columns_sse2(gamepad_processing_t const& processing, gamepad_states_soa_t const& columns, uint32_t count)
+{
+    const __m128 threshold = _mm_set1_ps(processing.trigger_threshold);
+    const __m128i left_bit = _mm_set1_epi32(static_cast<int>(button_left_trigger));
+    const __m128i right_bit = _mm_set1_epi32(static_cast<int>(button_right_trigger));
+
+    for (uint32_t i = 0; i < count; i += 4)
+    {
+        sse2_stick_deadzone(processing.deadzone_mode, processing.left_thumb_deadzone, columns.lx + i, columns.ly + i);
+        sse2_stick_deadzone(processing.deadzone_mode, processing.right_thumb_deadzone, columns.rx + i, columns.ry + i);
+
+        __m128i buttons = _mm_loadu_si128(reinterpret_cast<__m128i*>(columns.buttons + i));
+        buttons = _mm_andnot_si128(_mm_or_si128(left_bit, right_bit), buttons);
+        buttons = _mm_or_si128(buttons, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(_mm_loadu_ps(columns.lt + i), threshold)), left_bit));
+        buttons = _mm_or_si128(buttons, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(_mm_loadu_ps(columns.rt + i), threshold)), right_bit));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(columns.buttons + i), buttons);
+    }
+}
+#endif
+
+#if defined(GAMEPAD_PROCESSING_AVX2)
+///////////////////////////////////////////////////////////////////////////////
+// AVX2, 8 gamepads at once. Only called when the cpu supports it.
+
+GAMEPAD_TARGET_AVX2 static inline void avx2_stick_deadzone(deadzone_mode_e mode, float deadzone, float* px, float* py)
+{
+    __m256 x = _mm256_loadu_ps(px);
+    __m256 y = _mm256_loadu_ps(py);
+    __m256 dz = _mm256_set1_ps(deadzone);
+
+    switch (mode)
+    {
+        case deadzone_mode_e::axial:
+        {
+            __m256 sign = _mm256_set1_ps(-0.0f);
+            x = _mm256_andnot_ps(_mm256_cmp_ps(_mm256_andnot_ps(sign, x), dz, _CMP_LE_OQ), x);
+            y = _mm256_andnot_ps(_mm256_cmp_ps(_mm256_andnot_ps(sign, y), dz, _CMP_LE_OQ), y);
+            break;
+        }
+
+        case deadzone_mode_e::radial:
+        {
+            __m256 inside = _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), _mm256_mul_ps(dz, dz), _CMP_LE_OQ);
+            x = _mm256_andnot_ps(inside, x);
+            y = _mm256_andnot_ps(inside, y);
+            break;
+        }
+
+        case deadzone_mode_e::scaled_radial:
+        {
+            __m256 magnitude = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)));
+            __m256 inside = _mm256_cmp_ps(magnitude, dz, _CMP_LE_OQ);
+            __m256 scale = _mm256_div_ps(_mm256_sub_ps(_mm256_min_ps(magnitude, _mm256_set1_ps(1.0f)), dz), _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(1.0f), dz), magnitude));
+            x = _mm256_andnot_ps(inside, _mm256_mul_ps(x, scale));
+            y = _mm256_andnot_ps(inside, _mm256_mul_ps(y, scale));
+            break;
+        }
+
+        case deadzone_mode_e::none:
+            return;
+    }
+
+    _mm256_storeu_ps(px, x);
+    _mm256_storeu_ps(py, y);
+}
+
+GAMEPAD_TARGET_AVX2 static void process_columns_avx2(gamepad_processing_t const& processing, gamepad_states_soa_t const& columns, uint32_t count)
+{
+    const __m256 threshold = _mm256_set1_ps(processing.trigger_threshold);
+    const __m256i left_bit = _mm256_set1_epi32(static_cast<int>(button_left_trigger));
+    const __m256i right_bit = _mm256_set1_epi32(static_cast<int>(button_right_trigger));
+
+    for (uint32_t i = 0; i < count; i += 8)
+    {
+        avx2_stick_deadzone(processing.deadzone_mode, processing.left_thumb_deadzone, columns.lx + i, columns.ly + i);
+        avx2_stick_deadzone(processing.deadzone_mode, processing.right_thumb_deadzone, columns.rx + i, columns.ry + i);
+
+        __m256i buttons = _mm256_loadu_si256(reinterpret_cast<__m256i*>(columns.buttons + i));
+        buttons = _mm256_andnot_si256(_mm256_or_si256(left_bit, right_bit), buttons);
+        buttons = _mm256_or_si256(buttons, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(columns.lt + i), threshold, _CMP_GT_OQ)), left_bit));
+        buttons = _mm256_or_si256(buttons, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(columns.rt + i), threshold, _CMP_GT_OQ)), right_bit));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(columns.buttons + i), buttons);
+    }
+}
+
+static bool cpu_has_avx2()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+
+    __cpuid(info, 1);
+    // The OS must save the ymm registers (OSXSAVE and XCR0 bits 1 and 2).
+    if ((info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6) != 6)
+        return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+#endif
+
+#if defined(GAMEPAD_PROCESSING_NEON)
+///////////////////////////////////////////////////////////////////////////////
+// NEON, 4 gamepads at once.
+
+static inline void neon_stick_deadzone(deadzone_mode_e mode, float deadzone, float* px, float* py)
+{
+    float32x4_t x = vld1q_f32(px);
+    float32x4_t y = vld1q_f32(py);
+    float32x4_t dz = vdupq_n_f32(deadzone);
+
+    switch (mode)
+    {
+        case deadzone_mode_e::axial:
+            x = vreinterpretq_f32_u32(vbicq_u32(vreinterpretq_u32_f32(x), vcleq_f32(vabsq_f32(x), dz)));
+            y = vreinterpretq_f32_u32(vbicq_u32(vreinterpretq_u32_f32(y), vcleq_f32(vabsq_f32(y), dz)));
+            break;
+
+        case deadzone_mode_e::radial:
+        {
+            uint32x4_t inside = vcleq_f32(vaddq_f32(vmulq_f32(x, x), vmulq_f32(y, y)), vmulq_f32(dz, dz));
+            x = vreinterpretq_f32_u32(vbicq_u32(vreinterpretq_u32_f32(x), inside));
+            y = vreinterpretq_f32_u32(vbicq_u32(vreinterpretq_u32_f32(y), inside));
+            break;
+        }
+
+        case deadzone_mode_e::scaled_radial:
+        {
+            float32x4_t magnitude = vsqrtq_f32(vaddq_f32(vmulq_f32(x, x), vmulq_f32(y, y)));
+            uint32x4_t inside = vcleq_f32(magnitude, dz);
+            float32x4_t scale = vdivq_f32(vsubq_f32(vminq_f32(magnitude, vdupq_n_f32(1.0f)), dz), vmulq_f32(vsubq_f32(vdupq_n_f32(1.0f), dz), magnitude));
+            x = vreinterpretq_f32_u32(vbicq_u32(vreinterpretq_u32_f32(vmulq_f32(x, scale)), inside));
+            y = vreinterpretq_f32_u32(vbicq_u32(vreinterpretq_u32_f32(vmulq_f32(y, scale)), inside));
+            break;
+        }
+
+        case deadzone_mode_e::none:
+            return;
+    }
+
+    vst1q_f32(px, x);
+    vst1q_f32(py, y);
+}
+
+static void process_columns_neon(gamepad_processing_t const& processing, gamepad_states_soa_t const& columns, uint32_t count)
+{
+    const float32x4_t threshold = vdupq_n_f32(processing.trigger_threshold);
+    const uint32x4_t left_bit = vdupq_n_u32(button_left_trigger);
+    const uint32x4_t right_bit = vdupq_n_u32(button_right_trigger);
+
+    for (uint32_t i = 0; i < count; i += 4)
+    {
+        neon_stick_deadzone(processing.deadzone_mode, processing.left_thumb_deadzone, columns.lx + i, columns.ly + i);
+        neon_stick_deadzone(processing.deadzone_mode, processing.right_thumb_deadzone, columns.rx + i, columns.ry + i);
+
+        uint32x4_t buttons = vbicq_u32(vld1q_u32(columns.buttons + i), vorrq_u32(left_bit, right_bit));
+        buttons = vorrq_u32(buttons, vandq_u32(vcgtq_f32(vld1q_f32(columns.lt + i), threshold), left_bit));
+        buttons = vorrq_u32(buttons, vandq_u32(vcgtq_f32(vld1q_f32(columns.rt + i), threshold), right_bit));
+        vst1q_u32(columns.buttons + i, buttons);
+    }
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Dispatch
+
+// GAMEPAD_SCALAR_PROCESSING forces the scalar kernel (comparisons, cpus with broken vector units).
+static processing_kernel_t select_processing_kernel()
+{
+    if (getenv("GAMEPAD_SCALAR_PROCESSING") != nullptr)
+        return &process_columns_scalar;
+
+#if defined(GAMEPAD_PROCESSING_AVX2)
+    if (cpu_has_avx2())
+        return &process_columns_avx2;
+#endif
+
+#if defined(GAMEPAD_PROCESSING_SSE2)
+    return &process_columns_sse2;
+#elif defined(GAMEPAD_PROCESSING_NEON)
+    return &process_columns_neon;
+#else
+    return &process_columns_scalar;
+#endif
+}
+
+static processing_kernel_t get_processing_kernel()
+{
+    // Thread-safe once initialization.
+    static const processing_kernel_t kernel = select_processing_kernel();
+    return kernel;
+}
+
+void process_gamepad_states(gamepad_processing_t const& processing, gamepad_state_t* p_gamepad_states, uint32_t count)
+{
+    // Columns of a batch of gamepads, transposed from and back to p_gamepad_states.
+    uint32_t buttons[max_connected_gamepads];
+    float lx[max_connected_gamepads];
+    float ly[max_connected_gamepads];
+    float rx[max_connected_gamepads];
+    float ry[max_connected_gamepads];
+    float lt[max_connected_gamepads];
+    float rt[max_connected_gamepads];
+    gamepad_states_soa_t columns = { buttons, lx, ly, rx, ry, lt, rt };
+    processing_kernel_t kernel = get_processing_kernel();
+
+    static_assert(max_connected_gamepads % processing_lanes == 0, "The columns must be a multiple of the widest vector.");
+
+    if (p_gamepad_states == nullptr)
+        return;
+
+    for (uint32_t first = 0; first < count; first += max_connected_gamepads)
+    {
+        uint32_t batch = std::min(count - first, max_connected_gamepads);
+        uint32_t padded = (batch + processing_lanes - 1) / processing_lanes * processing_lanes;
+        gamepad_state_t* p_states = p_gamepad_states + first;
+
+        for (uint32_t i = 0; i < batch; ++i)
+        {
+            buttons[i] = p_states[i].buttons;
+            lx[i] = p_states[i].left_stick.x;
+            ly[i] = p_states[i].left_stick.y;
+            rx[i] = p_states[i].right_stick.x;
+            ry[i] = p_states[i].right_stick.y;
+            lt[i] = p_states[i].left_trigger;
+            rt[i] = p_states[i].right_trigger;
+        }
+        for (uint32_t i = batch; i < padded; ++i)
+        {
+            buttons[i] = 0;
+            lx[i] = ly[i] = rx[i] = ry[i] = lt[i] = rt[i] = 0.0f;
+        }
+
+        kernel(processing, columns, padded);
+
+        for (uint32_t i = 0; i < batch; ++i)
+        {
+            p_states[i].buttons = buttons[i];
+            p_states[i].left_stick.x = lx[i];
+            p_states[i].left_stick.y = ly[i];
+            p_states[i].right_stick.x = rx[i];
+            p_states[i].right_stick.y = ry[i];
+        }
+    }
+}
+
+void process_gamepad_states(gamepad_processing_t const& processing, gamepad_states_soa_t const& states)
+{
+    get_processing_kernel()(processing, states, max_connected_gamepads);
+}
+
+}// namespace gamepad
@@ -0,0 +1,520 @@
+/* Copyright (C) Nemirtingas
+ * This file is part of gamepad.
+ *
+ * gamepad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * gamepad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gamepad.  If not, see <https://www.gnu.org/licenses/>
+ */
+
+// In-memory backend, built instead of the OS one with GAMEPAD_SIMULATED_BACKEND (like gamepad.mm on Apple).
+#include "gamepad.cpp"
+
+#include <gamepad/gamepad_simulation.h>
+
+namespace gamepad {
+
+struct simulated_report_t
+{
+    uint64_t timestamp_us;
+    gamepad_state_t state;
+};
+
+// What the simulation plugged in a slot.
+struct simulated_slot_t
+{
+    bool connected;
+    // Bumped on every connection, a context made for an older one is replaced.
+    uint32_t generation;
+    gamepad_id_t id;
+    std::vector<simulated_report_t> reports;
+};
+
+struct gamepad_context_t
+{
+    uint8_t      dead;
+    uint32_t     index;
+    uint32_t     generation;
+    gamepad_id_t id;
+
+    // Swapped with the slot reports on update, both keep their allocation.
+    std::vector<simulated_report_t> reports;
+    float rumbleLeft;
+    float rumbleRight;
+
+    gamepad_state_t gamepadState;
+    gamepad_event_queue_t eventQueue;
+};
+
+// Lock order: s_gamepad_mutex, then s_simulation_mutex. The simulation functions only take the latter.
+static std::mutex s_simulation_mutex;
+static simulated_slot_t s_simulated_slots[max_connected_gamepads];
+// No simulated gamepad was ever plugged past it, the updates stop there.
+static std::atomic<uint32_t> s_simulated_slot_count(0);
+
+// Guarded by s_gamepad_mutex.
+static simulated_rumble_sink_t s_simulated_rumble_sink = nullptr;
+static void* s_simulated_rumble_sink_param = nullptr;
+
+static std::mutex s_simulation_thread_mutex;
+static std::condition_variable s_simulation_cv;
+static std::thread s_simulation_thread;
+// Guarded by s_simulation_mutex.
+static bool s_simulation_exit = false;
+
+static int32_t internal_create_context(gamepad_context_t** pp_context, uint32_t index, uint32_t generation, gamepad_id_t const& id)
+{
+    *pp_context = new gamepad_context_t;
+
+    if (*pp_context == nullptr)
+        return gamepad::failed;
+
+    (*pp_context)->dead = false;
+    (*pp_context)->index = index;
+    (*pp_context)->generation = generation;
+    (*pp_context)->id.id = id.id;
+    (*pp_context)->rumbleLeft = 0.0f;
+    (*pp_context)->rumbleRight = 0.0f;
+
+    memset(&(*pp_context)->gamepadState, 0, sizeof(gamepad_state_t));
+    reset_event_queue((*pp_context)->eventQueue);
+
+    return gamepad::success;
+}
+
+static void internal_free_context(gamepad_context_t** pp_context)
+{
+    if (*pp_context == nullptr)
+        return;
+
+    delete *pp_context;
+    *pp_context = nullptr;
+}
+
+// Must be called with s_gamepad_mutex held, brings the slot context in line with the simulated slot.
+static void sync_simulated_slot(uint32_t index)
+{
+    bool connected;
+    uint32_t generation;
+    gamepad_id_t id;
+
+    {
+        std::lock_guard<std::mutex> lk(s_simulation_mutex);
+        connected = s_simulated_slots[index].connected;
+        generation = s_simulated_slots[index].generation;
+        id.id = s_simulated_slots[index].id.id;
+    }
+
+    if (s_gamepads[index] != nullptr && (!connected || s_gamepads[index]->generation != generation))
+    {
+        internal_free_context(&s_gamepads[index]);
+        unpublish_gamepad_state(index);
+        queue_connection_event(index, false);
+    }
+
+    if (s_gamepads[index] == nullptr && connected)
+    {
+        if (internal_create_context(&s_gamepads[index], index, generation, id) != gamepad::success)
+        {
+            internal_free_context(&s_gamepads[index]);
+        }
+        else
+        {
+            reset_latency_stats(index);
+            publish_gamepad_context(index, s_gamepads[index]);
+            queue_connection_event(index, true);
+        }
+    }
+}
+
+static int32_t internal_get_gamepad(uint32_t index, gamepad_context_t** pp_context)
+{
+    sync_simulated_slot(index);
+
+    *pp_context = s_gamepads[index];
+    return *pp_context != nullptr ? gamepad::success : gamepad::failed;
+}
+
+// The updates bring the slots in line with the simulation, like the hotplug thread of a real backend.
+static bool internal_start_discovery()
+{
+    return true;
+}
+
+// Queues the events a device would have sent to go from the current state to the report.
+static void apply_simulated_report(gamepad_context_t* p_context, simulated_report_t const& report)
+{
+    gamepad_state_t& state = p_context->gamepadState;
+    float const old_axes[] = { state.left_stick.x, state.left_stick.y, state.right_stick.x, state.right_stick.y, state.left_trigger, state.right_trigger };
+    float const new_axes[] = { report.state.left_stick.x, report.state.left_stick.y, report.state.right_stick.x, report.state.right_stick.y, report.state.left_trigger, report.state.right_trigger };
+
+    for (uint32_t i = 0; i < sizeof(old_axes) / sizeof(*old_axes); ++i)
+    {
+        if (old_axes[i] != new_axes[i])
+            push_axis_event(p_context->eventQueue, report.timestamp_us, static_cast<gamepad_event_t::axis_e>(i), new_axes[i]);
+    }
+
+    if (state.buttons != report.state.buttons)
+        push_button_events(p_context->eventQueue, report.timestamp_us, state.buttons, report.state.buttons);
+
+    state = report.state;
+}
+
+static int32_t internal_update_gamepad_state(gamepad_context_t* p_context)
+{
+    {
+        std::lock_guard<std::mutex> lk(s_simulation_mutex);
+        simulated_slot_t& slot = s_simulated_slots[p_context->index];
+        if (!slot.connected || slot.generation != p_context->generation)
+        {
+            p_context->dead = 1;
+            return gamepad::failed;
+        }
+
+        p_context->reports.swap(slot.reports);
+    }
+
+    uint64_t read_us = p_context->reports.empty() ? 0 : get_monotonic_us();
+    for (simulated_report_t const& report : p_context->reports)
+    {
+        record_report_read(get_latency_stats(p_context->index), report.timestamp_us, read_us);
+        apply_simulated_report(p_context, report);
+    }
+
+    p_context->reports.clear();
+    return gamepad::success;
+}
+
+static int32_t internal_update_all_gamepads(uint32_t* p_changed_mask)
+{
+    gamepad_state_t old_state;
+
+    clear_gamepad_mask(p_changed_mask);
+
+    const uint32_t slot_count = s_simulated_slot_count.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i < slot_count; ++i)
+    {
+        gamepad_context_t* p_context = s_gamepads[i];
+
+        sync_simulated_slot(i);
+        if (s_gamepads[i] != p_context)
+            set_gamepad_mask_bit(p_changed_mask, i);
+
+        p_context = s_gamepads[i];
+        if (p_context == nullptr)
+            continue;
+
+        memcpy(&old_state, &p_context->gamepadState, sizeof(gamepad_state_t));
+        if (internal_update_gamepad_state(p_context) != gamepad::success)
+        {
+            unpublish_gamepad_state(i);
+            set_gamepad_mask_bit(p_changed_mask, i);
+        }
+        else if (memcmp(&old_state, &p_context->gamepadState, sizeof(gamepad_state_t)) != 0)
+        {
+            publish_gamepad_context(i, p_context);
+            set_gamepad_mask_bit(p_changed_mask, i);
+        }
+        record_reports_visible(i);
+    }
+
+    return gamepad::success;
+}
+
+static int32_t internal_get_gamepad_state(gamepad_context_t* p_context, gamepad_state_t* p_gamepad_state)
+{
+    memcpy(p_gamepad_state, &p_context->gamepadState, sizeof(gamepad_state_t));
+    return gamepad::success;
+}
+
+static int32_t internal_get_gamepad_id(gamepad_context_t* p_context, gamepad_id_t* p_gamepad_id)
+{
+    p_gamepad_id->id = p_context->id.id;
+    return gamepad::success;
+}
+
+static int32_t internal_set_gamepad_vibration(gamepad_context_t* p_context, float left_strength, float right_strength)
+{
+    p_context->rumbleLeft = left_strength;
+    p_context->rumbleRight = right_strength;
+
+    if (s_simulated_rumble_sink != nullptr)
+        s_simulated_rumble_sink(p_context->index, left_strength, right_strength, s_simulated_rumble_sink_param);
+
+    return gamepad::success;
+}
+
+// The simulated motors have no frame to wait for.
+static int32_t internal_write_gamepad_vibration(gamepad_context_t* p_context, float left_strength, float right_strength)
+{
+    return internal_set_gamepad_vibration(p_context, left_strength, right_strength);
+}
+
+static int32_t internal_set_gamepad_led(gamepad_context_t*, uint8_t, uint8_t, uint8_t)
+{
+    return gamepad::failed;
+}
+
+static int32_t internal_get_gamepad_events(gamepad_context_t* p_context, gamepad_event_t* p_events, uint32_t max_events, uint32_t* p_event_count, uint32_t* p_dropped_count)
+{
+    *p_event_count = pop_events(p_context->eventQueue, p_events, max_events, p_dropped_count);
+    return gamepad::success;
+}
+
+// Recordings are made of evdev events.
+static int32_t internal_start_gamepad_recording(gamepad_context_t*, const char*)
+{
+    return gamepad::failed;
+}
+
+static int32_t internal_stop_gamepad_recording(gamepad_context_t*)
+{
+    return gamepad::failed;
+}
+
+static int32_t internal_start_gamepad_replay(const char*, replay_speed_e, uint32_t*)
+{
+    return gamepad::failed;
+}
+
+static int32_t internal_stop_gamepad_replay(uint32_t)
+{
+    return gamepad::failed;
+}
+
+static void internal_free_all_contexts()
+{
+    for (uint32_t i = 0; i < gamepad::max_connected_gamepads; ++i)
+    {
+        internal_free_context(&s_gamepads[i]);
+    }
+}
+
+static void internal_stop_threads()
+{
+    stop_gamepad_simulation();
+}
+
+// The reports are applied by the update functions, there's no reader thread here.
+static int32_t internal_start_reader_thread()
+{
+    return gamepad::failed;
+}
+
+static int32_t internal_start_reader_threads(uint32_t, bool)
+{
+    return gamepad::failed;
+}
+
+static void internal_stop_reader_thread()
+{
+}
+
+static std::unique_lock<std::mutex> internal_lock_reader(gamepad_context_t*)
+{
+    return std::unique_lock<std::mutex>();
+}
+
+int32_t connect_simulated_gamepad(uint32_t index, gamepad_id_t const& id)
+{
+    if (index >= gamepad::max_connected_gamepads)
+        return gamepad::invalid_parameter;
+
+    std::lock_guard<std::mutex> lk(s_simulation_mutex);
+    simulated_slot_t& slot = s_simulated_slots[index];
+    if (slot.connected)
+        return gamepad::failed;
+
+    slot.connected = true;
+    ++slot.generation;
+    if (s_simulated_slot_count.load(std::memory_order_relaxed) <= index)
+        s_simulated_slot_count.store(index + 1, std::memory_order_relaxed);
+    slot.id.id = id.id;
+    slot.reports.clear();
+    return gamepad::success;
+}
+
+int32_t disconnect_simulated_gamepad(uint32_t index)
+{
+    if (index >= gamepad::max_connected_gamepads)
+        return gamepad::invalid_parameter;
+
+    std::lock_guard<std::mutex> lk(s_simulation_mutex);
+    simulated_slot_t& slot = s_simulated_slots[index];
+    if (!slot.connected)
+        return gamepad::failed;
+
+    slot.connected = false;
+    slot.reports.clear();
+    return gamepad::success;
+}
+
+int32_t push_simulated_gamepad_reports(uint32_t index, gamepad_state_t const* p_reports, uint32_t report_count)
+{
+    if (index >= gamepad::max_connected_gamepads || (p_reports == nullptr && report_count != 0))
+        return gamepad::invalid_parameter;
+
+    simulated_report_t report;
+    report.timestamp_us = get_monotonic_us();
+
+    std::lock_guard<std::mutex> lk(s_simulation_mutex);
+    simulated_slot_t& slot = s_simulated_slots[index];
+    if (!slot.connected)
+        return gamepad::failed;
+
+    for (uint32_t i = 0; i < report_count; ++i)
+    {
+        report.state = p_reports[i];
+        slot.reports.emplace_back(report);
+    }
+
+    // Nobody updated the gamepad for a while: drop the oldest half at once, the cost stays constant per report.
+    if (slot.reports.size() > simulated_report_queue_size)
+        slot.reports.erase(slot.reports.begin(), slot.reports.end() - simulated_report_queue_size / 2);
+
+    return gamepad::success;
+}
+
+int32_t set_simulated_rumble_sink(simulated_rumble_sink_t sink, void* user_param)
+{
+    std::lock_guard<gamepad_mutex_t> lk(s_gamepad_mutex);
+    s_simulated_rumble_sink = sink;
+    s_simulated_rumble_sink_param = user_param;
+    return gamepad::success;
+}
+
+// Sticks sweeping their range, triggers ramping and a button toggling every 8 reports.
+static void make_simulated_report(uint32_t report_number, uint32_t index, gamepad_state_t& state)
+{
+    float value = static_cast<float>(((report_number + index * 4099) * 97) % 65536) / 32767.5f - 1.0f;
+
+    state.buttons = (report_number & 8) ? gamepad::button_a : gamepad::button_none;
+    state.left_stick.x = value;
+    state.left_stick.y = -value;
+    state.right_stick.x = value;
+    state.right_stick.y = -value;
+    state.left_trigger = static_cast<float>(report_number % 256) / 255.0f;
+    state.right_trigger = static_cast<float>((report_number + 128) % 256) / 255.0f;
+}
+
+static void simulation_thread_proc(gamepad_simulation_t simulation)
+{
+    using clock = std::chrono::steady_clock;
+
+    const clock::duration report_period = std::chrono::microseconds(uint64_t(1000000) * simulation.report_burst_size / simulation.report_rate_hz);
+    const clock::duration rumble_period = std::chrono::microseconds(simulation.rumble_rate_hz != 0 ? 1000000 / simulation.rumble_rate_hz : 0);
+    const clock::duration reconnect_period = std::chrono::milliseconds(simulation.reconnect_period_ms);
+    clock::time_point next_report = clock::now();
+    clock::time_point next_rumble = next_report + rumble_period;
+    clock::time_point next_reconnect = next_report + reconnect_period;
+    std::vector<gamepad_state_t> reports(simulation.report_burst_size);
+    uint32_t report_number = 0;
+    uint32_t rumble_number = 0;
+    uint32_t reconnect_index = 0;
+
+    while (true)
+    {
+        clock::time_point next = next_report;
+        if (simulation.rumble_rate_hz != 0)
+            next = std::min(next, next_rumble);
+        if (simulation.reconnect_period_ms != 0)
+            next = std::min(next, next_reconnect);
+
+        {
+            std::unique_lock<std::mutex> lk(s_simulation_mutex);
+            if (s_simulation_cv.wait_until(lk, next, []() { return s_simulation_exit; }))
+                break;
+        }
+
+        // Late deadlines are not made up for, the rates are upper bounds.
+        clock::time_point now = clock::now();
+        if (now >= next_report)
+        {
+            for (uint32_t i = 0; i < simulation.gamepad_count; ++i)
+            {
+                for (uint32_t j = 0; j < simulation.report_burst_size; ++j)
+                    make_simulated_report(report_number + j, i, reports[j]);
+
+                push_simulated_gamepad_reports(i, reports.data(), simulation.report_burst_size);
+            }
+            report_number += simulation.report_burst_size;
+            next_report = std::max(next_report + report_period, now);
+        }
+
+        if (simulation.rumble_rate_hz != 0 && now >= next_rumble)
+        {
+            float strength = (rumble_number++ & 1) ? 1.0f : 0.0f;
+            for (uint32_t i = 0; i < simulation.gamepad_count; ++i)
+                set_gamepad_vibration(i, strength, 1.0f - strength);
+
+            next_rumble = std::max(next_rumble + rumble_period, now);
+        }
+
+        if (simulation.reconnect_period_ms != 0 && now >= next_reconnect)
+        {
+            gamepad_id_t id;
+            {
+                std::lock_guard<std::mutex> lk(s_simulation_mutex);
+                id.id = s_simulated_slots[reconnect_index].id.id;
+            }
+            disconnect_simulated_gamepad(reconnect_index);
+            connect_simulated_gamepad(reconnect_index, id);
+
+            reconnect_index = (reconnect_index + 1) % simulation.gamepad_count;
+            next_reconnect = std::max(next_reconnect + reconnect_period, now);
+        }
+    }
+}
+
+int32_t start_gamepad_simulation(gamepad_simulation_t const& simulation)
+{
+    if (simulation.gamepad_count == 0 || simulation.gamepad_count > gamepad::max_connected_gamepads ||
+        simulation.report_rate_hz == 0 || simulation.report_burst_size == 0 || simulation.rumble_rate_hz > 1000000)
+    {
+        return gamepad::invalid_parameter;
+    }
+
+    std::lock_guard<std::mutex> lk(s_simulation_thread_mutex);
+    if (s_simulation_thread.joinable())
+        return gamepad::failed;
+
+    gamepad_id_t id;
+    id.id = 0;
+    id.vendorID = 0x045e;
+    id.productID = 0x028e;
+    for (uint32_t i = 0; i < simulation.gamepad_count; ++i)
+        connect_simulated_gamepad(i, id);
+
+    {
+        std::lock_guard<std::mutex> simulation_lk(s_simulation_mutex);
+        s_simulation_exit = false;
+    }
+    register_threads_cleanup();
+    s_simulation_thread = std::thread(simulation_thread_proc, simulation);
+    return gamepad::success;
+}
+
+int32_t stop_gamepad_simulation()
+{
+    std::lock_guard<std::mutex> lk(s_simulation_thread_mutex);
+    if (!s_simulation_thread.joinable())
+        return gamepad::success;
+
+    {
+        std::lock_guard<std::mutex> simulation_lk(s_simulation_mutex);
+        s_simulation_exit = true;
+    }
+    s_simulation_cv.notify_all();
+    s_simulation_thread.join();
+    return gamepad::success;
+}
+
+}// namespace gamepad